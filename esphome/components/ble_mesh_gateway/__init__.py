@@ -3,15 +3,33 @@ import esphome.config_validation as cv
 from esphome.const import CONF_ID
 
 DEPENDENCIES = ['esp32']
+AUTO_LOAD = ['mesh_core']
+
+CONF_MAX_RATE = 'max_rate'
+CONF_BURST = 'burst'
+CONF_MIN_INTERVAL = 'min_interval'
+CONF_STATUS_GROUP = 'status_group'
 
 ble_mesh_gateway_ns = cg.esphome_ns.namespace('ble_mesh_gateway')
 BleMeshGateway = ble_mesh_gateway_ns.class_('BleMeshGateway', cg.Component)
 
 CONFIG_SCHEMA = cv.Schema({
     cv.GenerateID(): cv.declare_id(BleMeshGateway),
+    # Gateway-wide message budget (token bucket) shared by all lamps
+    cv.Optional(CONF_MAX_RATE, default=20.0): cv.positive_float,
+    cv.Optional(CONF_BURST, default=10): cv.int_range(min=1, max=100),
+    # Minimum gap between two messages to the same lamp
+    cv.Optional(CONF_MIN_INTERVAL, default='100ms'): cv.positive_time_period_milliseconds,
+    # Group the lamps publish their status to (configured in the provisioning app)
+    cv.Optional(CONF_STATUS_GROUP): cv.All(cv.hex_uint16_t, cv.Range(min=0xC000, max=0xFEFF)),
 }).extend(cv.COMPONENT_SCHEMA)
 
 async def to_code(config):
     var = cg.new_Pvariable(config[CONF_ID])
     await cg.register_component(var, config)
+    cg.add(var.set_max_rate(config[CONF_MAX_RATE]))
+    cg.add(var.set_burst(config[CONF_BURST]))
+    cg.add(var.set_min_interval(config[CONF_MIN_INTERVAL].total_milliseconds))
+    if CONF_STATUS_GROUP in config:
+        cg.add(var.set_status_group(config[CONF_STATUS_GROUP]))
     cg.add_global(cg.RawStatement('#include "esphome/components/ble_mesh_gateway/ble_mesh_gateway.h"'))
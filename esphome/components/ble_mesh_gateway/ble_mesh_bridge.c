@@ -1,29 +1,15 @@
-// Define LOG_LOCAL_LEVEL BEFORE including esp_log.h
-// This is required for ESP_LOGx macros to work in C files
-#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
-
 #include "ble_mesh_bridge.h"
 
+#include "../mesh_core/mesh_core.h"
 #include "esp_bt.h"
-#include "esp_bt_main.h"
-#include "esp_log.h"
-#include "esp_mac.h"
-#include "nvs.h"
-#include "nvs_flash.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include <stdio.h>
 #include <string.h>
 
-#include "esp_ble_mesh_common_api.h"
-#include "esp_ble_mesh_config_model_api.h"
-#include "esp_ble_mesh_defs.h"
-#include "esp_ble_mesh_generic_model_api.h"
-#include "esp_ble_mesh_lighting_model_api.h"
-#include "esp_ble_mesh_local_data_operation_api.h"
-#include "esp_ble_mesh_networking_api.h"
-#include "esp_ble_mesh_provisioning_api.h"
-
 static const char *TAG = "ble_mesh_bridge";
-#define CID_ESP 0x02E5
 #define NVS_MESH_INFO_KEY "mesh_info_clean"
+#define STATE_SLOTS 32
 
 // Custom logging macros that work with ESPHome's logging system
 // ESP-IDF's ESP_LOGx macros don't appear in ESPHome's log output from C files
@@ -31,127 +17,90 @@ static const char *TAG = "ble_mesh_bridge";
 #define LOG_W(tag, fmt, ...) printf("[W][%s]: " fmt "\n", tag, ##__VA_ARGS__)
 #define LOG_E(tag, fmt, ...) printf("[E][%s]: " fmt "\n", tag, ##__VA_ARGS__)
 
-// --- State ---
-typedef struct {
-  uint16_t net_idx;
-  uint16_t app_idx;
-  uint8_t tid;
-} __attribute__((packed)) mesh_app_state_t;
-
-static mesh_app_state_t s_app_state = {
-    .net_idx = ESP_BLE_MESH_KEY_UNUSED,
-    .app_idx = ESP_BLE_MESH_KEY_UNUSED,
-    .tid = 0,
-};
-
-static uint8_t s_dev_uuid[16] = {0};
-
-// --- Model Definitions ---
-static esp_ble_mesh_cfg_srv_t config_server = {
-    .relay = ESP_BLE_MESH_RELAY_DISABLED,
-    .beacon = ESP_BLE_MESH_BEACON_ENABLED,
-    .friend_state = ESP_BLE_MESH_FRIEND_NOT_SUPPORTED,
-    .gatt_proxy = ESP_BLE_MESH_GATT_PROXY_ENABLED,
-    .default_ttl = 7,
-    .net_transmit = ESP_BLE_MESH_TRANSMIT(4, 20),
-    .relay_retransmit = ESP_BLE_MESH_TRANSMIT(4, 20),
-};
-
-static esp_ble_mesh_client_t onoff_client;
-static esp_ble_mesh_client_t level_client;
-static esp_ble_mesh_client_t light_client;
-static esp_ble_mesh_client_t hsl_client;
-
-ESP_BLE_MESH_MODEL_PUB_DEFINE(onoff_cli_pub, 2 + 2, ROLE_NODE);
-ESP_BLE_MESH_MODEL_PUB_DEFINE(level_cli_pub, 2 + 2, ROLE_NODE);
-ESP_BLE_MESH_MODEL_PUB_DEFINE(light_cli_pub, 2 + 2, ROLE_NODE);
-ESP_BLE_MESH_MODEL_PUB_DEFINE(hsl_cli_pub, 2 + 2, ROLE_NODE);
-
-static esp_ble_mesh_model_t root_models[] = {
-    ESP_BLE_MESH_MODEL_CFG_SRV(&config_server),
-    ESP_BLE_MESH_MODEL_GEN_ONOFF_CLI(&onoff_cli_pub, &onoff_client),
-    ESP_BLE_MESH_MODEL_GEN_LEVEL_CLI(&level_cli_pub, &level_client),
-    ESP_BLE_MESH_MODEL_LIGHT_LIGHTNESS_CLI(&light_cli_pub, &light_client),
-    ESP_BLE_MESH_MODEL_LIGHT_HSL_CLI(&hsl_cli_pub, &hsl_client),
-};
-
-static esp_ble_mesh_elem_t elements[] = {
-    ESP_BLE_MESH_ELEMENT(0, root_models, ESP_BLE_MESH_MODEL_NONE),
-};
-
-static esp_ble_mesh_comp_t composition = {
-    .cid = CID_ESP,
-    .elements = elements,
-    .element_count = ARRAY_SIZE(elements),
-};
+// --- Reported State ---
+// Filled from the BLE Mesh task, read from the ESPHome loop.
 
-static esp_ble_mesh_prov_t provision = {
-    .uuid = s_dev_uuid,
-    .output_size = 0,
-    .output_actions = 0,
-};
-
-// --- NVS Helper ---
-static void mesh_info_store(void) {
-  nvs_handle_t handle;
-  if (nvs_open("ble_mesh", NVS_READWRITE, &handle) == ESP_OK) {
-    nvs_set_blob(handle, NVS_MESH_INFO_KEY, &s_app_state, sizeof(s_app_state));
-    nvs_commit(handle);
-    nvs_close(handle);
+typedef struct {
+  uint16_t addr; // 0 = free
+  bool changed;
+  ble_mesh_bridge_state_t state;
+} state_slot_t;
+
+static state_slot_t s_states[STATE_SLOTS];
+static portMUX_TYPE s_state_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Call with s_state_lock held
+static state_slot_t *state_slot(uint16_t addr, bool create) {
+  state_slot_t *free_slot = NULL;
+  for (int i = 0; i < STATE_SLOTS; i++) {
+    if (s_states[i].addr == addr)
+      return &s_states[i];
+    if (s_states[i].addr == 0 && free_slot == NULL)
+      free_slot = &s_states[i];
   }
+  if (!create || free_slot == NULL)
+    return NULL;
+  memset(free_slot, 0, sizeof(*free_slot));
+  free_slot->addr = addr;
+  return free_slot;
 }
 
-static void mesh_info_restore(void) {
-  nvs_handle_t handle;
-  if (nvs_open("ble_mesh", NVS_READONLY, &handle) == ESP_OK) {
-    size_t len = sizeof(s_app_state);
-    if (nvs_get_blob(handle, NVS_MESH_INFO_KEY, &s_app_state, &len) == ESP_OK) {
-      ESP_LOGI(TAG, "Restored Mesh State: NetKey=0x%04X, AppKey=0x%04X",
-               s_app_state.net_idx, s_app_state.app_idx);
+static void on_status(const mesh_core_status_t *status) {
+  portENTER_CRITICAL(&s_state_lock);
+  state_slot_t *slot = state_slot(status->addr, true);
+  if (slot != NULL) {
+    ble_mesh_bridge_state_t *st = &slot->state;
+    switch (status->type) {
+    case MESH_MSG_ONOFF:
+      st->on = status->onoff != 0;
+      break;
+    case MESH_MSG_LIGHTNESS:
+      st->on = status->lightness > 0;
+      if (status->lightness > 0) {
+        st->has_lightness = true;
+        st->lightness = status->lightness;
+      }
+      break;
+    case MESH_MSG_HSL:
+      st->on = status->hsl.lightness > 0;
+      if (status->hsl.lightness > 0) {
+        st->has_hsl = true;
+        st->hsl_lightness = status->hsl.lightness;
+        st->hue = status->hsl.hue;
+        st->saturation = status->hsl.saturation;
+      }
+      break;
+    default:
+      break;
     }
-    nvs_close(handle);
-  }
-}
-
-// --- Callbacks ---
-static void prov_callback(esp_ble_mesh_prov_cb_event_t event,
-                          esp_ble_mesh_prov_cb_param_t *param) {
-  switch (event) {
-  case ESP_BLE_MESH_PROV_REGISTER_COMP_EVT:
-    ESP_LOGI(TAG, "Registered Composition");
-    break;
-  case ESP_BLE_MESH_NODE_PROV_COMPLETE_EVT:
-    ESP_LOGI(TAG, "Provisioning Complete. NetKey Index: 0x%04X",
-             param->node_prov_complete.net_idx);
-    s_app_state.net_idx = param->node_prov_complete.net_idx;
-    mesh_info_store();
-    break;
-  default:
-    break;
+    st->last_seen_ms = (uint32_t) (esp_timer_get_time() / 1000);
+    slot->changed = true;
   }
+  portEXIT_CRITICAL(&s_state_lock);
 }
 
-static void config_server_callback(esp_ble_mesh_cfg_server_cb_event_t event,
-                                   esp_ble_mesh_cfg_server_cb_param_t *param) {
-  if (event == ESP_BLE_MESH_CFG_SERVER_STATE_CHANGE_EVT) {
-    if (param->ctx.recv_op == ESP_BLE_MESH_MODEL_OP_MODEL_APP_BIND) {
-      ESP_LOGI(TAG, "Model Bound to AppKey 0x%04X",
-               param->value.state_change.mod_app_bind.app_idx);
-      s_app_state.app_idx = param->value.state_change.mod_app_bind.app_idx;
-      mesh_info_store();
+bool ble_mesh_bridge_next_state(uint16_t *addr, ble_mesh_bridge_state_t *out) {
+  bool found = false;
+  portENTER_CRITICAL(&s_state_lock);
+  for (int i = 0; i < STATE_SLOTS && !found; i++) {
+    if (s_states[i].addr != 0 && s_states[i].changed) {
+      s_states[i].changed = false;
+      *addr = s_states[i].addr;
+      *out = s_states[i].state;
+      found = true;
     }
   }
+  portEXIT_CRITICAL(&s_state_lock);
+  return found;
 }
 
-static void
-generic_client_callback(esp_ble_mesh_generic_client_cb_event_t event,
-                        esp_ble_mesh_generic_client_cb_param_t *param) {
-  // Log function placeholder
-}
-
-static void light_client_callback(esp_ble_mesh_light_client_cb_event_t event,
-                                  esp_ble_mesh_light_client_cb_param_t *param) {
-  // Log function placeholder
+bool ble_mesh_bridge_get_state(uint16_t addr, ble_mesh_bridge_state_t *out) {
+  portENTER_CRITICAL(&s_state_lock);
+  state_slot_t *slot = state_slot(addr, false);
+  if (slot != NULL)
+    *out = slot->state;
+  portEXIT_CRITICAL(&s_state_lock);
+  return slot != NULL;
 }
 
 // --- Public Accessors ---
@@ -160,7 +109,7 @@ bool ble_mesh_bridge_is_ready_to_init(void) {
   return esp_bt_controller_get_status() == ESP_BT_CONTROLLER_STATUS_ENABLED;
 }
 
-void ble_mesh_bridge_init(void) {
+void ble_mesh_bridge_init(uint16_t status_group) {
   // Note: Bluetooth controller init is handled by ESPHome's
   // esp32_ble_tracker/esp_bt registration
 
@@ -171,118 +120,74 @@ void ble_mesh_bridge_init(void) {
   LOG_I(TAG, "BT Controller Status: %d (Enabled=%d)", status,
         ESP_BT_CONTROLLER_STATUS_ENABLED);
 
-  // Set UUID
-  esp_efuse_mac_get_default(s_dev_uuid);
-  LOG_I(TAG,
-        "Device UUID: "
-        "%02X:%02X:%02X:%02X:%02X:%02X:%02X:%02X:%02X:%02X:%02X:%02X:%02X:%"
-        "02X:%02X:%02X",
-        s_dev_uuid[0], s_dev_uuid[1], s_dev_uuid[2], s_dev_uuid[3],
-        s_dev_uuid[4], s_dev_uuid[5], s_dev_uuid[6], s_dev_uuid[7],
-        s_dev_uuid[8], s_dev_uuid[9], s_dev_uuid[10], s_dev_uuid[11],
-        s_dev_uuid[12], s_dev_uuid[13], s_dev_uuid[14], s_dev_uuid[15]);
-
-  mesh_info_restore();
-
-  esp_ble_mesh_register_prov_callback(prov_callback);
-  esp_ble_mesh_register_config_server_callback(config_server_callback);
-  esp_ble_mesh_register_generic_client_callback(generic_client_callback);
-  esp_ble_mesh_register_light_client_callback(light_client_callback);
-
-  esp_err_t err = esp_ble_mesh_init(&provision, &composition);
-  if (err == ESP_ERR_INVALID_STATE) {
-    LOG_W(TAG,
-          "Mesh stack already initialized! Attempting deinit and retry...");
-    esp_ble_mesh_deinit(NULL);
-    // Small delay?
-    err = esp_ble_mesh_init(&provision, &composition);
-  }
-
-  if (err != ESP_OK) {
-    LOG_E(TAG, "Failed to initialize mesh stack (err %d)", err);
-    return;
-  }
-
-  err = esp_ble_mesh_node_prov_enable(ESP_BLE_MESH_PROV_ADV |
-                                      ESP_BLE_MESH_PROV_GATT);
-  if (err == ESP_ERR_INVALID_STATE) {
-    LOG_W(TAG, "Node prov already enabled? Continuing...");
-  } else if (err != ESP_OK) {
-    LOG_E(TAG, "Failed to enable mesh node (err %d)", err);
+  const mesh_core_config_t config = {
+      .nvs_key = NVS_MESH_INFO_KEY,
+      .net_transmit_count = 4,
+      .net_transmit_interval_ms = 20,
+      // Start conservative; drops towards 1 while lamps keep answering
+      .net_transmit_min = 1,
+      .net_transmit_max = 4,
+      .ttl_max = 7,
+      .status_group = status_group,
+      .on_status = on_status,
+      .ack_timeout_ms = 0,
+  };
+  if (mesh_core_init(&config) != ESP_OK) {
+    LOG_E(TAG, "Failed to start BLE Mesh node");
     return;
   }
 
   LOG_I(TAG, "BLE Mesh Node initialized (Bridge)");
 }
 
-void ble_mesh_bridge_send_onoff(uint16_t addr, bool state) {
-  if (s_app_state.app_idx == ESP_BLE_MESH_KEY_UNUSED) {
-    LOG_W(TAG, "AppKey not bound, cannot send OnOff.");
+static void bridge_send(const mesh_msg_t *msg) {
+  if (!mesh_core_is_ready()) {
+    LOG_W(TAG, "AppKey not bound, dropping command for 0x%04X", msg->addr);
     return;
   }
-
-  esp_ble_mesh_generic_client_set_state_t set = {0};
-  esp_ble_mesh_client_common_param_t common = {0};
-
-  common.opcode = ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET_UNACK;
-  common.model = onoff_client.model;
-  common.ctx.net_idx = s_app_state.net_idx;
-  common.ctx.app_idx = s_app_state.app_idx;
-  common.ctx.addr = addr;
-  common.ctx.send_ttl = 7;
-  common.msg_timeout = 0;
-
-  set.onoff_set.op_en = false;
-  set.onoff_set.onoff = state ? 1 : 0;
-  set.onoff_set.tid = s_app_state.tid++;
-
-  esp_err_t err = esp_ble_mesh_generic_client_set_state(&common, &set);
-  if (err) {
-    LOG_E(TAG, "Send OnOff Set failed: %d", err);
-  }
+  mesh_core_send(msg);
 }
 
-void ble_mesh_bridge_send_level(uint16_t addr, uint16_t level) {
-  if (s_app_state.app_idx == ESP_BLE_MESH_KEY_UNUSED)
-    return;
-
-  esp_ble_mesh_light_client_set_state_t set = {0};
-  esp_ble_mesh_client_common_param_t common = {0};
-
-  common.opcode = ESP_BLE_MESH_MODEL_OP_LIGHT_LIGHTNESS_SET_UNACK;
-  common.model = light_client.model;
-  common.ctx.net_idx = s_app_state.net_idx;
-  common.ctx.app_idx = s_app_state.app_idx;
-  common.ctx.addr = addr;
-  common.ctx.send_ttl = 7;
+void ble_mesh_bridge_send_onoff(uint16_t addr, bool state,
+                                uint32_t transition_ms) {
+  mesh_msg_t msg = {
+      .type = MESH_MSG_ONOFF,
+      .addr = addr,
+      .trans_time = mesh_codec_transition_time(transition_ms),
+      .onoff = state ? 1 : 0,
+  };
+  bridge_send(&msg);
+}
 
-  set.lightness_set.op_en = false;
-  set.lightness_set.lightness = level;
-  set.lightness_set.tid = s_app_state.tid++;
+void ble_mesh_bridge_send_level(uint16_t addr, uint16_t level,
+                                uint32_t transition_ms) {
+  mesh_msg_t msg = {
+      .type = MESH_MSG_LIGHTNESS,
+      .addr = addr,
+      .trans_time = mesh_codec_transition_time(transition_ms),
+      .lightness = level,
+  };
+  bridge_send(&msg);
+}
 
-  esp_ble_mesh_light_client_set_state(&common, &set);
+void ble_mesh_bridge_send_generic_level(uint16_t addr, int16_t level,
+                                        uint32_t transition_ms) {
+  mesh_msg_t msg = {
+      .type = MESH_MSG_LEVEL,
+      .addr = addr,
+      .trans_time = mesh_codec_transition_time(transition_ms),
+      .level = level,
+  };
+  bridge_send(&msg);
 }
 
 void ble_mesh_bridge_send_hsl(uint16_t addr, uint16_t lightness, uint16_t hue,
-                              uint16_t saturation) {
-  if (s_app_state.app_idx == ESP_BLE_MESH_KEY_UNUSED)
-    return;
-
-  esp_ble_mesh_light_client_set_state_t set = {0};
-  esp_ble_mesh_client_common_param_t common = {0};
-
-  common.opcode = ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET_UNACK;
-  common.model = hsl_client.model;
-  common.ctx.net_idx = s_app_state.net_idx;
-  common.ctx.app_idx = s_app_state.app_idx;
-  common.ctx.addr = addr;
-  common.ctx.send_ttl = 7;
-
-  set.hsl_set.op_en = false;
-  set.hsl_set.hsl_lightness = lightness;
-  set.hsl_set.hsl_hue = hue;
-  set.hsl_set.hsl_saturation = saturation;
-  set.hsl_set.tid = s_app_state.tid++;
-
-  esp_ble_mesh_light_client_set_state(&common, &set);
+                              uint16_t saturation, uint32_t transition_ms) {
+  mesh_msg_t msg = {
+      .type = MESH_MSG_HSL,
+      .addr = addr,
+      .trans_time = mesh_codec_transition_time(transition_ms),
+      .hsl = {.lightness = lightness, .hue = hue, .saturation = saturation},
+  };
+  bridge_send(&msg);
 }
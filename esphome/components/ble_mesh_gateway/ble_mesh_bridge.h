@@ -7,18 +7,42 @@
 extern "C" {
 #endif
 
-// Initialize the BLE Mesh Stack (and NVS, Bluetooth)
-void ble_mesh_bridge_init(void);
+// Initialize the BLE Mesh Stack (and NVS, Bluetooth). status_group is the
+// group the lamps publish their status to, 0 for none.
+void ble_mesh_bridge_init(uint16_t status_group);
 
 // Check if controller is ready
 bool ble_mesh_bridge_is_ready_to_init(void);
 
-// Send commands
-void ble_mesh_bridge_send_onoff(uint16_t addr, bool state);
-void ble_mesh_bridge_send_level(uint16_t addr, uint16_t level);
-void ble_mesh_bridge_send_generic_level(uint16_t addr, int16_t level);
+// Send commands. transition_ms is handed to the lamp as the mesh Transition
+// Time so it fades by itself; 0 applies the value immediately.
+void ble_mesh_bridge_send_onoff(uint16_t addr, bool state,
+                                uint32_t transition_ms);
+void ble_mesh_bridge_send_level(uint16_t addr, uint16_t level,
+                                uint32_t transition_ms);
+void ble_mesh_bridge_send_generic_level(uint16_t addr, int16_t level,
+                                        uint32_t transition_ms);
 void ble_mesh_bridge_send_hsl(uint16_t addr, uint16_t lightness, uint16_t hue,
-                              uint16_t saturation);
+                              uint16_t saturation, uint32_t transition_ms);
+
+// Last state a lamp reported in its status messages
+typedef struct {
+  bool on;
+  bool has_lightness; // Light Lightness Status (lamp's level scale)
+  uint16_t lightness;
+  bool has_hsl; // Light HSL Status (full 16-bit range)
+  uint16_t hsl_lightness;
+  uint16_t hue;
+  uint16_t saturation;
+  uint32_t last_seen_ms;
+} ble_mesh_bridge_state_t;
+
+// Returns a lamp whose reported state changed since it was last returned.
+// Call from the main loop; false when there is none.
+bool ble_mesh_bridge_next_state(uint16_t *addr, ble_mesh_bridge_state_t *out);
+
+// Last reported state of addr; false if it has not reported yet
+bool ble_mesh_bridge_get_state(uint16_t addr, ble_mesh_bridge_state_t *out);
 
 #ifdef __cplusplus
 }
@@ -3,6 +3,11 @@
 #include "ble_mesh_bridge.h"
 #include "esphome.h"
 
+#include <functional>
+#include <map>
+#include <utility>
+#include <vector>
+
 #if !defined(CONFIG_BLE_MESH)
 #error "CONFIG_BLE_MESH not defined! Check sdkconfig."
 #endif
@@ -24,7 +29,7 @@ public:
     if (!this->init_done_) {
       if (ble_mesh_bridge_is_ready_to_init()) {
         ESP_LOGI(TAG, "BT Controller Ready. Initializing Mesh Bridge...");
-        ble_mesh_bridge_init();
+        ble_mesh_bridge_init(this->status_group_);
         this->init_done_ = true;
       } else {
         // Optional: Log waiting every few seconds if needed, but keeping it
@@ -35,83 +40,236 @@ public:
           warned = true;
         }
       }
+      return;
+    }
+
+    // Send values that were held back by the rate limiter
+    if (this->pending_count_ > 0) {
+      this->flush_pending_();
+    }
+
+    // Hand state reported by the lamps to the lights that show them
+    uint16_t addr;
+    ble_mesh_bridge_state_t reported;
+    while (ble_mesh_bridge_next_state(&addr, &reported)) {
+      for (auto &listener : this->state_listeners_) {
+        if (listener.first == addr)
+          listener.second(reported);
+      }
     }
   }
 
   void dump_config() override {
     ESP_LOGCONFIG(TAG, "BLE Mesh Gateway (Bridged)");
+    ESP_LOGCONFIG(TAG, "  Max Rate: %.1f msg/s", this->max_rate_);
+    ESP_LOGCONFIG(TAG, "  Burst: %u", this->burst_);
+    ESP_LOGCONFIG(TAG, "  Min Interval per Address: %u ms",
+                  (unsigned) this->min_interval_);
+    if (this->status_group_ != 0)
+      ESP_LOGCONFIG(TAG, "  Status Group: 0x%04X", this->status_group_);
+  }
+
+  // --- Rate Limiter Configuration (from YAML) ---
+
+  // Gateway-wide budget shared by all addresses. Should stay below what the
+  // advertising bearer can carry with the configured net_transmit.
+  void set_max_rate(float msgs_per_sec) { this->max_rate_ = msgs_per_sec; }
+  void set_burst(uint16_t burst) {
+    this->burst_ = burst;
+    this->tokens_ = burst;
+  }
+  // Minimum gap between two sends to the same address
+  void set_min_interval(uint32_t ms) { this->min_interval_ = ms; }
+  // Group the lamps publish their status to
+  void set_status_group(uint16_t group) { this->status_group_ = group; }
+
+  // Called from loop() whenever the lamp at addr reports a new state
+  void add_state_listener(
+      uint16_t addr,
+      std::function<void(const ble_mesh_bridge_state_t &)> &&listener) {
+    this->state_listeners_.emplace_back(addr, std::move(listener));
   }
 
   // --- Public API for YAML Lambdas ---
 
-  void control_light(uint16_t addr, float state, uint32_t &last_send,
-                     uint16_t max_level = 50) {
+  // Values are never dropped: a value that arrives inside the per-address
+  // window or while the bucket is empty is kept (newest wins) and sent from
+  // loop() as soon as the window has passed and a token is available.
+  //
+  // transition_ms is passed to the lamp as the mesh Transition Time: one
+  // message fades the lamp instead of a stream of intermediate levels.
+  void control_light(uint16_t addr, float state, uint16_t max_level = 50,
+                     uint32_t transition_ms = 0) {
     if (!this->init_done_) {
       ESP_LOGW(TAG, "Mesh not ready, skipping control_light");
       return;
     }
 
-    uint32_t now = millis();
-    // Rate Limit: Only send level every 100ms prevents buffer flooding
+    PendingCommand cmd{};
+    cmd.type = CommandType::LEVEL;
     // Immediate update if turning OFF (0) or MAX (1.0) for responsiveness
-    if (now - last_send > 100 || state == 0 || state == 1.0) {
-      uint16_t level = 0;
-      if (state > 0) {
-        // SCALING: Map 0-1.0 to 0-max_level
-        level = (uint16_t)(state * max_level);
-      }
-
-      ble_mesh_bridge_send_level(addr, level);
-
-      // Send explicit OnOff command only when turning off completely
-      if (state == 0) {
-        ble_mesh_bridge_send_onoff(addr, false);
-      }
-      last_send = now;
+    cmd.urgent = state == 0 || state == 1.0f;
+    cmd.turn_off = state == 0;
+    cmd.transition_ms = transition_ms;
+    if (state > 0) {
+      // SCALING: Map 0-1.0 to 0-max_level
+      cmd.level = (uint16_t) (state * max_level);
     }
+    this->submit_(addr, cmd);
   }
 
   void control_light_hsl(uint16_t addr, float state, float hue,
-                         float saturation, uint32_t &last_send,
-                         uint16_t max_level = 50) {
+                         float saturation, uint16_t max_level = 50,
+                         uint32_t transition_ms = 0) {
     if (!this->init_done_) {
       ESP_LOGW(TAG, "Mesh not ready, skipping control_light_hsl");
       return;
     }
 
+    // HSL Mapping:
+    // Hue: 0-360 -> 0-65535 (standard Mesh)
+    // Sat: 0-1.0 -> 0-65535
+    // Light: 0-1.0 -> 0-65535 (full range; the HSL message has its own
+    // lightness field, independent of the level scaling)
+    // Note: Some lamps ignore L in HSL Set and use Level/Lightness Set
+    // separately. We'll send HSL Set which includes L.
+    PendingCommand cmd{};
+    cmd.type = CommandType::HSL;
+    cmd.urgent = state == 0 || state == 1.0f;
+    cmd.turn_off = state == 0;
+    cmd.transition_ms = transition_ms;
+    cmd.level = (uint16_t) (state * 65535);
+    cmd.hue = (uint16_t) (hue / 360.0f * 65535);
+    cmd.saturation = (uint16_t) (saturation * 65535);
+    this->submit_(addr, cmd);
+  }
+
+  // Older YAML passes a per-lambda `last_send` timestamp. Throttling is now
+  // tracked per address by the gateway, so the argument is only updated.
+  void control_light(uint16_t addr, float state, uint32_t &last_send,
+                     uint16_t max_level = 50) {
+    this->control_light(addr, state, max_level);
+    last_send = millis();
+  }
+
+  void control_light_hsl(uint16_t addr, float state, float hue,
+                         float saturation, uint32_t &last_send,
+                         uint16_t max_level = 50) {
+    this->control_light_hsl(addr, state, hue, saturation, max_level);
+    last_send = millis();
+  }
+
+protected:
+  enum class CommandType : uint8_t { LEVEL, HSL };
+
+  struct PendingCommand {
+    CommandType type;
+    bool urgent;   // On/off edge: skips the per-address window
+    bool turn_off; // Follow up with an explicit Generic OnOff Off
+    uint16_t level;
+    uint16_t hue;
+    uint16_t saturation;
+    uint32_t transition_ms; // Fade performed by the lamp
+  };
+
+  struct AddressState {
+    uint32_t last_send = 0;
+    bool has_sent = false;
+    bool pending = false;
+    PendingCommand cmd{};
+  };
+
+  void refill_(uint32_t now) {
+    float elapsed = (float) (now - this->last_refill_);
+    this->last_refill_ = now;
+    this->tokens_ += elapsed * this->max_rate_ / 1000.0f;
+    if (this->tokens_ > this->burst_)
+      this->tokens_ = this->burst_;
+  }
+
+  void submit_(uint16_t addr, const PendingCommand &cmd) {
+    AddressState &st = this->addresses_[addr];
+    if (!st.pending) {
+      st.pending = true;
+      this->pending_count_++;
+    }
+    st.cmd = cmd; // Newest value wins
+
+    // Send right away unless other addresses are already waiting for tokens;
+    // those are served in turn from loop().
+    if (cmd.urgent || this->pending_count_ == 1) {
+      uint32_t now = millis();
+      this->refill_(now);
+      this->try_send_(addr, st, now);
+    }
+  }
+
+  bool try_send_(uint16_t addr, AddressState &st, uint32_t now) {
+    if (!st.pending)
+      return false;
+    if (!st.cmd.urgent && st.has_sent &&
+        now - st.last_send < this->min_interval_)
+      return false;
+
+    float cost = st.cmd.turn_off ? 2.0f : 1.0f;
+    if (this->tokens_ < cost)
+      return false;
+    this->tokens_ -= cost;
+
+    if (st.cmd.type == CommandType::HSL) {
+      ble_mesh_bridge_send_hsl(addr, st.cmd.level, st.cmd.hue,
+                               st.cmd.saturation, st.cmd.transition_ms);
+    } else {
+      ble_mesh_bridge_send_level(addr, st.cmd.level, st.cmd.transition_ms);
+    }
+    // Send explicit OnOff command only when turning off completely
+    if (st.cmd.turn_off) {
+      ble_mesh_bridge_send_onoff(addr, false, st.cmd.transition_ms);
+    }
+
+    st.pending = false;
+    st.last_send = now;
+    st.has_sent = true;
+    this->pending_count_--;
+    this->rr_cursor_ = addr;
+    return true;
+  }
+
+  // Round-robin over waiting addresses, starting after the last one served,
+  // so a single busy slider cannot starve the others. On/off edges go first.
+  void flush_pending_() {
     uint32_t now = millis();
-    if (now - last_send > 100 || state == 0 || state == 1.0) {
-      uint16_t lightness = 0;
-      if (state > 0) {
-        lightness = (uint16_t)(state * max_level);
-      }
+    this->refill_(now);
 
-      // HSL Mapping:
-      // Hue: 0-360 -> 0-65535 (standard Mesh)
-      // Sat: 0-1.0 -> 0-65535
-      // Light: 0-1.0 -> 0-65535 (independent of the level scaling?)
-      // Actually, Lighting HSL model has Lightness field.
-      // Usually "Level" controls the "Light Lightness Actual" state, but HSL
-      // message has its own lightness field.
-      // For Ledvance, likely the L field in HSL message works.
-
-      uint16_t h_u16 = (uint16_t)(hue / 360.0f * 65535);
-      uint16_t s_u16 = (uint16_t)(saturation * 65535);
-      uint16_t l_u16 = (uint16_t)(state * 65535); // Full range lightness
-
-      // Note: Some lamps ignore L in HSL Set and use Level/Lightness Set
-      // separately. We'll send HSL Set which includes L.
-      ble_mesh_bridge_send_hsl(addr, l_u16, h_u16, s_u16);
-
-      if (state == 0) {
-        ble_mesh_bridge_send_onoff(addr, false);
+    for (bool urgent_pass : {true, false}) {
+      auto it = this->addresses_.upper_bound(this->rr_cursor_);
+      for (size_t n = 0; n < this->addresses_.size(); n++) {
+        if (it == this->addresses_.end())
+          it = this->addresses_.begin();
+        if (this->tokens_ < 1.0f || this->pending_count_ == 0)
+          return;
+        if (!urgent_pass || it->second.cmd.urgent)
+          this->try_send_(it->first, it->second, now);
+        ++it;
       }
-      last_send = now;
     }
   }
 
-protected:
   bool init_done_ = false;
+
+  float max_rate_ = 20.0f;
+  uint16_t burst_ = 10;
+  uint32_t min_interval_ = 100;
+  uint16_t status_group_ = 0;
+  float tokens_ = 10.0f;
+  uint32_t last_refill_ = 0;
+
+  std::map<uint16_t, AddressState> addresses_;
+  std::vector<std::pair<uint16_t,
+                        std::function<void(const ble_mesh_bridge_state_t &)>>>
+      state_listeners_;
+  size_t pending_count_ = 0;
+  uint16_t rr_cursor_ = 0;
 };
 
 } // namespace ble_mesh_gateway
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "ble_mesh_gateway.h"
+#include "esphome/components/light/light_output.h"
+#include "esphome/components/light/light_state.h"
+#include "esphome/components/light/light_transformer.h"
+#include "esphome/core/helpers.h"
+
+namespace esphome {
+namespace ble_mesh_gateway {
+
+// A mesh lamp as an ESPHome light. Transitions are not rendered by ESPHome:
+// the target goes out once with the mesh Transition Time and the lamp fades
+// by itself. The state shown follows what the lamp reports in its status
+// messages, not only what was last commanded.
+class BleMeshLight : public light::LightOutput {
+public:
+  void set_gateway(BleMeshGateway *gateway) { this->gateway_ = gateway; }
+  void set_address(uint16_t address) { this->address_ = address; }
+  void set_max_level(uint16_t max_level) { this->max_level_ = max_level; }
+  void set_color(bool color) { this->color_ = color; }
+
+  light::LightTraits get_traits() override {
+    auto traits = light::LightTraits();
+    traits.set_supported_color_modes({this->color_
+                                          ? light::ColorMode::RGB
+                                          : light::ColorMode::BRIGHTNESS});
+    return traits;
+  }
+
+  std::unique_ptr<light::LightTransformer> create_default_transition() override;
+
+  void setup_state(light::LightState *state) override {
+    this->state_ = state;
+    this->gateway_->add_state_listener(
+        this->address_,
+        [this](const ble_mesh_bridge_state_t &st) { this->on_report_(st); });
+  }
+
+  void write_state(light::LightState *state) override {
+    this->send_(state->current_values, 0);
+  }
+
+  // Start of a transition: send the target with the transition length
+  void send_target(const light::LightColorValues &target, uint32_t length_ms) {
+    this->send_(target, length_ms);
+  }
+
+protected:
+  void send_(const light::LightColorValues &values, uint32_t transition_ms) {
+    // The transformer reports the target once the lamp's own fade is over;
+    // that write must not go out a second time.
+    if (this->has_sent_ && values == this->last_sent_)
+      return;
+    this->last_sent_ = values;
+    this->has_sent_ = true;
+
+    float level = values.get_state() * values.get_brightness();
+    if (this->color_) {
+      int hue;
+      float saturation, value;
+      rgb_to_hsv(values.get_red(), values.get_green(), values.get_blue(), hue,
+                 saturation, value);
+      this->gateway_->control_light_hsl(this->address_, level, hue, saturation,
+                                        this->max_level_, transition_ms);
+    } else {
+      this->gateway_->control_light(this->address_, level, this->max_level_,
+                                    transition_ms);
+    }
+  }
+
+  void on_report_(const ble_mesh_bridge_state_t &st) {
+    // Mid-transition reports show the fade, not the target
+    if (this->state_ == nullptr || this->state_->is_transformer_active())
+      return;
+
+    light::LightColorValues values = this->state_->remote_values;
+    values.set_state(st.on ? 1.0f : 0.0f);
+    if (this->color_ && st.has_hsl) {
+      float red, green, blue;
+      hsv_to_rgb((int) (st.hue * 360.0f / 65535.0f), st.saturation / 65535.0f,
+                 1.0f, red, green, blue);
+      values.set_red(red);
+      values.set_green(green);
+      values.set_blue(blue);
+      values.set_brightness(st.hsl_lightness / 65535.0f);
+    } else if (st.has_lightness && this->max_level_ > 0) {
+      float brightness = (float) st.lightness / this->max_level_;
+      values.set_brightness(brightness > 1.0f ? 1.0f : brightness);
+    }
+    if (values == this->state_->remote_values)
+      return;
+
+    // Publish without writing the output: the lamp is already there
+    this->last_sent_ = values;
+    this->has_sent_ = true;
+    this->state_->current_values = values;
+    this->state_->remote_values = values;
+    this->state_->publish_state();
+  }
+
+  light::LightState *state_{nullptr};
+  BleMeshGateway *gateway_{nullptr};
+  uint16_t address_{0};
+  uint16_t max_level_{50};
+  bool color_{false};
+  bool has_sent_{false};
+  light::LightColorValues last_sent_;
+};
+
+// Sends the target when the transition starts and produces no intermediate
+// values; the light state jumps to the target when the length has elapsed.
+class MeshTransitionTransformer : public light::LightTransformer {
+public:
+  explicit MeshTransitionTransformer(BleMeshLight *light) : light_(light) {}
+
+  void start() override {
+    this->light_->send_target(this->target_values_, this->length_);
+  }
+
+  optional<light::LightColorValues> apply() override {
+    if (this->is_finished())
+      return this->target_values_;
+    return {};
+  }
+
+protected:
+  BleMeshLight *light_;
+};
+
+inline std::unique_ptr<light::LightTransformer>
+BleMeshLight::create_default_transition() {
+  return make_unique<MeshTransitionTransformer>(this);
+}
+
+} // namespace ble_mesh_gateway
+} // namespace esphome
@@ -0,0 +1,34 @@
+import esphome.codegen as cg
+import esphome.config_validation as cv
+from esphome.components import light
+from esphome.const import CONF_ADDRESS, CONF_OUTPUT_ID
+
+from . import BleMeshGateway, ble_mesh_gateway_ns
+
+DEPENDENCIES = ['ble_mesh_gateway']
+
+CONF_BLE_MESH_GATEWAY_ID = 'ble_mesh_gateway_id'
+CONF_MAX_LEVEL = 'max_level'
+CONF_COLOR = 'color'
+
+BleMeshLight = ble_mesh_gateway_ns.class_('BleMeshLight', light.LightOutput)
+
+CONFIG_SCHEMA = light.RGB_LIGHT_SCHEMA.extend({
+    cv.GenerateID(CONF_OUTPUT_ID): cv.declare_id(BleMeshLight),
+    cv.GenerateID(CONF_BLE_MESH_GATEWAY_ID): cv.use_id(BleMeshGateway),
+    cv.Required(CONF_ADDRESS): cv.hex_uint16_t,
+    # Lightness sent for full brightness (lamp-specific scale)
+    cv.Optional(CONF_MAX_LEVEL, default=50): cv.uint16_t,
+    # Expose RGB and send HSL Sets
+    cv.Optional(CONF_COLOR, default=False): cv.boolean,
+})
+
+async def to_code(config):
+    var = cg.new_Pvariable(config[CONF_OUTPUT_ID])
+    await light.register_light(var, config)
+    gateway = await cg.get_variable(config[CONF_BLE_MESH_GATEWAY_ID])
+    cg.add(var.set_gateway(gateway))
+    cg.add(var.set_address(config[CONF_ADDRESS]))
+    cg.add(var.set_max_level(config[CONF_MAX_LEVEL]))
+    cg.add(var.set_color(config[CONF_COLOR]))
+    cg.add_global(cg.RawStatement('#include "esphome/components/ble_mesh_gateway/ble_mesh_light.h"'))
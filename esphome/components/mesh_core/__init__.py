@@ -0,0 +1,4 @@
+# Shared BLE Mesh node (composition, provisioning state, Set encoding).
+# Auto-loaded by ble_mesh_gateway; the ESP-IDF firmware builds the same sources
+# as an IDF component.
+CODEOWNERS = []
@@ -0,0 +1,147 @@
+/*
+ * mesh_codec.c - Table-driven encoder for the mesh messages the gateway sends
+ *
+ * Every Set the gateway emits has the same shape: a few little-endian state
+ * fields followed by a TID. The table below describes those fields per message
+ * type, so adding a model is a table entry rather than another send function.
+ */
+
+#include "mesh_codec.h"
+
+#include <stddef.h>
+
+#define MAX_FIELDS 3
+
+typedef struct {
+    uint8_t offset; // offsetof(mesh_msg_t, ...)
+    uint8_t size;   // 1 or 2 bytes, little-endian on air
+} field_t;
+
+typedef struct {
+    mesh_codec_desc_t desc;
+    uint8_t field_count;
+    field_t fields[MAX_FIELDS];
+} codec_entry_t;
+
+#define FIELD(member) { offsetof(mesh_msg_t, member), sizeof(((mesh_msg_t *)0)->member) }
+
+static const codec_entry_t s_codec[MESH_MSG_TYPE_COUNT] = {
+    [MESH_MSG_ONOFF] = {
+        .desc = { MESH_OP_GEN_ONOFF_GET, MESH_OP_GEN_ONOFF_SET, MESH_OP_GEN_ONOFF_SET_UNACK,
+                  MESH_OP_GEN_ONOFF_STATUS, 0x1001, "onoff" },
+        .field_count = 1,
+        .fields = { FIELD(onoff) },
+    },
+    [MESH_MSG_LEVEL] = {
+        .desc = { MESH_OP_GEN_LEVEL_GET, MESH_OP_GEN_LEVEL_SET, MESH_OP_GEN_LEVEL_SET_UNACK,
+                  MESH_OP_GEN_LEVEL_STATUS, 0x1003, "level" },
+        .field_count = 1,
+        .fields = { FIELD(level) },
+    },
+    [MESH_MSG_LIGHTNESS] = {
+        .desc = { MESH_OP_LIGHT_LIGHTNESS_GET, MESH_OP_LIGHT_LIGHTNESS_SET, MESH_OP_LIGHT_LIGHTNESS_SET_UNACK,
+                  MESH_OP_LIGHT_LIGHTNESS_STATUS, 0x1302, "lightness" },
+        .field_count = 1,
+        .fields = { FIELD(lightness) },
+    },
+    [MESH_MSG_HSL] = {
+        .desc = { MESH_OP_LIGHT_HSL_GET, MESH_OP_LIGHT_HSL_SET, MESH_OP_LIGHT_HSL_SET_UNACK,
+                  MESH_OP_LIGHT_HSL_STATUS, 0x1309, "hsl" },
+        .field_count = 3,
+        .fields = { FIELD(hsl.lightness), FIELD(hsl.hue), FIELD(hsl.saturation) },
+    },
+    [MESH_MSG_LIGHTNESS_RANGE] = {
+        // Range Set belongs to the Setup Server and carries no TID; not sent
+        .desc = { MESH_OP_LIGHT_LIGHTNESS_RANGE_GET, 0, 0,
+                  MESH_OP_LIGHT_LIGHTNESS_RANGE_STATUS, 0x1302, "lightness_range" },
+    },
+};
+
+const mesh_codec_desc_t *mesh_codec_desc(mesh_msg_type_t type)
+{
+    if ((unsigned)type >= MESH_MSG_TYPE_COUNT) {
+        return NULL;
+    }
+    return &s_codec[type].desc;
+}
+
+uint32_t mesh_codec_set_opcode(const mesh_msg_t *msg)
+{
+    const mesh_codec_desc_t *desc = mesh_codec_desc(msg->type);
+    if (desc == NULL) {
+        return 0;
+    }
+    return msg->ack ? desc->op_set : desc->op_set_unack;
+}
+
+bool mesh_codec_type_from_opcode(uint32_t opcode, mesh_msg_type_t *type)
+{
+    for (int i = 0; i < MESH_MSG_TYPE_COUNT; i++) {
+        const mesh_codec_desc_t *d = &s_codec[i].desc;
+        if (opcode != 0 && (opcode == d->op_get || opcode == d->op_set ||
+                            opcode == d->op_set_unack || opcode == d->op_status)) {
+            *type = (mesh_msg_type_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint8_t mesh_codec_transition_time(uint32_t ms)
+{
+    static const uint32_t resolution_ms[] = { 100, 1000, 10000, 600000 };
+
+    if (ms == 0) {
+        return 0;
+    }
+    for (uint8_t r = 0; r < 4; r++) {
+        uint32_t steps = (ms + resolution_ms[r] / 2) / resolution_ms[r];
+        if (steps <= 62) {
+            return (uint8_t)((r << 6) | (steps ? steps : 1));
+        }
+    }
+    return (3 << 6) | 62;
+}
+
+size_t mesh_codec_encode_set(const mesh_msg_t *msg, uint8_t tid, uint8_t *buf, size_t len)
+{
+    if ((unsigned)msg->type >= MESH_MSG_TYPE_COUNT) {
+        return 0;
+    }
+
+    const codec_entry_t *entry = &s_codec[msg->type];
+    if (entry->desc.op_set == 0) {
+        return 0;
+    }
+    const uint8_t *src = (const uint8_t *)msg;
+    size_t n = 0;
+
+    for (int i = 0; i < entry->field_count; i++) {
+        const field_t *f = &entry->fields[i];
+        if (n + f->size > len) {
+            return 0;
+        }
+        if (f->size == 1) {
+            buf[n++] = src[f->offset];
+        } else {
+            uint16_t v = (uint16_t)(src[f->offset] | (src[f->offset + 1] << 8));
+            // Fields live in host byte order; the mesh is little-endian
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            v = (uint16_t)((v >> 8) | (v << 8));
+#endif
+            buf[n++] = (uint8_t)(v & 0xFF);
+            buf[n++] = (uint8_t)(v >> 8);
+        }
+    }
+
+    bool transition = msg->trans_time != 0 || msg->delay != 0;
+    if (n + (transition ? 3 : 1) > len) {
+        return 0;
+    }
+    buf[n++] = tid;
+    if (transition) {
+        buf[n++] = msg->trans_time;
+        buf[n++] = msg->delay;
+    }
+    return n;
+}
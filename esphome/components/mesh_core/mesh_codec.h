@@ -0,0 +1,128 @@
+#pragma once
+
+/*
+ * mesh_codec.h - Table-driven encoder for the mesh messages the gateway sends
+ *
+ * Portable C without ESP-IDF or BLE dependencies, so it also builds for the
+ * ESP-IDF linux host target.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// SIG model opcodes (Mesh Model Specification)
+#define MESH_OP_GEN_ONOFF_GET             0x8201
+#define MESH_OP_GEN_ONOFF_SET             0x8202
+#define MESH_OP_GEN_ONOFF_SET_UNACK       0x8203
+#define MESH_OP_GEN_ONOFF_STATUS          0x8204
+#define MESH_OP_GEN_LEVEL_GET             0x8205
+#define MESH_OP_GEN_LEVEL_SET             0x8206
+#define MESH_OP_GEN_LEVEL_SET_UNACK       0x8207
+#define MESH_OP_GEN_LEVEL_STATUS          0x8208
+#define MESH_OP_LIGHT_LIGHTNESS_GET       0x824B
+#define MESH_OP_LIGHT_LIGHTNESS_SET       0x824C
+#define MESH_OP_LIGHT_LIGHTNESS_SET_UNACK 0x824D
+#define MESH_OP_LIGHT_LIGHTNESS_STATUS    0x824E
+#define MESH_OP_LIGHT_LIGHTNESS_RANGE_GET    0x8257
+#define MESH_OP_LIGHT_LIGHTNESS_RANGE_STATUS 0x8258
+#define MESH_OP_LIGHT_HSL_GET             0x826D
+#define MESH_OP_LIGHT_HSL_SET             0x8276
+#define MESH_OP_LIGHT_HSL_SET_UNACK       0x8277
+#define MESH_OP_LIGHT_HSL_STATUS          0x8278
+
+// Largest parameter block produced by mesh_codec_encode_set()
+#define MESH_CODEC_MAX_PARAMS 9
+
+typedef enum {
+    MESH_MSG_ONOFF = 0,
+    MESH_MSG_LEVEL,
+    MESH_MSG_LIGHTNESS,
+    MESH_MSG_HSL,
+    MESH_MSG_LIGHTNESS_RANGE,   // Get only: the lamp's Light Lightness Range
+    MESH_MSG_TYPE_COUNT,
+} mesh_msg_type_t;
+
+// One outbound Set or Get, independent of the mesh stack's API structs.
+typedef struct {
+    mesh_msg_type_t type;
+    uint16_t addr;          // Destination (unicast or group)
+    bool ack;               // Acknowledged opcode, lamp replies with a status
+    bool get;               // Get instead of Set: no state fields, the reply is a status
+    uint8_t trans_time;     // Encoded Transition Time (mesh_codec_transition_time()), 0 = none
+    uint8_t delay;          // Delay before the transition starts, in 5 ms steps
+    union {
+        uint8_t onoff;
+        int16_t level;
+        uint16_t lightness;
+        struct {
+            uint16_t lightness;
+            uint16_t hue;
+            uint16_t saturation;
+        } hsl;
+    };
+} mesh_msg_t;
+
+// Opcodes and client model of one message type. op_set and op_set_unack
+// are 0 for types the gateway only reads.
+typedef struct {
+    uint32_t op_get;
+    uint32_t op_set;
+    uint32_t op_set_unack;
+    uint32_t op_status;
+    uint16_t client_model_id;
+    const char *name;
+} mesh_codec_desc_t;
+
+/**
+ * @brief Looks up the opcodes of a message type.
+ *
+ * @return The descriptor, or NULL for an invalid type.
+ */
+const mesh_codec_desc_t *mesh_codec_desc(mesh_msg_type_t type);
+
+/**
+ * @brief Opcode to transmit for a message (acknowledged or not).
+ */
+uint32_t mesh_codec_set_opcode(const mesh_msg_t *msg);
+
+/**
+ * @brief Maps an opcode (Get, Set or Status) back to its message type.
+ *
+ * @return true if the opcode belongs to one of the types in the table.
+ */
+bool mesh_codec_type_from_opcode(uint32_t opcode, mesh_msg_type_t *type);
+
+/**
+ * @brief Encodes a duration as a mesh Transition Time.
+ *
+ * The field holds 1-62 steps of 100 ms, 1 s, 10 s or 10 min; the finest
+ * resolution that fits is used and the value rounded to it. Durations beyond
+ * 10.3 hours are clamped.
+ *
+ * @param ms Duration in milliseconds; 0 means no transition.
+ */
+uint8_t mesh_codec_transition_time(uint32_t ms);
+
+/**
+ * @brief Encodes the parameters of a Set message (without the opcode).
+ *
+ * Transition Time and Delay are appended after the TID when either is set.
+ * Types without a Set (see mesh_codec_desc_t) cannot be encoded.
+ *
+ * @param msg The message to encode.
+ * @param tid Transaction identifier to place after the state fields.
+ * @param[out] buf Output buffer, at least MESH_CODEC_MAX_PARAMS bytes.
+ * @param len Size of @p buf.
+ * @return Number of bytes written, or 0 if the type is invalid, has no Set or
+ *         @p buf is too small.
+ */
+size_t mesh_codec_encode_set(const mesh_msg_t *msg, uint8_t tid, uint8_t *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
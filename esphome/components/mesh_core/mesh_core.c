@@ -0,0 +1,514 @@
+/*
+ * mesh_core.c - BLE Mesh node shared by the ESP-IDF firmware and the ESPHome
+ *               ble_mesh_gateway component
+ *
+ * Every Set goes through mesh_core_send(): the message is encoded by the
+ * mesh_codec table and handed to the matching client model as a raw access
+ * message. Status replies still arrive through the SIG client models, which
+ * decode them before they are forwarded to the application.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "nvs.h"
+
+#include "esp_ble_mesh_common_api.h"
+#include "esp_ble_mesh_provisioning_api.h"
+#include "esp_ble_mesh_networking_api.h"
+#include "esp_ble_mesh_config_model_api.h"
+#include "esp_ble_mesh_generic_model_api.h"
+#include "esp_ble_mesh_lighting_model_api.h"
+#include "esp_ble_mesh_local_data_operation_api.h"
+
+#include "mesh_core.h"
+#include "mesh_core_log.h"
+#include "mesh_link.h"
+#include "mesh_tid.h"
+
+#define TAG "MESH_CORE"
+#define CID_ESP 0x02E5
+#define NVS_NAMESPACE "ble_mesh"
+#define DEFAULT_TTL 7
+
+static mesh_core_config_t s_config;
+static uint8_t s_transmit_count;    // Network Transmit count currently in config_server
+
+// Persisted as a blob; layout must stay compatible with existing NVS data
+static struct app_state_t {
+    uint16_t net_idx;   /* NetKey Index */
+    uint16_t app_idx;   /* AppKey Index */
+    uint8_t  tid;       /* Unused, TIDs are tracked per destination (mesh_tid.c) */
+} __attribute__((packed)) app_state = {
+    .net_idx = ESP_BLE_MESH_KEY_UNUSED,
+    .app_idx = ESP_BLE_MESH_KEY_UNUSED,
+    .tid = 0x0,
+};
+
+/* --- Composition --- */
+
+static uint8_t dev_uuid[16];
+
+static esp_ble_mesh_client_t onoff_client;
+static esp_ble_mesh_client_t level_client;
+static esp_ble_mesh_client_t light_client;
+static esp_ble_mesh_client_t hsl_client;
+
+// Client model used to send each message type, indexed by mesh_msg_type_t
+static esp_ble_mesh_client_t *const s_clients[MESH_MSG_TYPE_COUNT] = {
+    [MESH_MSG_ONOFF] = &onoff_client,
+    [MESH_MSG_LEVEL] = &level_client,
+    [MESH_MSG_LIGHTNESS] = &light_client,
+    [MESH_MSG_HSL] = &hsl_client,
+    [MESH_MSG_LIGHTNESS_RANGE] = &light_client,
+};
+
+static esp_ble_mesh_cfg_srv_t config_server = {
+    .relay = ESP_BLE_MESH_RELAY_DISABLED,
+    .beacon = ESP_BLE_MESH_BEACON_ENABLED,
+#if defined(CONFIG_BLE_MESH_FRIEND)
+    .friend_state = ESP_BLE_MESH_FRIEND_ENABLED,
+#else
+    .friend_state = ESP_BLE_MESH_FRIEND_NOT_SUPPORTED,
+#endif
+#if defined(CONFIG_BLE_MESH_GATT_PROXY_SERVER)
+    .gatt_proxy = ESP_BLE_MESH_GATT_PROXY_ENABLED,
+#else
+    .gatt_proxy = ESP_BLE_MESH_GATT_PROXY_NOT_SUPPORTED,
+#endif
+    .default_ttl = DEFAULT_TTL,
+    .net_transmit = ESP_BLE_MESH_TRANSMIT(2, 20),
+    .relay_retransmit = ESP_BLE_MESH_TRANSMIT(2, 20),
+};
+
+ESP_BLE_MESH_MODEL_PUB_DEFINE(onoff_cli_pub, 2 + 2, ROLE_NODE);
+ESP_BLE_MESH_MODEL_PUB_DEFINE(level_cli_pub, 2 + 2, ROLE_NODE);
+ESP_BLE_MESH_MODEL_PUB_DEFINE(light_cli_pub, 2 + 2, ROLE_NODE);
+ESP_BLE_MESH_MODEL_PUB_DEFINE(hsl_cli_pub, 2 + 2, ROLE_NODE);
+
+static esp_ble_mesh_model_t root_models[] = {
+    ESP_BLE_MESH_MODEL_CFG_SRV(&config_server),
+    ESP_BLE_MESH_MODEL_GEN_ONOFF_CLI(&onoff_cli_pub, &onoff_client),
+    ESP_BLE_MESH_MODEL_GEN_LEVEL_CLI(&level_cli_pub, &level_client),
+    ESP_BLE_MESH_MODEL_LIGHT_LIGHTNESS_CLI(&light_cli_pub, &light_client),
+    ESP_BLE_MESH_MODEL_LIGHT_HSL_CLI(&hsl_cli_pub, &hsl_client),
+};
+
+static esp_ble_mesh_elem_t elements[] = {
+    ESP_BLE_MESH_ELEMENT(0, root_models, ESP_BLE_MESH_MODEL_NONE),
+};
+
+static esp_ble_mesh_comp_t composition = {
+    .cid = CID_ESP,
+    .elements = elements,
+    .element_count = ARRAY_SIZE(elements),
+};
+
+static esp_ble_mesh_prov_t provision = {
+    .uuid = dev_uuid,
+    .output_size = 0,
+    .output_actions = 0,
+};
+
+/* --- NVS --- */
+
+static void mesh_info_store(void)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        CORE_LOGE("Failed to open NVS (err %d)", err);
+        return;
+    }
+    err = nvs_set_blob(handle, s_config.nvs_key, &app_state, sizeof(app_state));
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    if (err != ESP_OK) {
+        CORE_LOGE("Failed to store mesh info (err %d)", err);
+    }
+    nvs_close(handle);
+}
+
+static void mesh_info_restore(void)
+{
+    nvs_handle_t handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+    size_t len = sizeof(app_state);
+    esp_err_t err = nvs_get_blob(handle, s_config.nvs_key, &app_state, &len);
+    if (err == ESP_OK) {
+        CORE_LOGI("Restored state: net_idx 0x%04x, app_idx 0x%04x",
+                  app_state.net_idx, app_state.app_idx);
+    } else if (err != ESP_ERR_NVS_NOT_FOUND) {
+        CORE_LOGE("Failed to restore mesh info from NVS (err %d)", err);
+    }
+    nvs_close(handle);
+}
+
+/* --- Status group --- */
+
+/**
+ * @brief Subscribes the client models to the group the lamps publish their
+ *        status to, so changes made elsewhere (wall switch, app) are heard
+ *        without polling. Already existing subscriptions are left as they are.
+ */
+static void subscribe_status_group(void)
+{
+    if (s_config.status_group == 0 || !esp_ble_mesh_node_is_provisioned()) {
+        return;
+    }
+    if (s_config.status_group < 0xC000 || s_config.status_group > 0xFEFF) {
+        CORE_LOGE("Status group 0x%04x is not a group address", s_config.status_group);
+        return;
+    }
+
+    uint16_t element_addr = esp_ble_mesh_get_primary_element_address();
+    for (int i = 0; i < MESH_MSG_TYPE_COUNT; i++) {
+        uint16_t model_id = mesh_codec_desc((mesh_msg_type_t)i)->client_model_id;
+        bool shared = false;
+        for (int j = 0; j < i; j++) {
+            shared |= s_clients[j] == s_clients[i];
+        }
+        if (shared) {
+            continue;   // Client model already subscribed for another message type
+        }
+        esp_err_t err = esp_ble_mesh_model_subscribe_group_addr(element_addr, ESP_BLE_MESH_CID_NVAL,
+                                                                model_id, s_config.status_group);
+        if (err != ESP_OK) {
+            CORE_LOGE("Failed to subscribe model 0x%04x to 0x%04x (err %d)",
+                      model_id, s_config.status_group, err);
+        }
+    }
+    CORE_LOGI("Listening for lamp status on group 0x%04x", s_config.status_group);
+}
+
+/* --- Callbacks --- */
+
+// Only for replies that did not come: a lost reply is what mesh_link counts
+// as a link loss, and what the caller counts against the lamp.
+static void report_timeout(uint32_t opcode, uint16_t addr)
+{
+    mesh_msg_type_t type;
+    mesh_link_on_timeout(addr);
+    if (s_config.on_timeout && mesh_codec_type_from_opcode(opcode, &type)) {
+        s_config.on_timeout(addr, type);
+    }
+}
+
+static mesh_core_status_src_t status_source(bool get_reply, bool set_reply)
+{
+    if (get_reply) {
+        return MESH_CORE_STATUS_GET_REPLY;
+    }
+    return set_reply ? MESH_CORE_STATUS_SET_REPLY : MESH_CORE_STATUS_PUBLISH;
+}
+
+static void ble_mesh_provisioning_cb(esp_ble_mesh_prov_cb_event_t event,
+                                     esp_ble_mesh_prov_cb_param_t *param)
+{
+    switch (event) {
+    case ESP_BLE_MESH_PROV_REGISTER_COMP_EVT:
+        CORE_LOGI("Composition registered, err_code %d", param->prov_register_comp.err_code);
+        break;
+    case ESP_BLE_MESH_NODE_PROV_LINK_OPEN_EVT:
+        CORE_LOGI("Provisioning link opened on %s",
+                  param->node_prov_link_open.bearer == ESP_BLE_MESH_PROV_ADV ? "PB-ADV" : "PB-GATT");
+        break;
+    case ESP_BLE_MESH_NODE_PROV_LINK_CLOSE_EVT:
+        CORE_LOGI("Provisioning link closed on %s",
+                  param->node_prov_link_close.bearer == ESP_BLE_MESH_PROV_ADV ? "PB-ADV" : "PB-GATT");
+        break;
+    case ESP_BLE_MESH_NODE_PROV_COMPLETE_EVT:
+        CORE_LOGI("Provisioning complete: net_idx 0x%04x, addr 0x%04x, flags 0x%02x, iv_index 0x%08" PRIx32,
+                  param->node_prov_complete.net_idx, param->node_prov_complete.addr,
+                  param->node_prov_complete.flags, param->node_prov_complete.iv_index);
+        app_state.net_idx = param->node_prov_complete.net_idx;
+        mesh_info_store();
+        if (s_config.on_prov_complete) {
+            s_config.on_prov_complete(param->node_prov_complete.net_idx, param->node_prov_complete.addr);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void ble_mesh_config_server_cb(esp_ble_mesh_cfg_server_cb_event_t event,
+                                      esp_ble_mesh_cfg_server_cb_param_t *param)
+{
+    if (event != ESP_BLE_MESH_CFG_SERVER_STATE_CHANGE_EVT) {
+        return;
+    }
+
+    switch (param->ctx.recv_op) {
+    case ESP_BLE_MESH_MODEL_OP_APP_KEY_ADD:
+        CORE_LOGI("AppKey added: net_idx 0x%04x, app_idx 0x%04x",
+                  param->value.state_change.appkey_add.net_idx,
+                  param->value.state_change.appkey_add.app_idx);
+        break;
+    case ESP_BLE_MESH_MODEL_OP_MODEL_APP_BIND: {
+        uint16_t model_id = param->value.state_change.mod_app_bind.model_id;
+        CORE_LOGI("Model bound: elem_addr 0x%04x, app_idx 0x%04x, mod_id 0x%04x",
+                  param->value.state_change.mod_app_bind.element_addr,
+                  param->value.state_change.mod_app_bind.app_idx, model_id);
+        for (int i = 0; i < MESH_MSG_TYPE_COUNT; i++) {
+            if (mesh_codec_desc((mesh_msg_type_t)i)->client_model_id == model_id) {
+                bool first_bind = app_state.app_idx == ESP_BLE_MESH_KEY_UNUSED;
+                app_state.app_idx = param->value.state_change.mod_app_bind.app_idx;
+                mesh_info_store();
+                if (first_bind) {
+                    subscribe_status_group();
+                }
+                break;
+            }
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+static void ble_mesh_generic_client_cb(esp_ble_mesh_generic_client_cb_event_t event,
+                                       esp_ble_mesh_generic_client_cb_param_t *param)
+{
+    if (event == ESP_BLE_MESH_GENERIC_CLIENT_TIMEOUT_EVT) {
+        report_timeout(param->params->opcode, param->params->ctx.addr);
+        return;
+    }
+    if (param->error_code) {
+        CORE_LOGE("Generic client error: event %u, error_code %d, opcode 0x%04" PRIx32,
+                  event, param->error_code, param->params->opcode);
+        return;
+    }
+    if (event != ESP_BLE_MESH_GENERIC_CLIENT_GET_STATE_EVT &&
+        event != ESP_BLE_MESH_GENERIC_CLIENT_SET_STATE_EVT &&
+        event != ESP_BLE_MESH_GENERIC_CLIENT_PUBLISH_EVT) {
+        return;
+    }
+
+    mesh_core_status_t status = {
+        .source = status_source(event == ESP_BLE_MESH_GENERIC_CLIENT_GET_STATE_EVT,
+                                event == ESP_BLE_MESH_GENERIC_CLIENT_SET_STATE_EVT),
+        .addr = param->params->ctx.addr,
+        .recv_ttl = param->params->ctx.recv_ttl,
+    };
+    switch (param->params->ctx.recv_op) {
+    case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_STATUS:
+        status.type = MESH_MSG_ONOFF;
+        status.onoff = param->status_cb.onoff_status.present_onoff;
+        break;
+    case ESP_BLE_MESH_MODEL_OP_GEN_LEVEL_STATUS:
+        status.type = MESH_MSG_LEVEL;
+        status.level = param->status_cb.level_status.present_level;
+        break;
+    default:
+        return;
+    }
+    mesh_link_on_status(status.addr, status.recv_ttl);
+    if (s_config.on_status) {
+        s_config.on_status(&status);
+    }
+}
+
+static void ble_mesh_lighting_client_cb(esp_ble_mesh_light_client_cb_event_t event,
+                                        esp_ble_mesh_light_client_cb_param_t *param)
+{
+    if (event == ESP_BLE_MESH_LIGHT_CLIENT_TIMEOUT_EVT) {
+        report_timeout(param->params->opcode, param->params->ctx.addr);
+        return;
+    }
+    if (param->error_code) {
+        CORE_LOGE("Lighting client error: event %u, error_code %d, opcode 0x%04" PRIx32,
+                  event, param->error_code, param->params->opcode);
+        return;
+    }
+    if (event != ESP_BLE_MESH_LIGHT_CLIENT_GET_STATE_EVT &&
+        event != ESP_BLE_MESH_LIGHT_CLIENT_SET_STATE_EVT &&
+        event != ESP_BLE_MESH_LIGHT_CLIENT_PUBLISH_EVT) {
+        return;
+    }
+
+    mesh_core_status_t status = {
+        .source = status_source(event == ESP_BLE_MESH_LIGHT_CLIENT_GET_STATE_EVT,
+                                event == ESP_BLE_MESH_LIGHT_CLIENT_SET_STATE_EVT),
+        .addr = param->params->ctx.addr,
+        .recv_ttl = param->params->ctx.recv_ttl,
+    };
+    switch (param->params->ctx.recv_op) {
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_LIGHTNESS_STATUS:
+        status.type = MESH_MSG_LIGHTNESS;
+        status.lightness = param->status_cb.lightness_status.present_lightness;
+        break;
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_STATUS:
+        status.type = MESH_MSG_HSL;
+        status.hsl.lightness = param->status_cb.hsl_status.hsl_lightness;
+        status.hsl.hue = param->status_cb.hsl_status.hsl_hue;
+        status.hsl.saturation = param->status_cb.hsl_status.hsl_saturation;
+        break;
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_LIGHTNESS_RANGE_STATUS:
+        status.type = MESH_MSG_LIGHTNESS_RANGE;
+        status.range.status_code = param->status_cb.lightness_range_status.status_code;
+        status.range.min = param->status_cb.lightness_range_status.range_min;
+        status.range.max = param->status_cb.lightness_range_status.range_max;
+        break;
+    default:
+        return;
+    }
+    mesh_link_on_status(status.addr, status.recv_ttl);
+    if (s_config.on_status) {
+        s_config.on_status(&status);
+    }
+}
+
+// Sets sent with esp_ble_mesh_client_model_send_msg() report send failures and
+// response timeouts here rather than through the SIG client callbacks.
+static void ble_mesh_model_cb(esp_ble_mesh_model_cb_event_t event, esp_ble_mesh_model_cb_param_t *param)
+{
+    switch (event) {
+    case ESP_BLE_MESH_MODEL_SEND_COMP_EVT:
+        if (param->model_send_comp.err_code) {
+            CORE_LOGE("Failed to send opcode 0x%04" PRIx32 " (err %d)",
+                      param->model_send_comp.opcode, param->model_send_comp.err_code);
+            // Never reached the air: says nothing about the link or the lamp
+            if (s_config.on_send_failed) {
+                mesh_msg_type_t type;
+                if (!mesh_codec_type_from_opcode(param->model_send_comp.opcode, &type)) {
+                    type = MESH_MSG_TYPE_COUNT;
+                }
+                s_config.on_send_failed(param->model_send_comp.ctx->addr, type,
+                                        param->model_send_comp.err_code);
+            }
+        }
+        break;
+    case ESP_BLE_MESH_CLIENT_MODEL_SEND_TIMEOUT_EVT:
+        CORE_LOGW("No status from 0x%04X for opcode 0x%04" PRIx32,
+                  param->client_send_timeout.ctx->addr, param->client_send_timeout.opcode);
+        report_timeout(param->client_send_timeout.opcode, param->client_send_timeout.ctx->addr);
+        break;
+    default:
+        break;
+    }
+}
+
+/* --- Public API --- */
+
+esp_err_t mesh_core_init(const mesh_core_config_t *config)
+{
+    esp_err_t err;
+
+    s_config = *config;
+    if (s_config.net_transmit_max == 0) {
+        s_config.net_transmit_min = s_config.net_transmit_count;
+        s_config.net_transmit_max = s_config.net_transmit_count;
+    }
+    mesh_link_init(s_config.ttl_max ? s_config.ttl_max : DEFAULT_TTL, s_config.net_transmit_count,
+                   s_config.net_transmit_min, s_config.net_transmit_max);
+    s_transmit_count = mesh_link_transmit_count();
+    config_server.net_transmit = ESP_BLE_MESH_TRANSMIT(s_transmit_count,
+                                                       s_config.net_transmit_interval_ms);
+    config_server.relay_retransmit = config_server.net_transmit;
+
+    err = esp_efuse_mac_get_default(dev_uuid);
+    if (err != ESP_OK) {
+        CORE_LOGE("Failed to read MAC for device UUID (err %d)", err);
+        return err;
+    }
+
+    mesh_info_restore();
+    mesh_tid_init();
+
+    esp_ble_mesh_register_prov_callback(ble_mesh_provisioning_cb);
+    esp_ble_mesh_register_config_server_callback(ble_mesh_config_server_cb);
+    esp_ble_mesh_register_generic_client_callback(ble_mesh_generic_client_cb);
+    esp_ble_mesh_register_light_client_callback(ble_mesh_lighting_client_cb);
+    esp_ble_mesh_register_custom_model_callback(ble_mesh_model_cb);
+
+    err = esp_ble_mesh_init(&provision, &composition);
+    if (err == ESP_ERR_INVALID_STATE) {
+        // Left over from a previous init (e.g. a component restart)
+        CORE_LOGW("Mesh stack already initialized, re-initializing");
+        esp_ble_mesh_deinit(NULL);
+        err = esp_ble_mesh_init(&provision, &composition);
+    }
+    if (err != ESP_OK) {
+        CORE_LOGE("Failed to initialize mesh stack (err %d)", err);
+        return err;
+    }
+
+    err = esp_ble_mesh_node_prov_enable(ESP_BLE_MESH_PROV_ADV | ESP_BLE_MESH_PROV_GATT);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+        CORE_LOGE("Failed to enable mesh node (err %d)", err);
+        return err;
+    }
+
+    subscribe_status_group();
+
+    CORE_LOGI("BLE Mesh node initialized");
+    return ESP_OK;
+}
+
+bool mesh_core_is_ready(void)
+{
+    return app_state.app_idx != ESP_BLE_MESH_KEY_UNUSED;
+}
+
+esp_err_t mesh_core_send(const mesh_msg_t *msg)
+{
+    uint8_t params[MESH_CODEC_MAX_PARAMS];
+
+    if (app_state.app_idx == ESP_BLE_MESH_KEY_UNUSED) {
+        CORE_LOGE("Cannot send to 0x%04X: AppKey has not been bound yet!", msg->addr);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    const mesh_codec_desc_t *desc = mesh_codec_desc(msg->type);
+    if (desc == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t len = 0;
+    if (!msg->get) {
+        len = mesh_codec_encode_set(msg, mesh_tid_next(msg->addr), params, sizeof(params));
+        if (len == 0) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    bool need_rsp = msg->ack || msg->get;
+
+    esp_ble_mesh_msg_ctx_t ctx = {
+        .net_idx = app_state.net_idx,
+        .app_idx = app_state.app_idx,
+        .addr = msg->addr,
+        .send_ttl = mesh_link_ttl(msg->addr),
+        .send_rel = false,
+    };
+    uint32_t opcode = msg->get ? desc->op_get : mesh_codec_set_opcode(msg);
+
+    // The stack reads Network Transmit from the Config Server state on every send
+    uint8_t count = mesh_link_transmit_count();
+    if (count != s_transmit_count) {
+        CORE_LOGI("Network transmit count %d -> %d", s_transmit_count, count);
+        s_transmit_count = count;
+        config_server.net_transmit = ESP_BLE_MESH_TRANSMIT(count, s_config.net_transmit_interval_ms);
+    }
+
+    ESP_LOGD(TAG, "Sending %s %s (opcode 0x%04" PRIx32 ") to 0x%04X, TTL %d",
+             desc->name, msg->get ? "Get" : "Set", opcode, msg->addr, ctx.send_ttl);
+
+    esp_err_t err = esp_ble_mesh_client_model_send_msg(s_clients[msg->type]->model, &ctx, opcode,
+                                                       len, params,
+                                                       need_rsp ? s_config.ack_timeout_ms : 0,
+                                                       need_rsp, ROLE_NODE);
+    if (err != ESP_OK) {
+        CORE_LOGE("Failed to send %s %s to 0x%04X (err %d)", desc->name, msg->get ? "Get" : "Set",
+                  msg->addr, err);
+    } else {
+        mesh_link_on_sent(msg->addr, need_rsp);
+    }
+    return err;
+}
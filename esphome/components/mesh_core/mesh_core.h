@@ -0,0 +1,110 @@
+#pragma once
+
+/*
+ * mesh_core.h - BLE Mesh node shared by the ESP-IDF firmware and the ESPHome
+ *               ble_mesh_gateway component
+ *
+ * Owns the node composition (Config Server plus OnOff, Level, Lightness and
+ * HSL clients), the provisioning state persisted in NVS, and the single send
+ * path for Set messages. Applications receive decoded lamp status through the
+ * callbacks in mesh_core_config_t.
+ */
+
+#include "esp_err.h"
+#include "mesh_codec.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    MESH_CORE_STATUS_PUBLISH = 0, // Unsolicited status (publication, reply to an unacked Set)
+    MESH_CORE_STATUS_SET_REPLY,   // Reply to one of our acknowledged Sets
+    MESH_CORE_STATUS_GET_REPLY,   // Reply to a Get
+} mesh_core_status_src_t;
+
+// Decoded status message from a lamp.
+typedef struct {
+    mesh_msg_type_t type;
+    mesh_core_status_src_t source;
+    uint16_t addr;          // Element that sent the status
+    uint8_t recv_ttl;
+    union {
+        uint8_t onoff;
+        int16_t level;
+        uint16_t lightness;
+        struct {
+            uint16_t lightness;
+            uint16_t hue;
+            uint16_t saturation;
+        } hsl;
+        struct {
+            uint8_t status_code;    // 0 = success
+            uint16_t min;
+            uint16_t max;
+        } range;                    // MESH_MSG_LIGHTNESS_RANGE
+    };
+} mesh_core_status_t;
+
+typedef struct {
+    // Blob key in the "ble_mesh" NVS namespace holding net/app key indexes
+    const char *nvs_key;
+    // Network Transmit state: transmissions per message and spacing
+    uint8_t net_transmit_count;
+    uint16_t net_transmit_interval_ms;
+    // Bounds for tuning the transmit count to the observed loss rate;
+    // net_transmit_max 0 keeps net_transmit_count fixed
+    uint8_t net_transmit_min;
+    uint8_t net_transmit_max;
+    // TTL for destinations of unknown distance and groups, and upper bound
+    // for the per-lamp TTL measured from status messages; 0 = 7
+    uint8_t ttl_max;
+    // Group the lamps publish their status to (set up on the lamps with the
+    // provisioning app); the client models subscribe to it. 0xC000-0xFEFF,
+    // or 0 = none
+    uint16_t status_group;
+    // Time the stack waits for the status of an acknowledged Set
+    int32_t ack_timeout_ms;
+
+    // Callbacks, all optional. Called from the BLE Mesh task; keep them short.
+    void (*on_prov_complete)(uint16_t net_idx, uint16_t addr);
+    void (*on_status)(const mesh_core_status_t *status);
+    // An acknowledged Set or a Get went out but got no status
+    void (*on_timeout)(uint16_t addr, mesh_msg_type_t type);
+    // The stack failed to send a message, so neither a status nor a timeout
+    // follows; -ENOBUFS means it is out of advertising buffers. type is
+    // MESH_MSG_TYPE_COUNT for an opcode mesh_codec does not know.
+    void (*on_send_failed)(uint16_t addr, mesh_msg_type_t type, int err);
+} mesh_core_config_t;
+
+/**
+ * @brief Restores the provisioning state and starts the BLE Mesh node.
+ *
+ * The Bluetooth controller and host must already be enabled and NVS initialized.
+ *
+ * @param config Node settings and callbacks. Copied.
+ * @return ESP_OK on success, or the error from the mesh stack.
+ */
+esp_err_t mesh_core_init(const mesh_core_config_t *config);
+
+/**
+ * @brief Whether the node has been provisioned and an AppKey bound to its clients.
+ */
+bool mesh_core_is_ready(void);
+
+/**
+ * @brief Encodes and transmits a Set or Get message.
+ *
+ * @param msg The message. Acknowledged Sets report their status through
+ *            on_status (source MESH_CORE_STATUS_SET_REPLY) or on_timeout,
+ *            Gets through on_status (source MESH_CORE_STATUS_GET_REPLY) or
+ *            on_timeout; a message the stack fails to send through
+ *            on_send_failed.
+ * @return ESP_OK on success, ESP_ERR_INVALID_STATE if no AppKey is bound,
+ *         ESP_ERR_INVALID_ARG for an unknown message type.
+ */
+esp_err_t mesh_core_send(const mesh_msg_t *msg);
+
+#ifdef __cplusplus
+}
+#endif
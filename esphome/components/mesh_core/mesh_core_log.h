@@ -0,0 +1,21 @@
+#pragma once
+
+/*
+ * mesh_core_log.h - Logging for mesh_core sources (private)
+ *
+ * ESP_LOGx output from C files does not reach the ESPHome logger, so ESPHome
+ * builds (which define USE_ESP32) print directly. Define TAG before use.
+ */
+
+#include <stdio.h>
+#include "esp_log.h"
+
+#ifdef USE_ESP32
+#define CORE_LOGI(fmt, ...) printf("[I][%s]: " fmt "\n", TAG, ##__VA_ARGS__)
+#define CORE_LOGW(fmt, ...) printf("[W][%s]: " fmt "\n", TAG, ##__VA_ARGS__)
+#define CORE_LOGE(fmt, ...) printf("[E][%s]: " fmt "\n", TAG, ##__VA_ARGS__)
+#else
+#define CORE_LOGI(fmt, ...) ESP_LOGI(TAG, fmt, ##__VA_ARGS__)
+#define CORE_LOGW(fmt, ...) ESP_LOGW(TAG, fmt, ##__VA_ARGS__)
+#define CORE_LOGE(fmt, ...) ESP_LOGE(TAG, fmt, ##__VA_ARGS__)
+#endif
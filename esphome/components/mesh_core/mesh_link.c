@@ -0,0 +1,233 @@
+/*
+ * mesh_link.c - Per-destination TTL and transmit count tuning
+ *
+ * A fixed TTL of 7 and four Network Transmit repetitions let every message to
+ * a lamp next to the gateway flood the whole mesh through the relays. Instead,
+ * the distance of each lamp is measured from the TTL its status messages
+ * arrive with, and Sets to it get just enough TTL to cover that distance.
+ *
+ * Lamps send with their Default TTL, and every relay decrements it by one, so
+ * the highest receive TTL seen from any lamp approximates the Default TTL and
+ * the difference to a lamp's receive TTL is its relay count. When a higher TTL
+ * turns up, every distance measured so far grows by the same amount, since
+ * unacknowledged Sets would otherwise keep using a too short one unnoticed.
+ * Underestimating a distance costs a lost message; for an acknowledged one
+ * the lamp then falls back to the maximum TTL until its next status
+ * recalibrates it.
+ *
+ * The Network Transmit count is node-wide. It follows the loss rate of lamps
+ * that answer: an acknowledged Set or Get to a lamp that replied before counts
+ * as a loss only when the stack reports that its reply timed out. Unacknowledged
+ * Sets expect nothing and are not counted, and lamps that never report a
+ * status are ignored.
+ */
+
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "mesh_core_log.h"
+#include "mesh_link.h"
+
+#define TAG "MESH_LINK"
+
+#ifndef MESH_LINK_SLOTS
+#define MESH_LINK_SLOTS 48          // Lamps the gateway talks to
+#endif
+#define TTL_MIN 2                   // 1 is prohibited, 0 would not be relayed
+#define TTL_SLACK 1                 // Extra hops on top of the measured distance
+#define MISSES_UNTIL_SILENT 3       // Consecutive misses before a lamp stops counting
+#define ADAPT_SAMPLES 32            // Outcomes per transmit count decision
+#define LOSS_RAISE_PCT 10           // Loss above which the count goes up
+#define LOSS_LOWER_PCT 2            // Loss below which the count goes down
+
+typedef struct {
+    uint16_t addr;                  // 0 = free
+    bool hops_known;
+    uint8_t relays;
+    bool responsive;                // Has answered a Set since its last silence
+    bool awaiting;                  // Sent a message expecting a reply, none seen yet
+    uint8_t misses;
+    uint32_t last_use;
+} link_slot_t;
+
+static link_slot_t s_slots[MESH_LINK_SLOTS];
+static uint32_t s_use_counter = 0;
+static uint8_t s_peer_ttl = 0;      // Highest receive TTL seen
+static uint8_t s_ttl_max = 7;
+static uint8_t s_count, s_count_min, s_count_max;
+static uint16_t s_samples = 0, s_losses = 0;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static inline bool is_unicast(uint16_t addr)
+{
+    return addr != 0 && addr < 0x8000;
+}
+
+// Call with s_lock held. Returns NULL for unknown addresses unless create is set.
+static link_slot_t *slot_for(uint16_t addr, bool create)
+{
+    link_slot_t *free_slot = NULL;
+    link_slot_t *oldest = NULL;
+
+    for (int i = 0; i < MESH_LINK_SLOTS; i++) {
+        link_slot_t *s = &s_slots[i];
+        if (s->addr == addr) {
+            s->last_use = s_use_counter++;
+            return s;
+        }
+        if (s->addr == 0) {
+            if (free_slot == NULL) {
+                free_slot = s;
+            }
+        } else if (oldest == NULL || (int32_t)(s->last_use - oldest->last_use) < 0) {
+            oldest = s;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    link_slot_t *victim = free_slot ? free_slot : oldest;
+    memset(victim, 0, sizeof(*victim));
+    victim->addr = addr;
+    victim->last_use = s_use_counter++;
+    return victim;
+}
+
+// Call with s_lock held.
+static void record_outcome(bool lost)
+{
+    s_samples++;
+    if (lost) {
+        s_losses++;
+    }
+    if (s_samples < ADAPT_SAMPLES) {
+        return;
+    }
+
+    uint32_t loss_pct = s_losses * 100 / s_samples;
+    if (loss_pct > LOSS_RAISE_PCT && s_count < s_count_max) {
+        s_count++;
+    } else if (loss_pct < LOSS_LOWER_PCT && s_count > s_count_min) {
+        s_count--;
+    }
+    s_samples = 0;
+    s_losses = 0;
+}
+
+// Call with s_lock held.
+static void record_miss(link_slot_t *s)
+{
+    s->awaiting = false;
+    s->hops_known = false;
+    if (!s->responsive) {
+        return;
+    }
+    record_outcome(true);
+    if (++s->misses >= MISSES_UNTIL_SILENT) {
+        s->responsive = false;
+    }
+}
+
+void mesh_link_init(uint8_t ttl_max, uint8_t count, uint8_t count_min, uint8_t count_max)
+{
+    s_ttl_max = ttl_max < TTL_MIN ? TTL_MIN : ttl_max;
+    if (count_min > count_max) {
+        count_min = count_max;
+    }
+    s_count_min = count_min;
+    s_count_max = count_max;
+    s_count = count < count_min ? count_min : count > count_max ? count_max : count;
+}
+
+uint8_t mesh_link_ttl(uint16_t dst)
+{
+    uint8_t ttl = s_ttl_max;
+
+    if (!is_unicast(dst)) {
+        return ttl;
+    }
+    portENTER_CRITICAL(&s_lock);
+    link_slot_t *s = slot_for(dst, false);
+    if (s != NULL && s->hops_known) {
+        ttl = s->relays + 1 + TTL_SLACK;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (ttl < TTL_MIN) {
+        ttl = TTL_MIN;
+    }
+    return ttl > s_ttl_max ? s_ttl_max : ttl;
+}
+
+void mesh_link_on_sent(uint16_t dst, bool need_rsp)
+{
+    if (!is_unicast(dst)) {
+        return;
+    }
+    portENTER_CRITICAL(&s_lock);
+    link_slot_t *s = slot_for(dst, true);
+    if (need_rsp) {
+        // A loss is only recorded when the stack reports the timeout
+        s->awaiting = true;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void mesh_link_on_status(uint16_t src, uint8_t recv_ttl)
+{
+    if (!is_unicast(src)) {
+        return;
+    }
+    portENTER_CRITICAL(&s_lock);
+    if (recv_ttl > s_peer_ttl) {
+        // Every distance so far was measured against a Default TTL that was
+        // too low by the difference
+        uint8_t rise = recv_ttl - s_peer_ttl;
+        for (int i = 0; i < MESH_LINK_SLOTS; i++) {
+            if (s_slots[i].addr != 0 && s_slots[i].hops_known) {
+                s_slots[i].relays += rise;
+            }
+        }
+        s_peer_ttl = recv_ttl;
+    }
+    uint8_t relays = s_peer_ttl - recv_ttl;
+
+    link_slot_t *s = slot_for(src, true);
+    if (!s->hops_known || relays > s->relays) {
+        s->relays = relays;
+        s->hops_known = true;
+    } else if (relays < s->relays) {
+        // Shorter routes come and go; only creep towards them
+        s->relays--;
+    }
+    if (s->awaiting) {
+        s->awaiting = false;
+        s->responsive = true;
+        s->misses = 0;
+        record_outcome(false);
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void mesh_link_on_timeout(uint16_t dst)
+{
+    if (!is_unicast(dst)) {
+        return;
+    }
+    portENTER_CRITICAL(&s_lock);
+    link_slot_t *s = slot_for(dst, false);
+    if (s != NULL && s->awaiting) {
+        record_miss(s);
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+uint8_t mesh_link_transmit_count(void)
+{
+    portENTER_CRITICAL(&s_lock);
+    uint8_t count = s_count;
+    portEXIT_CRITICAL(&s_lock);
+    return count;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+/*
+ * mesh_link.h - Per-destination TTL and transmit count tuning (private to mesh_core)
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Sets the tuning bounds. With count_min == count_max the transmit
+ *        count stays at @p count.
+ *
+ * @param ttl_max TTL for destinations whose distance is unknown, and the upper bound.
+ * @param count Initial Network Transmit count.
+ * @param count_min Lowest transmit count the tuning may choose.
+ * @param count_max Highest transmit count the tuning may choose.
+ */
+void mesh_link_init(uint8_t ttl_max, uint8_t count, uint8_t count_min, uint8_t count_max);
+
+/**
+ * @brief TTL for the next message to @p dst: the hop count seen in its status
+ *        messages plus one hop of slack, or ttl_max while it is unknown.
+ */
+uint8_t mesh_link_ttl(uint16_t dst);
+
+/**
+ * @brief Records a message sent to @p dst.
+ *
+ * @param need_rsp The message expects a status (acknowledged Set or Get);
+ *                 only those can later count as a loss.
+ */
+void mesh_link_on_sent(uint16_t dst, bool need_rsp);
+
+/**
+ * @brief Records a status message from @p src and the TTL it arrived with.
+ */
+void mesh_link_on_status(uint16_t src, uint8_t recv_ttl);
+
+/**
+ * @brief Records that an acknowledged message to @p dst got no status. A
+ *        destination that has answered before counts as a loss.
+ */
+void mesh_link_on_timeout(uint16_t dst);
+
+/**
+ * @brief Network Transmit count chosen from the recent loss rate.
+ */
+uint8_t mesh_link_transmit_count(void);
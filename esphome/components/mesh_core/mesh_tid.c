@@ -0,0 +1,220 @@
+/*
+ * mesh_tid.c - Per-destination transaction identifiers
+ *
+ * A lamp ignores a Set whose (source, destination, TID) matches the previous
+ * one it saw within 6 seconds. If TIDs restart from a stale value after a
+ * reboot, the first commands can be dropped as retransmissions.
+ *
+ * Each destination therefore reserves TIDs in blocks. NVS holds a bound, and
+ * no TID sent so far has gone TID_BLOCK or more past it. At boot every
+ * destination starts TID_BLOCK past its bound, so its first TID always
+ * differs from the ones it may have seen. A new block is reserved when half
+ * the current one is used, and reservations are written together after a
+ * short delay, so NVS sees at most one write per TID_BLOCK / 2 messages to a
+ * lamp. When a destination gets within TID_BLOCK / 4 of its stored bound, the
+ * pending write is brought forward; it still happens on the timer task, so a
+ * send never waits for flash, and the slack past the bound covers the sends
+ * made until it lands.
+ */
+
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+#include "mesh_core_log.h"
+#include "mesh_tid.h"
+
+#define TAG "MESH_TID"
+
+#define NVS_NAMESPACE "ble_mesh"
+#define NVS_TID_KEY "mesh_tid"
+
+#ifndef MESH_TID_SLOTS
+#define MESH_TID_SLOTS 48           // Lamps plus groups
+#endif
+#define TID_BLOCK 32                // TIDs reserved per destination and NVS write
+#define TID_FLUSH_DELAY_US (5 * 1000 * 1000)
+
+typedef struct {
+    uint16_t addr;                  // 0 = free
+    uint8_t next;                   // TID for the next message
+    uint8_t reserved;               // Bound to persist; stays ahead of next
+    uint8_t persisted;              // Bound currently in NVS
+    uint32_t last_use;              // For eviction when the table is full
+} tid_slot_t;
+
+// NVS record; layout must stay stable
+typedef struct {
+    uint16_t addr;
+    uint8_t reserved;
+} __attribute__((packed)) tid_record_t;
+
+static tid_slot_t s_slots[MESH_TID_SLOTS];
+static uint32_t s_use_counter = 0;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t s_flush_timer = NULL;
+static SemaphoreHandle_t s_flush_lock = NULL;   // One NVS write at a time
+
+static void tid_flush(void)
+{
+    tid_record_t records[MESH_TID_SLOTS];
+    int count = 0;
+
+    // Without this an older snapshot could reach flash after a newer one and
+    // mark bounds as persisted that NVS no longer holds
+    xSemaphoreTake(s_flush_lock, portMAX_DELAY);
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < MESH_TID_SLOTS; i++) {
+        if (s_slots[i].addr != 0) {
+            records[count].addr = s_slots[i].addr;
+            records[count].reserved = s_slots[i].reserved;
+            count++;
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(handle, NVS_TID_KEY, records, count * sizeof(tid_record_t));
+        if (err == ESP_OK) {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+    if (err != ESP_OK) {
+        CORE_LOGE("Failed to store TID reservations (err %d)", err);
+        xSemaphoreGive(s_flush_lock);
+        return;
+    }
+
+    // Only what actually reached flash counts as persisted
+    portENTER_CRITICAL(&s_lock);
+    for (int r = 0; r < count; r++) {
+        for (int i = 0; i < MESH_TID_SLOTS; i++) {
+            if (s_slots[i].addr == records[r].addr) {
+                s_slots[i].persisted = records[r].reserved;
+                break;
+            }
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+    xSemaphoreGive(s_flush_lock);
+}
+
+static void tid_flush_timer_cb(void *arg)
+{
+    tid_flush();
+}
+
+// Call with s_lock held. Sets *created when the destination was not known.
+static tid_slot_t *slot_for(uint16_t dst, bool *created)
+{
+    tid_slot_t *free_slot = NULL;
+    tid_slot_t *oldest = NULL;
+
+    for (int i = 0; i < MESH_TID_SLOTS; i++) {
+        tid_slot_t *s = &s_slots[i];
+        if (s->addr == dst) {
+            return s;
+        }
+        if (s->addr == 0) {
+            if (free_slot == NULL) {
+                free_slot = s;
+            }
+        } else if (oldest == NULL || (int32_t)(s->last_use - oldest->last_use) < 0) {
+            oldest = s;
+        }
+    }
+
+    // Unknown destination: a random start is as good as any. Nothing is stored
+    // for it yet, so persisted is its start and the first block is written
+    // right away. When the table is full the least recently used destination
+    // gives way.
+    tid_slot_t *victim = free_slot ? free_slot : oldest;
+    victim->addr = dst;
+    victim->next = (uint8_t)esp_random();
+    victim->reserved = victim->next + TID_BLOCK;
+    victim->persisted = victim->next;
+    *created = true;
+    return victim;
+}
+
+esp_err_t mesh_tid_init(void)
+{
+    tid_record_t records[MESH_TID_SLOTS];
+    size_t len = sizeof(records);
+    int count = 0;
+
+    s_flush_lock = xSemaphoreCreateMutex();
+    if (s_flush_lock == NULL) {
+        CORE_LOGE("Failed to create TID flush mutex");
+        return ESP_ERR_NO_MEM;
+    }
+
+    nvs_handle_t handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+        if (nvs_get_blob(handle, NVS_TID_KEY, records, &len) == ESP_OK) {
+            count = len / sizeof(tid_record_t);
+        }
+        nvs_close(handle);
+    }
+
+    for (int i = 0; i < count; i++) {
+        // Jump a block past the persisted bound; sends made while a write was
+        // still pending never got that far
+        s_slots[i].addr = records[i].addr;
+        s_slots[i].next = records[i].reserved + TID_BLOCK;
+        s_slots[i].reserved = s_slots[i].next + TID_BLOCK;
+        s_slots[i].persisted = records[i].reserved;
+    }
+    if (count > 0) {
+        CORE_LOGI("Restored TIDs for %d destinations", count);
+        tid_flush();
+    }
+
+    const esp_timer_create_args_t args = {
+        .callback = tid_flush_timer_cb,
+        .name = "mesh_tid",
+    };
+    esp_err_t err = esp_timer_create(&args, &s_flush_timer);
+    if (err != ESP_OK) {
+        CORE_LOGE("Failed to create TID flush timer (err %d)", err);
+    }
+    return err;
+}
+
+uint8_t mesh_tid_next(uint16_t dst)
+{
+    bool flush_soon;
+    bool flush_later = false;
+    uint8_t tid;
+
+    portENTER_CRITICAL(&s_lock);
+    tid_slot_t *slot = slot_for(dst, &flush_later);
+    if ((uint8_t)(slot->reserved - slot->next) <= TID_BLOCK / 2) {
+        slot->reserved += TID_BLOCK;
+        flush_later = true;
+    }
+    // Running TID_BLOCK past persisted would break the guarantee after a
+    // reboot, so the write that moves it on should not wait out the delay
+    flush_soon = (int8_t)(slot->persisted - slot->next) <= TID_BLOCK / 4;
+    tid = slot->next++;
+    slot->last_use = s_use_counter++;
+    portEXIT_CRITICAL(&s_lock);
+
+    if (s_flush_timer == NULL) {
+        return tid;
+    }
+    if (flush_soon) {
+        esp_timer_stop(s_flush_timer);
+        esp_timer_start_once(s_flush_timer, 0);
+    } else if (flush_later && !esp_timer_is_active(s_flush_timer)) {
+        esp_timer_start_once(s_flush_timer, TID_FLUSH_DELAY_US);
+    }
+    return tid;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+/*
+ * mesh_tid.h - Per-destination transaction identifiers (private to mesh_core)
+ */
+
+#include <stdint.h>
+#include "esp_err.h"
+
+/**
+ * @brief Loads the persisted TID reservations and moves every destination
+ *        past the TIDs it may have seen before the restart.
+ *
+ * NVS must be initialized.
+ */
+esp_err_t mesh_tid_init(void);
+
+/**
+ * @brief Returns the TID for the next Set to @p dst.
+ *
+ * Never writes NVS itself: new reservations are stored in batches by a timer,
+ * which runs at once when a destination gets close to its stored reservation.
+ */
+uint8_t mesh_tid_next(uint16_t dst);
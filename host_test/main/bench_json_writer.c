@@ -0,0 +1,113 @@
+/*
+ * bench_json_writer.c - JSON writer against cJSON for a discovery config
+ *
+ * The cJSON path is the one the gateway used before: build a tree, print it
+ * to a heap string, free both. Timings are wall clock on the host and only
+ * meaningful relative to each other.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cJSON.h"
+
+#include "host_test.h"
+#include "json_writer.h"
+
+#define BENCH_ITERATIONS 100000
+
+int json_bench_writer(char *buf, size_t len)
+{
+    json_writer_t w;
+
+    json_init(&w, buf, len);
+    json_obj_begin(&w, NULL);
+    json_null(&w, "name");
+    json_str(&w, "~", "homeassistant/light/living_room");
+    json_str(&w, "cmd_t", "~/set");
+    json_str(&w, "stat_t", "~/state");
+    json_str(&w, "schema", "json");
+    json_str(&w, "avty_t", "~/availability");
+    json_bool(&w, "brightness", true);
+    json_int(&w, "bri_scl", 65535);
+    json_str(&w, "sup_clrm", "hs");
+    json_str(&w, "uniq_id", "0x0005");
+    json_obj_begin(&w, "dev");
+    json_str(&w, "name", "living_room");
+    json_str(&w, "identifiers", "0x0005");
+    json_str(&w, "manufacturer", "Espressif");
+    json_str(&w, "model", "BLE Mesh Lamp");
+    json_obj_end(&w);
+    json_obj_end(&w);
+    return json_finish(&w);
+}
+
+cJSON *json_bench_cjson(void)
+{
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddNullToObject(root, "name");
+    cJSON_AddStringToObject(root, "~", "homeassistant/light/living_room");
+    cJSON_AddStringToObject(root, "cmd_t", "~/set");
+    cJSON_AddStringToObject(root, "stat_t", "~/state");
+    cJSON_AddStringToObject(root, "schema", "json");
+    cJSON_AddStringToObject(root, "avty_t", "~/availability");
+    cJSON_AddTrueToObject(root, "brightness");
+    cJSON_AddNumberToObject(root, "bri_scl", 65535);
+    cJSON_AddStringToObject(root, "sup_clrm", "hs");
+    cJSON_AddStringToObject(root, "uniq_id", "0x0005");
+    cJSON *dev = cJSON_AddObjectToObject(root, "dev");
+    cJSON_AddStringToObject(dev, "name", "living_room");
+    cJSON_AddStringToObject(dev, "identifiers", "0x0005");
+    cJSON_AddStringToObject(dev, "manufacturer", "Espressif");
+    cJSON_AddStringToObject(dev, "model", "BLE Mesh Lamp");
+    return root;
+}
+
+static size_t s_allocations;
+
+static void *counting_malloc(size_t size)
+{
+    s_allocations++;
+    return malloc(size);
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void run_json_writer_bench(void)
+{
+    char buf[JSON_BENCH_PAYLOAD_LEN];
+    size_t total = 0;               // Keeps the loops from being optimised away
+
+    double start = now_ns();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        total += json_bench_writer(buf, sizeof(buf));
+    }
+    double writer_ns = (now_ns() - start) / BENCH_ITERATIONS;
+
+    cJSON_Hooks hooks = { .malloc_fn = counting_malloc, .free_fn = free };
+    cJSON_InitHooks(&hooks);
+    s_allocations = 0;
+    start = now_ns();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        cJSON *root = json_bench_cjson();
+        char *printed = cJSON_PrintUnformatted(root);
+        total += printed ? strlen(printed) : 0;
+        cJSON_free(printed);
+        cJSON_Delete(root);
+    }
+    double cjson_ns = (now_ns() - start) / BENCH_ITERATIONS;
+    cJSON_InitHooks(NULL);
+
+    printf("Discovery config, %d iterations (%zu bytes written):\n", BENCH_ITERATIONS, total);
+    printf("  json_writer: %8.0f ns per payload, no heap\n", writer_ns);
+    printf("  cJSON:       %8.0f ns per payload, %zu heap allocations\n", cjson_ns,
+           s_allocations / BENCH_ITERATIONS);
+    printf("  speedup:     %8.1fx\n", cjson_ns / writer_ns);
+}
@@ -0,0 +1,22 @@
+#ifndef HOST_TEST_H
+#define HOST_TEST_H
+
+#include <stddef.h>
+
+#include "cJSON.h"
+
+// Each test file runs its cases with RUN_TEST()
+void run_cmd_parse_tests(void);
+void run_json_writer_tests(void);
+
+// Discovery config used by the JSON writer benchmark, built both ways
+#define JSON_BENCH_PAYLOAD_LEN 512
+int json_bench_writer(char *buf, size_t len);
+cJSON *json_bench_cjson(void);
+
+/**
+ * @brief Times the JSON writer against cJSON and prints the results.
+ */
+void run_json_writer_bench(void);
+
+#endif /* HOST_TEST_H */
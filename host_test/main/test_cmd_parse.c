@@ -0,0 +1,111 @@
+/*
+ * test_cmd_parse.c - Command parsing and reassembly of fragmented commands
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "unity.h"
+
+#include "cmd_parse.h"
+#include "host_test.h"
+
+static cmd_frag_t s_frag;
+
+// A command longer than the MQTT receive buffer; the effect pads it out
+static int long_command(char *buf, size_t len)
+{
+    char effect[CMD_MQTT_BUFFER_SIZE + 100];
+
+    memset(effect, 'x', sizeof(effect) - 1);
+    effect[sizeof(effect) - 1] = '\0';
+    return snprintf(buf, len, "{\"state\":\"ON\",\"effect\":\"%s\",\"brightness\":128,\"transition\":2}",
+                    effect);
+}
+
+// Feeds a payload in pieces as the MQTT client would
+static cmd_frag_result_t feed(const char *payload, int len, int piece)
+{
+    cmd_frag_result_t result = CMD_FRAG_DROPPED;
+
+    TEST_ASSERT_TRUE(cmd_frag_begin(&s_frag, len));
+    for (int offset = 0; offset < len; offset += piece) {
+        int n = len - offset < piece ? len - offset : piece;
+        result = cmd_frag_add(&s_frag, offset, payload + offset, n);
+        if (result != CMD_FRAG_MORE) {
+            break;
+        }
+    }
+    return result;
+}
+
+static void test_parse_command(void)
+{
+    const char *json = "{\"state\":\"OFF\",\"color\":{\"h\":120.5,\"s\":50},\"color_temp\":300}";
+    cmd_request_t req;
+
+    TEST_ASSERT_TRUE(cmd_parse(json, strlen(json), &req));
+    TEST_ASSERT_TRUE(req.has_state);
+    TEST_ASSERT_FALSE(req.on);
+    TEST_ASSERT_TRUE(req.has_color);
+    TEST_ASSERT_EQUAL_UINT16(120, req.hue);
+    TEST_ASSERT_EQUAL_UINT16(50, req.saturation);
+    TEST_ASSERT_EQUAL_UINT16(300, req.color_temp);
+    TEST_ASSERT_FALSE(req.has_brightness);
+}
+
+static void test_transition_clamped(void)
+{
+    const char *json = "{\"transition\":1e12}";
+    cmd_request_t req;
+
+    TEST_ASSERT_TRUE(cmd_parse(json, strlen(json), &req));
+    TEST_ASSERT_EQUAL_UINT32(CMD_MAX_TRANSITION_MS, req.transition_ms);
+}
+
+static void test_fragmented_command(void)
+{
+    char payload[CMD_PARSE_MAX_LEN];
+    int len = long_command(payload, sizeof(payload));
+    cmd_request_t req;
+
+    TEST_ASSERT_GREATER_THAN(CMD_MQTT_BUFFER_SIZE, len);
+    TEST_ASSERT_EQUAL(CMD_FRAG_DONE, feed(payload, len, 300));
+    TEST_ASSERT_EQUAL(len, s_frag.len);
+    TEST_ASSERT_EQUAL_MEMORY(payload, s_frag.data, len);
+    TEST_ASSERT_FALSE(cmd_frag_active(&s_frag));
+
+    TEST_ASSERT_TRUE(cmd_parse(s_frag.data, s_frag.len, &req));
+    TEST_ASSERT_TRUE(req.has_state);
+    TEST_ASSERT_TRUE(req.on);
+    TEST_ASSERT_EQUAL_UINT16(128, req.brightness);
+    TEST_ASSERT_EQUAL_UINT32(2000, req.transition_ms);
+}
+
+static void test_fragment_out_of_order(void)
+{
+    char payload[CMD_PARSE_MAX_LEN];
+    int len = long_command(payload, sizeof(payload));
+
+    TEST_ASSERT_TRUE(cmd_frag_begin(&s_frag, len));
+    TEST_ASSERT_EQUAL(CMD_FRAG_MORE, cmd_frag_add(&s_frag, 0, payload, 500));
+    TEST_ASSERT_EQUAL(CMD_FRAG_DROPPED, cmd_frag_add(&s_frag, 600, payload + 600, 500));
+    TEST_ASSERT_FALSE(cmd_frag_active(&s_frag));
+    // The rest of the payload is ignored until the next one starts
+    TEST_ASSERT_EQUAL(CMD_FRAG_DROPPED, cmd_frag_add(&s_frag, 500, payload + 500, 100));
+}
+
+static void test_fragment_too_long(void)
+{
+    TEST_ASSERT_FALSE(cmd_frag_begin(&s_frag, CMD_PARSE_MAX_LEN + 1));
+    TEST_ASSERT_FALSE(cmd_frag_active(&s_frag));
+}
+
+void run_cmd_parse_tests(void)
+{
+    RUN_TEST(test_parse_command);
+    RUN_TEST(test_transition_clamped);
+    RUN_TEST(test_fragmented_command);
+    RUN_TEST(test_fragment_out_of_order);
+    RUN_TEST(test_fragment_too_long);
+}
@@ -0,0 +1,122 @@
+/*
+ * test_json_writer.c - JSON writer output, escaping and overflow, and a
+ *                      comparison with cJSON
+ */
+
+#include <string.h>
+
+#include "cJSON.h"
+#include "unity.h"
+
+#include "host_test.h"
+#include "json_writer.h"
+
+static void test_nested_object(void)
+{
+    char buf[128];
+    json_writer_t w;
+
+    json_init(&w, buf, sizeof(buf));
+    json_obj_begin(&w, NULL);
+    json_str(&w, "state", "ON");
+    json_int(&w, "brightness", -12);
+    json_obj_begin(&w, "color");
+    json_int(&w, "h", 120);
+    json_obj_end(&w);
+    json_bool(&w, "on", false);
+    json_null(&w, "name");
+    json_obj_end(&w);
+
+    TEST_ASSERT_EQUAL(strlen(buf), json_finish(&w));
+    TEST_ASSERT_EQUAL_STRING("{\"state\":\"ON\",\"brightness\":-12,\"color\":{\"h\":120},"
+                             "\"on\":false,\"name\":null}", buf);
+}
+
+static void test_escaping(void)
+{
+    char buf[128];
+    json_writer_t w;
+
+    json_init(&w, buf, sizeof(buf));
+    json_obj_begin(&w, NULL);
+    json_str(&w, "k\"ey", "a\\b\"c\nd\x01");
+    json_obj_end(&w);
+
+    TEST_ASSERT_GREATER_THAN(0, json_finish(&w));
+    TEST_ASSERT_EQUAL_STRING("{\"k\\\"ey\":\"a\\\\b\\\"c\\u000ad\\u0001\"}", buf);
+}
+
+static void test_overflow(void)
+{
+    const char *expected = "{\"name\":\"lamp\"}";
+    size_t n = strlen(expected);
+    char buf[32];
+    json_writer_t w;
+
+    // Fits exactly: the document plus its terminator
+    json_init(&w, buf, n + 1);
+    json_obj_begin(&w, NULL);
+    json_str(&w, "name", "lamp");
+    json_obj_end(&w);
+    TEST_ASSERT_EQUAL(n, json_finish(&w));
+    TEST_ASSERT_EQUAL_STRING(expected, buf);
+
+    // One byte short
+    memset(buf, 'x', sizeof(buf));
+    json_init(&w, buf, n);
+    json_obj_begin(&w, NULL);
+    json_str(&w, "name", "lamp");
+    json_obj_end(&w);
+    TEST_ASSERT_EQUAL(-1, json_finish(&w));
+    TEST_ASSERT_EQUAL_STRING("", buf);
+    TEST_ASSERT_EQUAL('x', buf[n]);
+
+    // An escape sequence that does not fit entirely
+    json_init(&w, buf, 12);
+    json_obj_begin(&w, NULL);
+    json_str(&w, "k", "ab\x01");
+    json_obj_end(&w);
+    TEST_ASSERT_EQUAL(-1, json_finish(&w));
+}
+
+static void test_unbalanced(void)
+{
+    char buf[64];
+    json_writer_t w;
+
+    json_init(&w, buf, sizeof(buf));
+    json_obj_begin(&w, NULL);
+    json_obj_begin(&w, "open");
+    json_obj_end(&w);
+    TEST_ASSERT_EQUAL(-1, json_finish(&w));
+
+    json_init(&w, buf, sizeof(buf));
+    for (int i = 0; i < JSON_WRITER_MAX_DEPTH; i++) {
+        json_obj_begin(&w, i ? "o" : NULL);
+    }
+    TEST_ASSERT_TRUE(w.overflow);
+    TEST_ASSERT_EQUAL(-1, json_finish(&w));
+}
+
+static void test_matches_cjson(void)
+{
+    char buf[JSON_BENCH_PAYLOAD_LEN];
+
+    TEST_ASSERT_GREATER_THAN(0, json_bench_writer(buf, sizeof(buf)));
+
+    cJSON *root = json_bench_cjson();
+    char *printed = cJSON_PrintUnformatted(root);
+    TEST_ASSERT_NOT_NULL(printed);
+    TEST_ASSERT_EQUAL_STRING(printed, buf);
+    cJSON_free(printed);
+    cJSON_Delete(root);
+}
+
+void run_json_writer_tests(void)
+{
+    RUN_TEST(test_nested_object);
+    RUN_TEST(test_escaping);
+    RUN_TEST(test_overflow);
+    RUN_TEST(test_unbalanced);
+    RUN_TEST(test_matches_cjson);
+}
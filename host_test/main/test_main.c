@@ -0,0 +1,29 @@
+/*
+ * test_main.c - Runs the host tests, then the benchmarks; the exit code is
+ *               the number of failed tests
+ */
+
+#include <stdlib.h>
+
+#include "unity.h"
+
+#include "host_test.h"
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+void app_main(void)
+{
+    UNITY_BEGIN();
+    run_cmd_parse_tests();
+    run_json_writer_tests();
+    int failures = UNITY_END();
+
+    run_json_writer_bench();
+    exit(failures);
+}
@@ -0,0 +1,329 @@
+/*
+ * cmd_parse.c - Allocation-free parser for Home Assistant light commands
+ *
+ * A command only needs a handful of scalar members, so instead of building a
+ * cJSON tree the parser walks the payload once, picks out the members it
+ * knows and skips the rest without copying anything. Nesting is limited, so
+ * a hostile payload cannot exhaust the MQTT task's stack.
+ *
+ * Commands larger than the MQTT client's receive buffer come in pieces and
+ * are collected in a fixed buffer before parsing.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "cmd_parse.h"
+
+#define TAG "CMD_PARSE"
+
+#define MAX_DEPTH 8
+#define MAX_NUMBER_LEN 31
+
+typedef struct {
+    const char *p;
+    const char *end;
+} cursor_t;
+
+static void skip_ws(cursor_t *c)
+{
+    while (c->p < c->end && (*c->p == ' ' || *c->p == '\t' || *c->p == '\n' || *c->p == '\r')) {
+        c->p++;
+    }
+}
+
+// Consumes ch (after whitespace) if it is next
+static bool accept(cursor_t *c, char ch)
+{
+    skip_ws(c);
+    if (c->p < c->end && *c->p == ch) {
+        c->p++;
+        return true;
+    }
+    return false;
+}
+
+static char peek(cursor_t *c)
+{
+    skip_ws(c);
+    return c->p < c->end ? *c->p : '\0';
+}
+
+/**
+ * @brief Reads a string and returns its raw contents (escapes left as they are).
+ */
+static bool parse_string(cursor_t *c, const char **s, int *len)
+{
+    if (!accept(c, '"')) {
+        return false;
+    }
+    const char *start = c->p;
+    while (c->p < c->end && *c->p != '"') {
+        if (*c->p == '\\') {
+            c->p++;
+        }
+        c->p++;
+    }
+    if (c->p >= c->end) {
+        return false;
+    }
+    *s = start;
+    *len = (int)(c->p - start);
+    c->p++;
+    return true;
+}
+
+static bool parse_number(cursor_t *c, double *val)
+{
+    char num[MAX_NUMBER_LEN + 1];
+    int n = 0;
+
+    skip_ws(c);
+    while (c->p < c->end && n < MAX_NUMBER_LEN && strchr("+-.0123456789eE", *c->p) != NULL) {
+        num[n++] = *c->p++;
+    }
+    num[n] = '\0';
+
+    char *num_end;
+    *val = strtod(num, &num_end);
+    return n > 0 && num_end == num + n;
+}
+
+static bool accept_literal(cursor_t *c, const char *lit)
+{
+    size_t n = strlen(lit);
+    if ((size_t)(c->end - c->p) < n || memcmp(c->p, lit, n) != 0) {
+        return false;
+    }
+    c->p += n;
+    return true;
+}
+
+static bool skip_value(cursor_t *c, int depth)
+{
+    const char *s;
+    int len;
+    double num;
+
+    if (depth > MAX_DEPTH) {
+        return false;
+    }
+    switch (peek(c)) {
+    case '"':
+        return parse_string(c, &s, &len);
+    case '{':
+    case '[': {
+        char close = *c->p == '{' ? '}' : ']';
+        c->p++;
+        if (accept(c, close)) {
+            return true;
+        }
+        do {
+            if (close == '}' && (!parse_string(c, &s, &len) || !accept(c, ':'))) {
+                return false;
+            }
+            if (!skip_value(c, depth + 1)) {
+                return false;
+            }
+        } while (accept(c, ','));
+        return accept(c, close);
+    }
+    case 't':
+        return accept_literal(c, "true");
+    case 'f':
+        return accept_literal(c, "false");
+    case 'n':
+        return accept_literal(c, "null");
+    default:
+        return parse_number(c, &num);
+    }
+}
+
+static bool span_is(const char *span, int len, const char *str)
+{
+    return (int)strlen(str) == len && memcmp(span, str, len) == 0;
+}
+
+static uint16_t clamp_u16(double v)
+{
+    if (v <= 0) {
+        return 0;
+    }
+    return v >= UINT16_MAX ? UINT16_MAX : (uint16_t)v;
+}
+
+/**
+ * @brief Reads a number member; any other value is skipped.
+ *
+ * @param[out] found Whether the value was a number.
+ * @return false on a syntax error.
+ */
+static bool member_number(cursor_t *c, double *val, bool *found)
+{
+    char next = peek(c);
+    if (next == '-' || (next >= '0' && next <= '9')) {
+        *found = parse_number(c, val);
+        return *found;
+    }
+    *found = false;
+    return skip_value(c, 1);
+}
+
+static bool parse_color(cursor_t *c, cmd_request_t *out)
+{
+    bool has_h = false;
+    bool has_s = false;
+    double h = 0;
+    double s = 0;
+
+    if (peek(c) != '{') {
+        return skip_value(c, 1);
+    }
+    c->p++;
+    if (!accept(c, '}')) {
+        do {
+            const char *key;
+            int key_len;
+            bool ok;
+
+            if (!parse_string(c, &key, &key_len) || !accept(c, ':')) {
+                return false;
+            }
+            if (span_is(key, key_len, "h")) {
+                ok = member_number(c, &h, &has_h);
+            } else if (span_is(key, key_len, "s")) {
+                ok = member_number(c, &s, &has_s);
+            } else {
+                ok = skip_value(c, 2);
+            }
+            if (!ok) {
+                return false;
+            }
+        } while (accept(c, ','));
+        if (!accept(c, '}')) {
+            return false;
+        }
+    }
+
+    if (has_h && has_s) {
+        out->has_color = true;
+        out->hue = clamp_u16(h);
+        out->saturation = clamp_u16(s);
+    }
+    return true;
+}
+
+static bool parse_member(cursor_t *c, const char *key, int key_len, cmd_request_t *out)
+{
+    double num;
+    bool found;
+
+    if (span_is(key, key_len, "state")) {
+        const char *val;
+        int val_len;
+
+        if (peek(c) != '"') {
+            return skip_value(c, 1);
+        }
+        if (!parse_string(c, &val, &val_len)) {
+            return false;
+        }
+        if (span_is(val, val_len, "ON") || span_is(val, val_len, "OFF")) {
+            out->has_state = true;
+            out->on = span_is(val, val_len, "ON");
+        }
+        return true;
+    }
+    if (span_is(key, key_len, "brightness")) {
+        if (!member_number(c, &num, &found)) {
+            return false;
+        }
+        if (found) {
+            // HA already scales brightness to the lamp's range (bri_scl), send it as is
+            out->has_brightness = true;
+            out->brightness = clamp_u16(num);
+        }
+        return true;
+    }
+    if (span_is(key, key_len, "color")) {
+        return parse_color(c, out);
+    }
+    if (span_is(key, key_len, "transition")) {
+        if (!member_number(c, &num, &found)) {
+            return false;
+        }
+        // Seconds in HA; the lamp fades on its own instead of us streaming steps
+        if (found && num > 0) {
+            out->transition_ms = num * 1000 < CMD_MAX_TRANSITION_MS ?
+                                 (uint32_t)(num * 1000) : CMD_MAX_TRANSITION_MS;
+        }
+        return true;
+    }
+    if (span_is(key, key_len, "color_temp")) {
+        if (!member_number(c, &num, &found)) {
+            return false;
+        }
+        if (found) {
+            out->has_color_temp = true;
+            out->color_temp = clamp_u16(num);
+        }
+        return true;
+    }
+    // "effect" and anything else: no effects are offered in discovery
+    return skip_value(c, 1);
+}
+
+bool cmd_parse(const char *json, int len, cmd_request_t *out)
+{
+    cursor_t c = { .p = json, .end = json + len };
+
+    memset(out, 0, sizeof(*out));
+    if (!accept(&c, '{')) {
+        return false;
+    }
+    if (accept(&c, '}')) {
+        return true;
+    }
+    do {
+        const char *key;
+        int key_len;
+
+        if (!parse_string(&c, &key, &key_len) || !accept(&c, ':') ||
+            !parse_member(&c, key, key_len, out)) {
+            ESP_LOGD(TAG, "Syntax error at offset %d", (int)(c.p - json));
+            return false;
+        }
+    } while (accept(&c, ','));
+    return accept(&c, '}');
+}
+
+bool cmd_frag_begin(cmd_frag_t *frag, int total_len)
+{
+    frag->len = 0;
+    frag->total_len = 0;
+    if (total_len <= 0 || total_len > CMD_PARSE_MAX_LEN) {
+        return false;
+    }
+    frag->total_len = total_len;
+    return true;
+}
+
+cmd_frag_result_t cmd_frag_add(cmd_frag_t *frag, int offset, const char *data, int len)
+{
+    if (!cmd_frag_active(frag)) {
+        return CMD_FRAG_DROPPED;
+    }
+    if (offset != frag->len || len < 0 || len > frag->total_len - frag->len) {
+        frag->total_len = 0;
+        return CMD_FRAG_DROPPED;
+    }
+    memcpy(frag->data + frag->len, data, len);
+    frag->len += len;
+    if (frag->len < frag->total_len) {
+        return CMD_FRAG_MORE;
+    }
+    frag->total_len = 0;
+    return CMD_FRAG_DONE;
+}
@@ -0,0 +1,73 @@
+#ifndef CMD_PARSE_H
+#define CMD_PARSE_H
+
+#include <stdbool.h>
+
+#include "cmd_planner.h"
+
+// Receive buffer of the MQTT client (buffer.size in its config). A message
+// larger than this arrives in several MQTT_EVENT_DATA events.
+#define CMD_MQTT_BUFFER_SIZE 1024
+
+// Longest command accepted in pieces. Above the receive buffer, so every
+// command that needs reassembling fits; HA light commands are far shorter.
+#define CMD_PARSE_MAX_LEN (2 * CMD_MQTT_BUFFER_SIZE)
+
+// Longest transition a mesh Transition Time holds: 62 steps of 10 minutes
+#define CMD_MAX_TRANSITION_MS (62u * 10 * 60 * 1000)
+
+// Command payload arriving in several MQTT_EVENT_DATA events
+typedef struct {
+    char data[CMD_PARSE_MAX_LEN];
+    int len;
+    int total_len;              // 0 = none in progress
+} cmd_frag_t;
+
+typedef enum {
+    CMD_FRAG_MORE,              // Fragment stored, more to come
+    CMD_FRAG_DONE,              // Payload complete in data/len
+    CMD_FRAG_DROPPED,           // Out of order or too long; payload discarded
+} cmd_frag_result_t;
+
+/**
+ * @brief Parses a Home Assistant JSON light command without allocating.
+ *
+ * Reads "state", "brightness", "color" ("h" and "s"), "transition" and
+ * "color_temp"; "effect" and any other member is skipped. A member of the
+ * wrong type is ignored like a missing one.
+ *
+ * @param json Payload; need not be NUL-terminated.
+ * @param len Length of @p json.
+ * @param[out] out Receives the fields present in the command.
+ * @return false if the payload is not a JSON object.
+ */
+bool cmd_parse(const char *json, int len, cmd_request_t *out);
+
+/**
+ * @brief Starts collecting a payload of @p total_len bytes, dropping any
+ *        payload in progress.
+ *
+ * @return false if the payload is longer than CMD_PARSE_MAX_LEN.
+ */
+bool cmd_frag_begin(cmd_frag_t *frag, int total_len);
+
+/**
+ * @brief Appends a fragment of the payload being collected.
+ *
+ * Fragments must arrive in order, as the MQTT client delivers them.
+ *
+ * @param offset Position of the fragment in the payload (current_data_offset).
+ * @param data Fragment data.
+ * @param len Length of the fragment.
+ */
+cmd_frag_result_t cmd_frag_add(cmd_frag_t *frag, int offset, const char *data, int len);
+
+/**
+ * @brief Whether a payload is being collected.
+ */
+static inline bool cmd_frag_active(const cmd_frag_t *frag)
+{
+    return frag->total_len > 0;
+}
+
+#endif /* CMD_PARSE_H */
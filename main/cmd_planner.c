@@ -0,0 +1,78 @@
+/*
+ * cmd_planner.c - Turns a Home Assistant command into the fewest mesh messages
+ *
+ * HSL and Lightness are bound on the lamp (HSL lightness drives Light Lightness,
+ * which drives Generic OnOff), so one Set is always enough: a colour change with
+ * the right lightness also sets brightness and switches the lamp on.
+ */
+
+#include <string.h>
+
+#include "cmd_planner.h"
+
+/**
+ * @brief Plans a lightness with the best message type the lamp has.
+ *
+ * Generic Level is bound to Light Lightness as lightness - 32768.
+ */
+static void plan_lightness(uint8_t caps, uint16_t lightness, mesh_msg_t *out)
+{
+    if (caps & LAMP_CAP_LIGHTNESS) {
+        out->type = MESH_MSG_LIGHTNESS;
+        out->lightness = lightness;
+    } else if (caps & LAMP_CAP_LEVEL) {
+        out->type = MESH_MSG_LEVEL;
+        out->level = (int16_t)((int32_t)lightness - 32768);
+    } else {
+        out->type = MESH_MSG_ONOFF;
+        out->onoff = lightness > 0;
+    }
+}
+
+bool cmd_plan(const cmd_request_t *req, uint8_t caps, const lamp_state_t *last,
+              uint16_t fallback_lightness, mesh_msg_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    out->trans_time = mesh_codec_transition_time(req->transition_ms);
+
+    if (req->has_state && !req->on) {
+        if (caps & LAMP_CAP_ONOFF) {
+            out->type = MESH_MSG_ONOFF;
+            out->onoff = 0;
+        } else {
+            plan_lightness(caps, 0, out);
+        }
+        return true;
+    }
+
+    if (req->has_color && (caps & LAMP_CAP_HSL)) {
+        uint16_t lightness = fallback_lightness;
+        if (req->has_brightness) {
+            lightness = req->brightness;
+        } else if (last->lightness_known) {
+            lightness = last->lightness;
+        }
+        out->type = MESH_MSG_HSL;
+        out->hsl.lightness = lightness;
+        out->hsl.hue = req->hue;
+        out->hsl.saturation = req->saturation;
+        return true;
+    }
+
+    if (req->has_brightness) {
+        plan_lightness(caps, req->brightness, out);
+        return true;
+    }
+
+    if (req->has_state) {
+        if (caps & LAMP_CAP_ONOFF) {
+            out->type = MESH_MSG_ONOFF;
+            out->onoff = 1;
+        } else {
+            plan_lightness(caps, last->lightness_known ? last->lightness : fallback_lightness, out);
+        }
+        return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,53 @@
+#ifndef CMD_PLANNER_H
+#define CMD_PLANNER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lamp_nvs.h"
+#include "lamp_state.h"
+#include "mesh_codec.h"
+
+/**
+ * @brief Fields present in one Home Assistant JSON command.
+ */
+typedef struct {
+    bool has_state;
+    bool on;
+    bool has_brightness;
+    uint16_t brightness;        // Already in the lamp's brightness scale
+    bool has_color;
+    uint16_t hue;
+    uint16_t saturation;
+    uint32_t transition_ms;     // Fade duration handed to the lamp, 0 = none
+    bool has_color_temp;
+    uint16_t color_temp;        // Mireds; not sent yet, the gateway has no CTL client
+} cmd_request_t;
+
+/**
+ * @brief Merges a command with the target's last known state into a single
+ *        mesh Set.
+ *
+ * "OFF" wins over everything else. A colour becomes one HSL Set carrying the
+ * requested brightness, or the last known one, so colour and brightness never
+ * go out as two messages. Brightness alone is a Lightness Set and a bare "ON"
+ * an OnOff Set. A requested transition travels in the message's Transition
+ * Time, so the lamp fades by itself.
+ *
+ * Only message types in @p caps are used: a lamp without HSL gets the
+ * brightness part of a colour command, brightness goes to a lamp without
+ * Light Lightness as a Generic Level Set, and on/off to a lamp without
+ * Generic OnOff as a lightness.
+ *
+ * @param req Parsed command.
+ * @param caps LAMP_CAP_* bits of the target.
+ * @param last Last known state of the target.
+ * @param fallback_lightness Lightness for a colour change when neither the
+ *                           command nor the state provides one.
+ * @param[out] out The planned message; the caller fills in addr and ack.
+ * @return true if the command maps to a message, false if it has nothing to send.
+ */
+bool cmd_plan(const cmd_request_t *req, uint8_t caps, const lamp_state_t *last,
+              uint16_t fallback_lightness, mesh_msg_t *out);
+
+#endif /* CMD_PLANNER_H */
@@ -0,0 +1,326 @@
+/*
+ * discovery.c - Incremental, paced Home Assistant discovery publishing
+ *
+ * Every lamp and group has an entry with the hash of the config payload last
+ * published for it. A request only marks the entries; the pacing timer then
+ * builds each payload, skips it if the hash matches, and otherwise enqueues
+ * it, one config per tick and only while the MQTT outbox is below its limit.
+ * So adding a lamp costs one publish, and a Home Assistant restart is spread
+ * out instead of filling the outbox ahead of command handling.
+ *
+ * Entries whose lamp or group disappeared (removed or renamed) get an empty
+ * retained config first, so HA deletes the entity before a renamed lamp
+ * shows up again under the same unique id.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "discovery.h"
+#include "fnv_hash.h"
+#include "json_writer.h"
+#include "lamp_health.h"
+#include "lamp_nvs.h"
+#include "main.h"
+#include "mqtt_routes.h"
+
+#define TAG "DISCOVERY"
+
+// Room for removed and renamed entries that are not cleared yet
+#define DISCOVERY_ENTRIES   (2 * (MAX_LAMPS + MAX_GROUPS + 1))
+#define DISCOVERY_GAP_US    ((uint64_t)CONFIG_MQTT_DISCOVERY_GAP_MS * 1000)
+#define DISCOVERY_OUTBOX_MAX CONFIG_MQTT_DISCOVERY_OUTBOX_MAX
+#define DISCOVERY_PAYLOAD_LEN 512
+
+typedef struct {
+    char name[MAX_LAMP_NAME_LEN];   // "" = unused
+    uint16_t addr;
+    bool group;
+    bool seen;                  // Still a lamp or group (during a request)
+    bool pending;               // Publish, or clear if removed
+    bool removed;
+    bool published;             // hash is valid
+    uint32_t hash;              // Of the payload last published
+} disc_entry_t;
+
+static disc_entry_t s_entries[DISCOVERY_ENTRIES];
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t s_timer = NULL;
+static esp_mqtt_client_handle_t s_client = NULL;
+
+static int create_ha_discovery_payload(char *buf, size_t len,
+                                       const char *name, const char *uniq_id, const char *model,
+                                       uint8_t caps, int brightness_scaling,
+                                       const char *base_topic, bool availability)
+{
+    json_writer_t w;
+
+    json_init(&w, buf, len);
+    json_obj_begin(&w, NULL);
+    json_null(&w, "name");
+    json_str(&w, "~", base_topic);
+    json_str(&w, "cmd_t", "~/set");
+    json_str(&w, "stat_t", "~/state");
+    json_str(&w, "schema", "json");
+    if (availability) {
+        json_str(&w, "avty_t", "~/availability");
+    }
+    if (caps & (LAMP_CAP_LIGHTNESS | LAMP_CAP_LEVEL)) {
+        json_bool(&w, "brightness", true);
+        // Use the lamp's specific brightness scaling
+        json_int(&w, "bri_scl", brightness_scaling);
+    }
+    // Conditionally add color support
+    if (caps & LAMP_CAP_HSL) {
+        json_str(&w, "sup_clrm", "hs");
+    }
+    json_str(&w, "uniq_id", uniq_id);
+
+    json_obj_begin(&w, "dev");
+    json_str(&w, "name", name);
+    json_str(&w, "identifiers", uniq_id);
+    json_str(&w, "manufacturer", "Espressif");
+    json_str(&w, "model", model);
+    json_obj_end(&w);
+
+    json_obj_end(&w);
+    return json_finish(&w);
+}
+
+/**
+ * @brief Builds the config payload of an entry from the current lamp list.
+ *
+ * @return Payload length, or -1 if the lamp is gone or the payload did not fit.
+ */
+static int build_payload(char *buf, size_t len, const char *name, uint16_t addr, bool group)
+{
+    char base_topic[MQTT_ROUTE_TOPIC_LEN];
+    snprintf(base_topic, sizeof(base_topic), MQTT_TOPIC_PREFIX "%s", name);
+
+    if (group) {
+        char uniq_id[16];
+        uint8_t caps;
+        int brightness_scaling;
+
+        snprintf(uniq_id, sizeof(uniq_id), "group_%04x", addr);
+        get_group_profile(addr, &caps, &brightness_scaling);
+        // A group message is sent whether or not its members are reachable
+        return create_ha_discovery_payload(buf, len, name, uniq_id, "BLE Mesh Group", caps,
+                                           brightness_scaling, base_topic, false);
+    }
+
+    LampInfo lamp;
+    LampLabel label;
+    if (lamp_by_name(name, &lamp, &label) != ESP_OK) {
+        return -1;
+    }
+    return create_ha_discovery_payload(buf, len, name, label.address, "BLE Mesh Lamp",
+                                       lamp.caps, lamp.brightness_scaling, base_topic, true);
+}
+
+// Call with s_lock held
+static void mark_entity(const char *name, uint16_t addr, bool group, bool force)
+{
+    disc_entry_t *entry = NULL;
+    disc_entry_t *free_entry = NULL;
+
+    for (int i = 0; i < DISCOVERY_ENTRIES && entry == NULL; i++) {
+        if (s_entries[i].name[0] == '\0') {
+            if (free_entry == NULL) {
+                free_entry = &s_entries[i];
+            }
+        } else if (strcmp(s_entries[i].name, name) == 0) {
+            entry = &s_entries[i];
+        }
+    }
+    if (entry == NULL) {
+        if (free_entry == NULL) {
+            return;
+        }
+        entry = free_entry;
+        memset(entry, 0, sizeof(*entry));
+        strncpy(entry->name, name, sizeof(entry->name) - 1);
+    }
+    entry->addr = addr;
+    entry->group = group;
+    entry->seen = true;
+    entry->removed = false;
+    entry->pending = true;
+    if (force) {
+        entry->published = false;
+    }
+}
+
+static bool enqueue(const char *name, const char *suffix, const char *payload)
+{
+    char topic[MQTT_ROUTE_TOPIC_LEN + sizeof("availability")];
+    snprintf(topic, sizeof(topic), MQTT_TOPIC_PREFIX "%s/%s", name, suffix);
+    // Queued for the MQTT task instead of sent from the timer task
+    if (esp_mqtt_client_enqueue(s_client, topic, payload, 0, 1, 1, true) < 0) {
+        ESP_LOGW(TAG, "Could not queue %s of '%s', retrying", suffix, name);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Settles entry @p i after its messages were handed to the client.
+ *
+ * If the entry was changed meanwhile (renamed slot, lamp added again) it is
+ * left alone; its new state is still pending.
+ *
+ * @param e Copy of the entry taken by publish_next().
+ * @param sent false if a message could not be enqueued; the entry stays pending.
+ */
+static void entry_done(int i, const disc_entry_t *e, bool sent, uint32_t hash)
+{
+    portENTER_CRITICAL(&s_lock);
+    disc_entry_t *cur = &s_entries[i];
+    if (strcmp(cur->name, e->name) == 0 && cur->removed == e->removed) {
+        if (!sent) {
+            cur->pending = true;
+        } else if (e->removed) {
+            if (!cur->pending) {
+                memset(cur, 0, sizeof(*cur));
+            }
+        } else {
+            cur->published = true;
+            cur->hash = hash;
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+/**
+ * @brief Publishes or clears one entry that needs it.
+ *
+ * @return true if messages were handed to the client (or it refused them and
+ *         the entry waits for the next tick), false if nothing is left to do.
+ */
+static bool publish_next(void)
+{
+    // Clears first: a renamed lamp keeps its unique id
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < DISCOVERY_ENTRIES; i++) {
+            disc_entry_t e;
+
+            portENTER_CRITICAL(&s_lock);
+            bool take = s_entries[i].pending && s_entries[i].removed == (pass == 0);
+            if (take) {
+                s_entries[i].pending = false;
+                e = s_entries[i];
+            }
+            portEXIT_CRITICAL(&s_lock);
+
+            if (!take) {
+                continue;
+            }
+            if (e.removed) {
+                ESP_LOGI(TAG, "Removing '%s'", e.name);
+                bool sent = enqueue(e.name, "config", "");
+                if (sent && !e.group) {
+                    sent = enqueue(e.name, "availability", "");
+                }
+                entry_done(i, &e, sent, 0);
+                return true;
+            }
+
+            char payload[DISCOVERY_PAYLOAD_LEN];
+            if (build_payload(payload, sizeof(payload), e.name, e.addr, e.group) < 0) {
+                ESP_LOGW(TAG, "No config for '%s'", e.name);
+                continue;
+            }
+            uint32_t hash = fnv_hash_str(payload);
+            if (e.published && e.hash == hash) {
+                continue;
+            }
+
+            ESP_LOGI(TAG, "Publishing config of '%s'", e.name);
+            bool sent = enqueue(e.name, "config", payload);
+            if (sent && !e.group) {
+                // HA shows a lamp as unavailable until its availability topic has a message
+                sent = enqueue(e.name, "availability", lamp_health_is_offline(e.addr) ? "offline" : "online");
+            }
+            entry_done(i, &e, sent, hash);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void discovery_tick(void *arg)
+{
+    if (s_client == NULL) {
+        return;
+    }
+    // Leave room in the outbox for state and command traffic
+    if (esp_mqtt_client_get_outbox_size(s_client) < DISCOVERY_OUTBOX_MAX && !publish_next()) {
+        return;
+    }
+    esp_timer_start_once(s_timer, DISCOVERY_GAP_US);
+}
+
+/* --- Public API --- */
+
+esp_err_t discovery_init(void)
+{
+    const esp_timer_create_args_t args = {
+        .callback = discovery_tick,
+        .name = "discovery",
+    };
+    esp_err_t err = esp_timer_create(&args, &s_timer);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create pacing timer (err %d)", err);
+    }
+    return err;
+}
+
+void discovery_request(esp_mqtt_client_handle_t client, bool force)
+{
+    if (client == NULL || s_timer == NULL) {
+        return;
+    }
+
+    LampInfo lamps[MAX_LAMPS];
+    LampLabel labels[MAX_LAMPS];
+    GroupInfo groups[MAX_GROUPS];
+    int lamp_count = get_all_lamps(lamps, labels, MAX_LAMPS);
+    int group_count = get_all_groups(groups, MAX_GROUPS);
+
+    portENTER_CRITICAL(&s_lock);
+    s_client = client;
+    for (int i = 0; i < DISCOVERY_ENTRIES; i++) {
+        s_entries[i].seen = false;
+    }
+    for (int i = 0; i < lamp_count; i++) {
+        mark_entity(labels[i].name, lamps[i].address, false, force);
+    }
+    for (int i = 0; i < group_count; i++) {
+        mark_entity(groups[i].name, groups[i].address, true, force);
+    }
+    if (lamp_count > 0) {
+        mark_entity(ALL_LAMPS_GROUP_NAME, ALL_LAMPS_GROUP_ADDR, true, force);
+    }
+    for (int i = 0; i < DISCOVERY_ENTRIES; i++) {
+        disc_entry_t *e = &s_entries[i];
+        if (e->name[0] == '\0' || e->seen) {
+            continue;
+        }
+        if (e->published) {
+            e->removed = true;
+            e->pending = true;
+        } else {
+            memset(e, 0, sizeof(*e));
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    ESP_LOGI(TAG, "Updating Home Assistant discovery%s", force ? " (all)" : "");
+    if (!esp_timer_is_active(s_timer)) {
+        esp_timer_start_once(s_timer, 0);
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "mqtt_client.h"
+
+/**
+ * @brief Creates the timer that paces discovery publishing.
+ *
+ * @return ESP_OK, or the error from esp_timer_create().
+ */
+esp_err_t discovery_init(void);
+
+/**
+ * @brief Brings the Home Assistant discovery configs in line with the lamp
+ *        and group list.
+ *
+ * Lamps and groups whose config payload changed since it was last published
+ * are republished, ones that were removed or renamed get an empty retained
+ * config so HA deletes them. Publishing happens in the background, one
+ * config at a time while the MQTT outbox has room.
+ *
+ * @param client Connected MQTT client; NULL does nothing.
+ * @param force Republish every config, e.g. when HA announces it restarted.
+ */
+void discovery_request(esp_mqtt_client_handle_t client, bool force);
+
+#endif /* DISCOVERY_H */
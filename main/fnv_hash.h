@@ -0,0 +1,43 @@
+#ifndef FNV_HASH_H
+#define FNV_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * 32-bit FNV-1a, used for the hash indexes and for telling whether a payload
+ * or snapshot changed. Not collision resistant: callers only use it where a
+ * collision costs a skipped write or a longer probe.
+ */
+
+#define FNV_HASH_INIT  2166136261u
+#define FNV_HASH_PRIME 16777619u
+
+/**
+ * @brief Hashes @p len bytes.
+ */
+static inline uint32_t fnv_hash(const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint32_t h = FNV_HASH_INIT;
+    while (len--) {
+        h ^= *p++;
+        h *= FNV_HASH_PRIME;
+    }
+    return h;
+}
+
+/**
+ * @brief Hashes a NUL-terminated string, without the terminator.
+ */
+static inline uint32_t fnv_hash_str(const char *s)
+{
+    uint32_t h = FNV_HASH_INIT;
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= FNV_HASH_PRIME;
+    }
+    return h;
+}
+
+#endif /* FNV_HASH_H */
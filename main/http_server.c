@@ -7,13 +7,42 @@
 #include "cJSON.h"
 #include "main.h"
 #include "lamp_nvs.h"
+#include "lamp_health.h"
+#include "lamp_state.h"
+#include "probe.h"
+#include "esp_timer.h"
 #include "mqtt_client.h"
+#include "mqtt_pub.h"
 #include "nvs_flash.h"
 #include "nvs.h"
 
 #define TAG "HTTP_SERVER"
 
 // --- Helper Functions ---
+static void format_lamp_state(uint16_t addr, char *buf, size_t len) {
+    lamp_state_t st;
+    lamp_state_get(addr, &st);
+
+    const char *health = lamp_health_is_offline(addr) ? "Offline, " : "";
+    int n;
+    if (!st.on_known) {
+        n = snprintf(buf, len, "%sUnknown", health);
+    } else if (st.on && st.lightness_known) {
+        n = snprintf(buf, len, "%sOn (%d)", health, st.lightness);
+    } else {
+        n = snprintf(buf, len, "%s%s", health, st.on ? "On" : "Off");
+    }
+    if (n < 0 || (size_t)n >= len) {
+        return;
+    }
+    if (st.last_seen_us == 0) {
+        snprintf(buf + n, len - n, ", not reported");
+    } else {
+        snprintf(buf + n, len - n, ", seen %llds ago",
+                 (long long)((esp_timer_get_time() - st.last_seen_us) / 1000000));
+    }
+}
+
 static char from_hex(char ch) {
     return isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10;
 }
@@ -37,6 +66,97 @@ static esp_err_t get_post_field(char *buf, const char *field, char *dest, int de
     return ESP_OK;
 }
 
+// Parses a comma-separated list of group addresses ("0xC001,0xC002") into a lamp record.
+static void parse_lamp_groups(const char *list, LampInfo *lamp) {
+    memset(lamp->groups, 0, sizeof(lamp->groups));
+    int g = 0;
+    const char *p = list;
+    while (*p && g < MAX_LAMP_GROUPS) {
+        char *end;
+        long addr = strtol(p, &end, 0);
+        if (end == p) {
+            p++;
+            continue;
+        }
+        if (addr >= 0xC000 && addr < 0xFF00) {
+            lamp->groups[g++] = (uint16_t)addr;
+        }
+        p = end;
+    }
+}
+
+// Formats a lamp's group memberships as "0xC001,0xC002".
+static void format_lamp_groups(const LampInfo *lamp, char *dest, size_t dest_len) {
+    size_t w = 0;
+    dest[0] = '\0';
+    for (int g = 0; g < MAX_LAMP_GROUPS && w < dest_len; g++) {
+        if (lamp->groups[g] != 0) {
+            w += snprintf(dest + w, dest_len - w, "%s0x%04X", w ? "," : "", lamp->groups[g]);
+        }
+    }
+}
+
+// Capability checkboxes of the lamp forms.
+static const struct {
+    uint8_t bit;
+    const char *field;
+    const char *label;
+} s_cap_fields[] = {
+    { LAMP_CAP_ONOFF,     "cap_onoff",     "OnOff" },
+    { LAMP_CAP_LEVEL,     "cap_level",     "Level" },
+    { LAMP_CAP_LIGHTNESS, "cap_lightness", "Lightness" },
+    { LAMP_CAP_HSL,       "cap_hsl",       "HSL" },
+    { LAMP_CAP_CTL,       "cap_ctl",       "CTL" },
+};
+#define CAP_FIELD_COUNT (sizeof(s_cap_fields) / sizeof(s_cap_fields[0]))
+
+// Formats a capability bitmask as "OnOff Level Lightness".
+static void format_lamp_caps(uint8_t caps, char *dest, size_t dest_len) {
+    size_t w = 0;
+    dest[0] = '\0';
+    for (size_t i = 0; i < CAP_FIELD_COUNT && w < dest_len; i++) {
+        if (caps & s_cap_fields[i].bit) {
+            w += snprintf(dest + w, dest_len - w, "%s%s", w ? " " : "", s_cap_fields[i].label);
+        }
+    }
+}
+
+// Renders the capability checkboxes, ticking those in caps.
+static void format_caps_inputs(uint8_t caps, char *dest, size_t dest_len) {
+    size_t w = 0;
+    dest[0] = '\0';
+    for (size_t i = 0; i < CAP_FIELD_COUNT && w < dest_len; i++) {
+        w += snprintf(dest + w, dest_len - w, "%s<input type='checkbox' name='%s' value='1' %s> ",
+                      s_cap_fields[i].label, s_cap_fields[i].field,
+                      (caps & s_cap_fields[i].bit) ? "checked" : "");
+    }
+}
+
+// Reads the ticked capability checkboxes from a form body.
+static uint8_t parse_lamp_caps(char *buf) {
+    uint8_t caps = 0;
+    for (size_t i = 0; i < CAP_FIELD_COUNT; i++) {
+        char key[24], val[4] = {0};
+        snprintf(key, sizeof(key), "%s=", s_cap_fields[i].field);
+        if (get_post_field(buf, key, val, sizeof(val)) == ESP_OK && val[0] == '1') {
+            caps |= s_cap_fields[i].bit;
+        }
+    }
+    return caps;
+}
+
+// Brightness range from the form, 100 if out of range. A blank field leaves
+// the range to the probe: the lamp gets scaling 0 and auto_scaling.
+static void parse_lamp_scaling(const char *value, LampInfo *lamp) {
+    int scaling = atoi(value);
+    lamp->auto_scaling = (value[0] == '\0');
+    if (lamp->auto_scaling) {
+        lamp->brightness_scaling = 0;
+    } else {
+        lamp->brightness_scaling = (scaling > 0 && scaling <= UINT16_MAX) ? (uint16_t)scaling : 100;
+    }
+}
+
 // --- MQTT Test Logic ---
 static EventGroupHandle_t s_mqtt_test_group;
 #define MQTT_TEST_CONNECTED_BIT BIT0
@@ -173,40 +293,84 @@ static esp_err_t get_lamps_overview_handler(httpd_req_t *req) {
         "</style></head><body>"
         "<h1>Lamp Overview</h1>"
         "<a href='/config' class='btn cfg'>System Configuration</a>"
-        "<table><tr><th>Name</th><th>Address</th><th>Type</th><th>Scale</th><th>Actions</th></tr>");
+        "<table><tr><th>Name</th><th>Address</th><th>Type</th><th>Scale</th><th>Groups</th><th>Ack</th><th>State</th><th>Actions</th></tr>");
 
-    int count;
-    const LampInfo* lamps = get_all_lamps(&count);
+    LampInfo lamps[MAX_LAMPS];
+    LampLabel labels[MAX_LAMPS];
+    int count = get_all_lamps(lamps, labels, MAX_LAMPS);
     for (int i = 0; i < count; i++) {
-        char row[512];
-        snprintf(row, sizeof(row), "<tr><td>%s</td><td>%s</td><td>%s</td><td>%d</td><td>"
+        char row[736];
+        char groups[48];
+        char state[48];
+        char caps[40];
+        const LampLabel *label = &labels[i];
+        format_lamp_groups(&lamps[i], groups, sizeof(groups));
+        format_lamp_state(lamps[i].address, state, sizeof(state));
+        format_lamp_caps(lamps[i].caps, caps, sizeof(caps));
+        snprintf(row, sizeof(row), "<tr><td>%s</td><td>%s</td><td>%s%s</td><td>%d</td><td>%s</td><td>%s</td><td>%s</td><td>"
             "<form action='/remove_lamp' method='post' style='display:inline;'><input type='hidden' name='lamp_name' value='%s'><input type='submit' value='Remove' class='btn del'></form> "
             "<form action='/edit_lamp' method='get' style='display:inline;'><input type='hidden' name='lamp_name' value='%s'><input type='submit' value='Edit' class='btn edit'></form>"
             "</td></tr>",
-            lamps[i].name, lamps[i].address, lamps[i].supports_color?"Color":"White", lamps[i].brightness_scaling, lamps[i].name, lamps[i].name);
+            label->name, label->address, caps, lamps[i].probed?" (probed)":"", lamps[i].brightness_scaling, groups, lamps[i].acknowledged?"Yes":"No", state, label->name, label->name);
         httpd_resp_sendstr_chunk(req, row);
     }
-    httpd_resp_sendstr_chunk(req, "</table><h2>Add Lamp</h2>"
+    httpd_resp_sendstr_chunk(req, "</table>");
+    uint32_t dropped = mqtt_pub_dropped();
+    if (dropped > 0) {
+        char note[64];
+        snprintf(note, sizeof(note), "<p>MQTT messages dropped: %lu</p>", (unsigned long)dropped);
+        httpd_resp_sendstr_chunk(req, note);
+    }
+    char cap_inputs[400];
+    format_caps_inputs(LAMP_CAPS_DIMMABLE, cap_inputs, sizeof(cap_inputs));
+    httpd_resp_sendstr_chunk(req, "<h2>Add Lamp</h2>"
         "<form action='/add_lamp' method='post'>"
         "Name: <input type='text' name='lamp_name' required> "
         "Addr: <input type='text' name='lamp_address' required> "
-        "Scale: <input type='number' name='lamp_scaling' value='100' style='width:60px'> "
-        "Color: <input type='checkbox' name='lamp_color' value='1'> "
+        "Scale: <input type='number' name='lamp_scaling' placeholder='auto' style='width:60px'> ");
+    httpd_resp_sendstr_chunk(req, cap_inputs);
+    httpd_resp_sendstr_chunk(req,
+        "Groups: <input type='text' name='lamp_groups' placeholder='0xC001,0xC002'> "
+        "Ack: <input type='checkbox' name='lamp_ack' value='1'> "
+        "<input type='submit' value='Add' class='btn edit'></form>"
+        "<h1>Groups</h1>"
+        "<table><tr><th>Name</th><th>Address</th><th>Actions</th></tr>");
+
+    GroupInfo group_list[MAX_GROUPS];
+    count = get_all_groups(group_list, MAX_GROUPS);
+    for (int i = 0; i < count; i++) {
+        char row[384];
+        snprintf(row, sizeof(row), "<tr><td>%s</td><td>0x%04X</td><td>"
+            "<form action='/remove_group' method='post' style='display:inline;'><input type='hidden' name='group_name' value='%s'><input type='submit' value='Remove' class='btn del'></form>"
+            "</td></tr>",
+            group_list[i].name, group_list[i].address, group_list[i].name);
+        httpd_resp_sendstr_chunk(req, row);
+    }
+    httpd_resp_sendstr_chunk(req, "<tr><td>" ALL_LAMPS_GROUP_NAME "</td><td>All nodes</td><td>Built-in</td></tr>"
+        "</table><h2>Add Group</h2>"
+        "<form action='/add_group' method='post'>"
+        "Name: <input type='text' name='group_name' required> "
+        "Addr: <input type='text' name='group_address' placeholder='0xC001' required> "
         "<input type='submit' value='Add' class='btn edit'></form></body></html>");
     httpd_resp_send_chunk(req, NULL, 0);
     return ESP_OK;
 }
 
 static esp_err_t add_lamp_post_handler(httpd_req_t *req) {
-    char buf[512]; httpd_req_recv(req, buf, sizeof(buf));
-    LampInfo l = {0}; char col[4]={0}, scl[16]={0};
-    get_post_field(buf, "lamp_name=", l.name, sizeof(l.name));
-    get_post_field(buf, "lamp_address=", l.address, sizeof(l.address));
-    get_post_field(buf, "lamp_color=", col, sizeof(col)); l.supports_color = (col[0]=='1');
-    get_post_field(buf, "lamp_scaling=", scl, sizeof(scl)); l.brightness_scaling = atoi(scl)?atoi(scl):100;
-    add_lamp_info(&l);
+    char buf[512]; int ret = httpd_req_recv(req, buf, sizeof(buf) - 1);
+    if (ret <= 0) return ESP_FAIL;
+    buf[ret] = '\0';
+    LampLabel lb = {0}; LampInfo l = {0}; char ack[4]={0}, scl[16]={0}, grp[64]={0};
+    get_post_field(buf, "lamp_name=", lb.name, sizeof(lb.name));
+    get_post_field(buf, "lamp_address=", lb.address, sizeof(lb.address));
+    l.caps = parse_lamp_caps(buf);
+    get_post_field(buf, "lamp_scaling=", scl, sizeof(scl)); parse_lamp_scaling(scl, &l);
+    get_post_field(buf, "lamp_groups=", grp, sizeof(grp)); parse_lamp_groups(grp, &l);
+    get_post_field(buf, "lamp_ack=", ack, sizeof(ack)); l.acknowledged = (ack[0]=='1');
+    add_lamp_info(&lb, &l);
     httpd_resp_set_status(req, "303 See Other"); httpd_resp_set_hdr(req, "Location", "/"); httpd_resp_send(req,NULL,0);
-    refresh_mqtt_subscriptions(); publish_ha_discovery_messages();
+    refresh_mqtt_routes(); publish_ha_discovery_messages();
+    probe_kick();
     return ESP_OK;
 }
 static esp_err_t remove_lamp_post_handler(httpd_req_t *req) {
@@ -214,35 +378,77 @@ static esp_err_t remove_lamp_post_handler(httpd_req_t *req) {
     char name[32]; get_post_field(buf, "lamp_name=", name, sizeof(name));
     remove_lamp_info_by_name(name);
     httpd_resp_set_status(req, "303 See Other"); httpd_resp_set_hdr(req, "Location", "/"); httpd_resp_send(req,NULL,0);
-    refresh_mqtt_subscriptions(); publish_ha_discovery_messages();
+    refresh_mqtt_routes(); lamp_state_prune(); publish_ha_discovery_messages();
     return ESP_OK;
 }
 static esp_err_t edit_lamp_get_handler(httpd_req_t *req) {
     char q[128], name[32]; httpd_req_get_url_query_str(req, q, sizeof(q)); httpd_query_key_value(q, "lamp_name", name, sizeof(name));
-    LampInfo l; find_lamp_by_name(name, &l);
-    char buf[1024];
+    LampInfo lamp;
+    LampLabel label;
+    if (lamp_by_name(name, &lamp, &label) != ESP_OK) {
+        httpd_resp_send_404(req);
+        return ESP_OK;
+    }
+    const LampInfo *l = &lamp;
+    const LampLabel *lb = &label;
+    char scaling[8] = "";
+    if (!l->auto_scaling) {
+        snprintf(scaling, sizeof(scaling), "%d", l->brightness_scaling);
+    }
+    char groups[48]; format_lamp_groups(l, groups, sizeof(groups));
+    char cap_inputs[400]; format_caps_inputs(l->caps, cap_inputs, sizeof(cap_inputs));
+    char buf[1536];
     snprintf(buf, sizeof(buf), "<html><body><h1>Edit %s</h1><form action='/update_lamp' method='post'>"
         "<input type='hidden' name='original_name' value='%s'>"
         "Name: <input type='text' name='lamp_name' value='%s'><br>"
         "Addr: <input type='text' name='lamp_address' value='%s'><br>"
-        "Scale: <input type='number' name='lamp_scaling' value='%d'><br>"
-        "Color: <input type='checkbox' name='lamp_color' value='1' %s><br>"
+        "Scale: <input type='number' name='lamp_scaling' value='%s' placeholder='auto'><br>"
+        "%s<br>"
+        "Groups: <input type='text' name='lamp_groups' value='%s' placeholder='0xC001,0xC002'><br>"
+        "Ack: <input type='checkbox' name='lamp_ack' value='1' %s><br>"
         "<input type='submit' value='Update'></form></body></html>",
-        l.name, l.name, l.name, l.address, l.brightness_scaling, l.supports_color?"checked":"");
+        lb->name, lb->name, lb->name, lb->address, scaling, cap_inputs, groups, l->acknowledged?"checked":"");
     httpd_resp_send(req, buf, HTTPD_RESP_USE_STRLEN);
     return ESP_OK;
 }
 static esp_err_t update_lamp_post_handler(httpd_req_t *req) {
-    char buf[512]; httpd_req_recv(req, buf, sizeof(buf));
-    char orig[32]; LampInfo l={0}; char col[4]={0}, scl[16]={0};
+    char buf[512]; int ret = httpd_req_recv(req, buf, sizeof(buf) - 1);
+    if (ret <= 0) return ESP_FAIL;
+    buf[ret] = '\0';
+    char orig[32]={0}; LampLabel lb = {0}; LampInfo l={0}; char ack[4]={0}, scl[16]={0}, grp[64]={0};
     get_post_field(buf, "original_name=", orig, sizeof(orig));
-    get_post_field(buf, "lamp_name=", l.name, sizeof(l.name));
-    get_post_field(buf, "lamp_address=", l.address, sizeof(l.address));
-    get_post_field(buf, "lamp_color=", col, sizeof(col)); l.supports_color = (col[0]=='1');
-    get_post_field(buf, "lamp_scaling=", scl, sizeof(scl)); l.brightness_scaling = atoi(scl)?atoi(scl):100;
-    update_lamp_info(orig, &l);
+    get_post_field(buf, "lamp_name=", lb.name, sizeof(lb.name));
+    get_post_field(buf, "lamp_address=", lb.address, sizeof(lb.address));
+    l.caps = parse_lamp_caps(buf);
+    get_post_field(buf, "lamp_scaling=", scl, sizeof(scl)); parse_lamp_scaling(scl, &l);
+    get_post_field(buf, "lamp_groups=", grp, sizeof(grp)); parse_lamp_groups(grp, &l);
+    get_post_field(buf, "lamp_ack=", ack, sizeof(ack)); l.acknowledged = (ack[0]=='1');
+    update_lamp_info(orig, &lb, &l);
+    httpd_resp_set_status(req, "303 See Other"); httpd_resp_set_hdr(req, "Location", "/"); httpd_resp_send(req,NULL,0);
+    refresh_mqtt_routes(); lamp_state_prune(); publish_ha_discovery_messages();
+    probe_kick();
+    return ESP_OK;
+}
+static esp_err_t add_group_post_handler(httpd_req_t *req) {
+    char buf[256]; int ret = httpd_req_recv(req, buf, sizeof(buf) - 1);
+    if (ret <= 0) return ESP_FAIL;
+    buf[ret] = '\0';
+    GroupInfo g = {0}; char addr[16] = {0};
+    get_post_field(buf, "group_name=", g.name, sizeof(g.name));
+    get_post_field(buf, "group_address=", addr, sizeof(addr)); g.address = (uint16_t)strtol(addr, NULL, 0);
+    add_group_info(&g);
+    httpd_resp_set_status(req, "303 See Other"); httpd_resp_set_hdr(req, "Location", "/"); httpd_resp_send(req,NULL,0);
+    refresh_mqtt_routes(); publish_ha_discovery_messages();
+    return ESP_OK;
+}
+static esp_err_t remove_group_post_handler(httpd_req_t *req) {
+    char buf[128]; int ret = httpd_req_recv(req, buf, sizeof(buf) - 1);
+    if (ret <= 0) return ESP_FAIL;
+    buf[ret] = '\0';
+    char name[32] = {0}; get_post_field(buf, "group_name=", name, sizeof(name));
+    remove_group_info_by_name(name);
     httpd_resp_set_status(req, "303 See Other"); httpd_resp_set_hdr(req, "Location", "/"); httpd_resp_send(req,NULL,0);
-    refresh_mqtt_subscriptions(); publish_ha_discovery_messages();
+    refresh_mqtt_routes(); lamp_state_prune(); publish_ha_discovery_messages();
     return ESP_OK;
 }
 
@@ -250,6 +456,7 @@ httpd_handle_t start_webserver(void)
 {
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.stack_size = 8192;
+    config.max_uri_handlers = 12;
     httpd_handle_t server = NULL;
     if (httpd_start(&server, &config) == ESP_OK) {
         httpd_uri_t root = { .uri = "/", .method = HTTP_GET, .handler = get_lamps_overview_handler };
@@ -262,6 +469,10 @@ httpd_handle_t start_webserver(void)
         httpd_register_uri_handler(server, &edit);
         httpd_uri_t upd = { .uri = "/update_lamp", .method = HTTP_POST, .handler = update_lamp_post_handler };
         httpd_register_uri_handler(server, &upd);
+        httpd_uri_t add_grp = { .uri = "/add_group", .method = HTTP_POST, .handler = add_group_post_handler };
+        httpd_register_uri_handler(server, &add_grp);
+        httpd_uri_t rem_grp = { .uri = "/remove_group", .method = HTTP_POST, .handler = remove_group_post_handler };
+        httpd_register_uri_handler(server, &rem_grp);
 
         // NEW CONFIG ROUTES
         httpd_uri_t cfg = { .uri = "/config", .method = HTTP_GET, .handler = get_config_handler };
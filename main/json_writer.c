@@ -0,0 +1,141 @@
+/*
+ * json_writer.c - Bounded, allocation-free JSON output
+ *
+ * Used for the MQTT payloads the gateway publishes over and over (states,
+ * discovery configs), which would otherwise cost a cJSON tree and a printed
+ * copy on the heap each time.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "json_writer.h"
+
+static void put(json_writer_t *w, const char *s, size_t n)
+{
+    if (w->overflow) {
+        return;
+    }
+    // Keep one byte for the terminator
+    if (n >= w->len - w->pos) {
+        w->overflow = true;
+        return;
+    }
+    memcpy(w->buf + w->pos, s, n);
+    w->pos += n;
+}
+
+static void put_char(json_writer_t *w, char c)
+{
+    put(w, &c, 1);
+}
+
+static void put_escaped(json_writer_t *w, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    put_char(w, '"');
+    while (*s && !w->overflow) {
+        // Copy runs that need no escaping in one go
+        size_t run = strcspn(s, "\"\\\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f"
+                                "\x10\x11\x12\x13\x14\x15\x16\x17\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f");
+        put(w, s, run);
+        s += run;
+        if (*s == '\0') {
+            break;
+        }
+        unsigned char c = (unsigned char)*s++;
+        if (c == '"' || c == '\\') {
+            char esc[2] = { '\\', (char)c };
+            put(w, esc, 2);
+        } else {
+            char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+            put(w, esc, 6);
+        }
+    }
+    put_char(w, '"');
+}
+
+// Separator and key of a new member
+static void member(json_writer_t *w, const char *key)
+{
+    uint8_t bit = 1u << w->depth;
+
+    if (w->has_items & bit) {
+        put_char(w, ',');
+    }
+    w->has_items |= bit;
+    if (key != NULL) {
+        put_escaped(w, key);
+        put_char(w, ':');
+    }
+}
+
+void json_init(json_writer_t *w, char *buf, size_t len)
+{
+    memset(w, 0, sizeof(*w));
+    w->buf = buf;
+    w->len = len;
+    w->overflow = len == 0;
+}
+
+void json_obj_begin(json_writer_t *w, const char *key)
+{
+    if (w->depth + 1 >= JSON_WRITER_MAX_DEPTH) {
+        w->overflow = true;
+        return;
+    }
+    member(w, key);
+    put_char(w, '{');
+    w->depth++;
+    w->has_items &= ~(1u << w->depth);
+}
+
+void json_obj_end(json_writer_t *w)
+{
+    if (w->depth == 0) {
+        w->overflow = true;
+        return;
+    }
+    w->depth--;
+    put_char(w, '}');
+}
+
+void json_str(json_writer_t *w, const char *key, const char *val)
+{
+    member(w, key);
+    put_escaped(w, val);
+}
+
+void json_int(json_writer_t *w, const char *key, int32_t val)
+{
+    char num[12];
+    int n = snprintf(num, sizeof(num), "%ld", (long)val);
+
+    member(w, key);
+    put(w, num, n);
+}
+
+void json_bool(json_writer_t *w, const char *key, bool val)
+{
+    member(w, key);
+    put(w, val ? "true" : "false", val ? 4 : 5);
+}
+
+void json_null(json_writer_t *w, const char *key)
+{
+    member(w, key);
+    put(w, "null", 4);
+}
+
+int json_finish(json_writer_t *w)
+{
+    if (w->overflow || w->depth != 0) {
+        if (w->len > 0) {
+            w->buf[0] = '\0';
+        }
+        return -1;
+    }
+    w->buf[w->pos] = '\0';
+    return (int)w->pos;
+}
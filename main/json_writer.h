@@ -0,0 +1,60 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define JSON_WRITER_MAX_DEPTH 8
+
+/**
+ * @brief Writes a JSON document straight into a caller-supplied buffer,
+ *        without heap allocations.
+ *
+ * Keys and values are appended in order; commas and string escaping are
+ * handled by the writer. Running out of space (or nesting too deep) sets
+ * overflow, after which further calls do nothing and json_finish() fails.
+ */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t pos;
+    uint8_t depth;
+    uint8_t has_items;          // Bit n: the object at depth n has a member already
+    bool overflow;
+} json_writer_t;
+
+/**
+ * @brief Starts a document in @p buf.
+ */
+void json_init(json_writer_t *w, char *buf, size_t len);
+
+/**
+ * @brief Opens an object.
+ *
+ * @param key Member name, or NULL for the top-level object.
+ */
+void json_obj_begin(json_writer_t *w, const char *key);
+
+/**
+ * @brief Closes the innermost open object.
+ */
+void json_obj_end(json_writer_t *w);
+
+/**
+ * @brief Adds a member. Strings are escaped as needed.
+ */
+void json_str(json_writer_t *w, const char *key, const char *val);
+void json_int(json_writer_t *w, const char *key, int32_t val);
+void json_bool(json_writer_t *w, const char *key, bool val);
+void json_null(json_writer_t *w, const char *key);
+
+/**
+ * @brief Terminates the document.
+ *
+ * @return Length of the document excluding the terminator, or -1 if it did
+ *         not fit or objects were left open.
+ */
+int json_finish(json_writer_t *w);
+
+#endif /* JSON_WRITER_H */
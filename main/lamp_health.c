@@ -0,0 +1,290 @@
+/*
+ * lamp_health.c - Tracks which lamps are reachable
+ *
+ * A lamp goes offline after a few messages in a row it did not answer and
+ * comes back with the next status it sends. A message counts once, when its
+ * sender gives up on it, not once per retry. Offline lamps, and lamps that
+ * have been silent for a long time, are checked with a background Get now
+ * and then, a few per round, so a lamp that is powered again at the wall is
+ * noticed without Home Assistant sending it anything.
+ *
+ * Mesh Heartbeat would tell the same without Gets, but subscribing a lamp's
+ * heartbeat publication takes its device key, which the gateway does not have.
+ */
+
+#include <string.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "lamp_health.h"
+#include "lamp_nvs.h"
+#include "lamp_state.h"
+#include "mesh_core.h"
+#include "mesh_tx.h"
+#include "resync.h"
+
+#define TAG "LAMP_HEALTH"
+
+#define HEALTH_MISSES       CONFIG_LAMP_HEALTH_MISSES
+#define HEALTH_RECHECK_US   ((uint64_t)CONFIG_LAMP_HEALTH_RECHECK_S * 1000000)
+#define HEALTH_STALE_US     ((int64_t)CONFIG_LAMP_HEALTH_STALE_S * 1000000)
+#define HEALTH_GETS_PER_ROUND 4
+#define HEALTH_NOTIFY_US    (100 * 1000)
+
+typedef struct {
+    uint16_t addr;              // 0 = unused
+    uint8_t misses;             // Unanswered messages in a row
+    bool offline;
+    bool changed;               // offline changed, handler not called yet
+    bool checking;              // A health check Get is waiting for its reply
+} health_slot_t;
+
+static health_slot_t s_slots[MAX_LAMPS];
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t s_check_timer = NULL;
+static esp_timer_handle_t s_notify_timer = NULL;
+static lamp_health_cb_t s_on_change = NULL;
+static int s_next_check = 0;    // Lamp index the next round starts at
+
+// Call with s_lock held. Returns NULL if the table is full; the caller checks
+// that addr is a lamp, as the lamp list cannot be read in a critical section.
+static health_slot_t *slot_find(uint16_t addr, bool create)
+{
+    health_slot_t *free_slot = NULL;
+
+    for (int i = 0; i < MAX_LAMPS; i++) {
+        if (s_slots[i].addr == addr) {
+            return &s_slots[i];
+        }
+        if (s_slots[i].addr == 0 && free_slot == NULL) {
+            free_slot = &s_slots[i];
+        }
+    }
+    if (!create || free_slot == NULL) {
+        return NULL;
+    }
+    memset(free_slot, 0, sizeof(*free_slot));
+    free_slot->addr = addr;
+    return free_slot;
+}
+
+// Call with s_lock held
+static void set_offline(health_slot_t *slot, bool offline)
+{
+    if (slot->offline != offline) {
+        slot->offline = offline;
+        slot->changed = true;
+    }
+}
+
+static void notify_changes(void *arg)
+{
+    for (int i = 0; i < MAX_LAMPS; i++) {
+        uint16_t addr;
+        bool offline;
+
+        portENTER_CRITICAL(&s_lock);
+        bool changed = s_slots[i].changed;
+        s_slots[i].changed = false;
+        addr = s_slots[i].addr;
+        offline = s_slots[i].offline;
+        portEXIT_CRITICAL(&s_lock);
+
+        if (!changed) {
+            continue;
+        }
+        ESP_LOGI(TAG, "Lamp 0x%04X is %s", addr, offline ? "offline" : "online");
+        if (s_on_change) {
+            s_on_change(addr, !offline);
+        }
+    }
+}
+
+// Call with s_lock held
+static void record_miss(health_slot_t *slot)
+{
+    if (slot->misses < UINT8_MAX) {
+        slot->misses++;
+    }
+    if (slot->misses >= HEALTH_MISSES) {
+        set_offline(slot, true);
+    }
+}
+
+// Calls the handler outside the BLE Mesh callbacks
+static void schedule_notify(void)
+{
+    if (s_notify_timer != NULL && !esp_timer_is_active(s_notify_timer)) {
+        esp_timer_start_once(s_notify_timer, HEALTH_NOTIFY_US);
+    }
+}
+
+// Frees the slots of lamps that were removed, so their places go to new ones
+static void prune_slots(const LampInfo *lamps, int lamp_count)
+{
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < MAX_LAMPS; i++) {
+        bool listed = false;
+        for (int n = 0; n < lamp_count && !listed; n++) {
+            listed = lamps[n].address == s_slots[i].addr;
+        }
+        if (!listed) {
+            memset(&s_slots[i], 0, sizeof(s_slots[i]));
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+static void health_check(void *arg)
+{
+    LampInfo lamps[MAX_LAMPS];
+    int lamp_count = get_all_lamps(lamps, NULL, MAX_LAMPS);
+
+    prune_slots(lamps, lamp_count);
+    if (!mesh_core_is_ready()) {
+        return;
+    }
+
+    int64_t now_us = esp_timer_get_time();
+    int sent = 0;
+
+    if (s_next_check >= lamp_count) {
+        s_next_check = 0;
+    }
+    // Round-robin, so a long list is covered over several rounds
+    for (int n = 0; n < lamp_count && sent < HEALTH_GETS_PER_ROUND; n++) {
+        int i = (s_next_check + n) % lamp_count;
+        uint16_t addr = lamps[i].address;
+        bool check = lamp_health_is_offline(addr);
+
+        if (!check && HEALTH_STALE_US > 0) {
+            lamp_state_t st;
+            lamp_state_get(addr, &st);
+            // Never seen: resync asks those after connecting
+            check = st.last_seen_us != 0 && now_us - st.last_seen_us > HEALTH_STALE_US;
+        }
+        if (!check) {
+            continue;
+        }
+
+        mesh_tx_cmd_t cmd = { .addr = addr, .type = resync_get_type(lamps[i].caps), .get = true };
+        if (mesh_tx_submit(&cmd) != ESP_OK) {
+            // Gateway busy, continue here next round
+            s_next_check = i;
+            return;
+        }
+        portENTER_CRITICAL(&s_lock);
+        health_slot_t *slot = slot_find(addr, true);
+        if (slot != NULL) {
+            slot->checking = true;
+        }
+        portEXIT_CRITICAL(&s_lock);
+        sent++;
+        s_next_check = i + 1;
+    }
+}
+
+/* --- Public API --- */
+
+esp_err_t lamp_health_init(lamp_health_cb_t on_change)
+{
+    s_on_change = on_change;
+
+    const esp_timer_create_args_t notify_args = {
+        .callback = notify_changes,
+        .name = "health_notify",
+    };
+    esp_err_t err = esp_timer_create(&notify_args, &s_notify_timer);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create notify timer (err %d)", err);
+        return err;
+    }
+
+    const esp_timer_create_args_t check_args = {
+        .callback = health_check,
+        .name = "health_check",
+    };
+    err = esp_timer_create(&check_args, &s_check_timer);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create check timer (err %d)", err);
+        return err;
+    }
+    return esp_timer_start_periodic(s_check_timer, HEALTH_RECHECK_US);
+}
+
+void lamp_health_on_status(uint16_t addr)
+{
+    bool changed = false;
+
+    portENTER_CRITICAL(&s_lock);
+    health_slot_t *slot = slot_find(addr, false);
+    if (slot != NULL) {
+        slot->misses = 0;
+        slot->checking = false;
+        set_offline(slot, false);
+        changed = slot->changed;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (changed) {
+        schedule_notify();
+    }
+}
+
+void lamp_health_on_miss(uint16_t addr)
+{
+    bool changed = false;
+
+    if (lamp_by_address(addr, NULL, NULL) != ESP_OK) {
+        return;
+    }
+    portENTER_CRITICAL(&s_lock);
+    health_slot_t *slot = slot_find(addr, true);
+    if (slot != NULL) {
+        record_miss(slot);
+        changed = slot->changed;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    lamp_state_on_miss(addr);
+    if (changed) {
+        schedule_notify();
+    }
+}
+
+void lamp_health_on_timeout(uint16_t addr)
+{
+    bool missed = false;
+    bool changed = false;
+
+    portENTER_CRITICAL(&s_lock);
+    health_slot_t *slot = slot_find(addr, false);
+    if (slot != NULL && slot->checking) {
+        slot->checking = false;
+        record_miss(slot);
+        missed = true;
+        changed = slot->changed;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (missed) {
+        lamp_state_on_miss(addr);
+    }
+    if (changed) {
+        schedule_notify();
+    }
+}
+
+bool lamp_health_is_offline(uint16_t addr)
+{
+    bool offline;
+
+    portENTER_CRITICAL(&s_lock);
+    health_slot_t *slot = slot_find(addr, false);
+    offline = slot != NULL && slot->offline;
+    portEXIT_CRITICAL(&s_lock);
+    return offline;
+}
@@ -0,0 +1,52 @@
+#ifndef LAMP_HEALTH_H
+#define LAMP_HEALTH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/**
+ * @brief Called from the esp_timer task when a lamp goes offline or comes back.
+ */
+typedef void (*lamp_health_cb_t)(uint16_t addr, bool online);
+
+/**
+ * @brief Starts the health checks: lamps that are offline, or silent for longer
+ *        than CONFIG_LAMP_HEALTH_STALE_S, are sent a Get every
+ *        CONFIG_LAMP_HEALTH_RECHECK_S.
+ *
+ * Must be called after mesh_tx_init().
+ *
+ * @param on_change Handler for availability changes.
+ * @return ESP_OK, or the error from esp_timer_create().
+ */
+esp_err_t lamp_health_init(lamp_health_cb_t on_change);
+
+/**
+ * @brief Reports a status message from a lamp, which marks it online. Safe to
+ *        call from the BLE Mesh callbacks.
+ */
+void lamp_health_on_status(uint16_t addr);
+
+/**
+ * @brief Reports a message the lamp never answered, after all its retries.
+ *        After CONFIG_LAMP_HEALTH_MISSES in a row the lamp is offline.
+ */
+void lamp_health_on_miss(uint16_t addr);
+
+/**
+ * @brief Reports a reply timeout from the mesh stack. Only the health
+ *        check's own Gets count as misses here; other senders retry and
+ *        report the final outcome with lamp_health_on_miss(). Safe to call
+ *        from the BLE Mesh callbacks.
+ */
+void lamp_health_on_timeout(uint16_t addr);
+
+/**
+ * @brief Whether a lamp is known to be offline. Lamps that have not been
+ *        heard from yet count as online.
+ */
+bool lamp_health_is_offline(uint16_t addr);
+
+#endif /* LAMP_HEALTH_H */
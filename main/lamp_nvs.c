@@ -3,103 +3,272 @@
 #include "nvs.h"
 #include "esp_log.h"
 #include "cJSON.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include <string.h>
 #include <stdlib.h>
 
-#define MAX_LAMPS 20
 #define TAG "LAMP_NVS"
 #define NVS_NAMESPACE "lamps"
 #define NVS_KEY "lamp_list"
+#define NVS_GROUP_KEY "group_list"
+
+// Open-addressing index from unicast address to cache position. At least
+// twice MAX_LAMPS and a power of two, so probes stay short and wrap cheaply.
+#define ADDR_INDEX_SIZE 64
+#define ADDR_INDEX_EMPTY (-1)
+
+_Static_assert(ADDR_INDEX_SIZE >= 2 * MAX_LAMPS, "address index too small for MAX_LAMPS");
+_Static_assert((ADDR_INDEX_SIZE & (ADDR_INDEX_SIZE - 1)) == 0, "address index size must be a power of two");
 
 // In-memory cache for fast access
 static LampInfo g_lamp_cache[MAX_LAMPS];
+static LampLabel g_lamp_labels[MAX_LAMPS];  // Same order as g_lamp_cache
 static int g_lamp_count = 0;
+static GroupInfo g_group_cache[MAX_GROUPS];
+static int g_group_count = 0;
+static int8_t g_addr_index[ADDR_INDEX_SIZE];
+
+// Guards the caches and the address index. The web server edits them while
+// the MQTT, mesh and timer tasks read them, so readers get copies and every
+// public function holds the lock, including across the NVS write.
+static SemaphoreHandle_t g_lock;
+
+#define LOCK() xSemaphoreTake(g_lock, portMAX_DELAY)
+#define UNLOCK() xSemaphoreGive(g_lock)
 
 // Forward declaration for internal function
 static esp_err_t _save_to_nvs(void);
 
+static inline unsigned _addr_slot(uint16_t address) {
+    // Fibonacci hashing; consecutive addresses land far apart
+    return ((uint16_t)(address * 40503u) >> 10) & (ADDR_INDEX_SIZE - 1);
+}
+
 /**
- * @brief Loads the lamp list from the NVS blob into the in-memory cache.
+ * @brief Rebuilds the address index after the lamp list changed.
+ *
+ * If two lamps share an address, the first one in the list wins, as with
+ * the linear search this replaces.
  */
-static void _load_from_nvs(void) {
-    nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle);
-    if (err != ESP_OK) {
-        ESP_LOGI(TAG, "NVS namespace not found, initializing empty lamp list.");
-        g_lamp_count = 0;
-        return;
+static void _rebuild_addr_index(void) {
+    memset(g_addr_index, ADDR_INDEX_EMPTY, sizeof(g_addr_index));
+    for (int i = 0; i < g_lamp_count; i++) {
+        uint16_t address = g_lamp_cache[i].address;
+        if (address == 0) {
+            continue;
+        }
+        unsigned slot = _addr_slot(address);
+        while (g_addr_index[slot] != ADDR_INDEX_EMPTY &&
+               g_lamp_cache[g_addr_index[slot]].address != address) {
+            slot = (slot + 1) & (ADDR_INDEX_SIZE - 1);
+        }
+        if (g_addr_index[slot] == ADDR_INDEX_EMPTY) {
+            g_addr_index[slot] = (int8_t)i;
+        }
+    }
+}
+
+/**
+ * @brief Adds the capabilities the mesh models imply: HSL and CTL servers
+ *        extend Light Lightness, which extends Generic OnOff and Level.
+ */
+static uint8_t _complete_caps(uint8_t caps) {
+    if (caps & (LAMP_CAP_HSL | LAMP_CAP_CTL)) {
+        caps |= LAMP_CAP_LIGHTNESS;
+    }
+    if (caps & LAMP_CAP_LIGHTNESS) {
+        caps |= LAMP_CAP_ONOFF | LAMP_CAP_LEVEL;
     }
+    return caps ? caps : LAMP_CAPS_DIMMABLE;
+}
 
+/**
+ * @brief Copies a lamp into the cache, parsing the address from its label.
+ */
+static void _store_lamp(int index, const LampLabel *label, const LampInfo *lamp) {
+    LampLabel *dst = &g_lamp_labels[index];
+    memset(dst, 0, sizeof(*dst));
+    strncpy(dst->name, label->name, MAX_LAMP_NAME_LEN - 1);
+    strncpy(dst->address, label->address, MAX_LAMP_ADDR_LEN - 1);
+
+    g_lamp_cache[index] = *lamp;
+    g_lamp_cache[index].address = (uint16_t)strtol(dst->address, NULL, 0);
+    g_lamp_cache[index].caps = _complete_caps(lamp->caps);
+    if (g_lamp_cache[index].brightness_scaling == 0) {
+        g_lamp_cache[index].brightness_scaling = 100;
+    }
+}
+
+/**
+ * @brief Reads a JSON blob from NVS and parses it.
+ *
+ * @return The parsed root (caller frees with cJSON_Delete), or NULL if the key
+ *         does not exist or cannot be parsed.
+ */
+static cJSON *_read_json_blob(nvs_handle_t nvs_handle, const char *key) {
     size_t required_size = 0;
-    err = nvs_get_blob(nvs_handle, NVS_KEY, NULL, &required_size);
+    esp_err_t err = nvs_get_blob(nvs_handle, key, NULL, &required_size);
     if (err == ESP_ERR_NVS_NOT_FOUND || required_size == 0) {
-        ESP_LOGI(TAG, "Lamp list not found in NVS, initializing empty list.");
-        g_lamp_count = 0;
-        nvs_close(nvs_handle);
-        return;
+        ESP_LOGI(TAG, "Key '%s' not found in NVS, initializing empty list.", key);
+        return NULL;
     }
 
     char* json_string = malloc(required_size);
     if (json_string == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate memory for lamp list JSON!");
-        g_lamp_count = 0;
-        nvs_close(nvs_handle);
-        return;
+        ESP_LOGE(TAG, "Failed to allocate memory for '%s' JSON!", key);
+        return NULL;
     }
 
-    err = nvs_get_blob(nvs_handle, NVS_KEY, json_string, &required_size);
+    cJSON *root = NULL;
+    err = nvs_get_blob(nvs_handle, key, json_string, &required_size);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to read lamp list blob from NVS: %s", esp_err_to_name(err));
-        g_lamp_count = 0;
+        ESP_LOGE(TAG, "Failed to read '%s' blob from NVS: %s", key, esp_err_to_name(err));
     } else {
-        cJSON *root = cJSON_Parse(json_string);
-        if (root != NULL && cJSON_IsArray(root)) {
-            int count = 0;
-            cJSON *elem;
-            cJSON_ArrayForEach(elem, root) {
-                if (count >= MAX_LAMPS) break;
-                cJSON *name = cJSON_GetObjectItem(elem, "name");
-                cJSON *address = cJSON_GetObjectItem(elem, "address");
-                cJSON *color = cJSON_GetObjectItem(elem, "supports_color");
-                cJSON *scaling = cJSON_GetObjectItem(elem, "brightness_scaling");
-                if (cJSON_IsString(name) && cJSON_IsString(address)) {
-                    strncpy(g_lamp_cache[count].name, name->valuestring, MAX_LAMP_NAME_LEN - 1);
-                    strncpy(g_lamp_cache[count].address, address->valuestring, MAX_LAMP_ADDR_LEN - 1);
-                    g_lamp_cache[count].name[MAX_LAMP_NAME_LEN - 1] = '\0';
-                    g_lamp_cache[count].address[MAX_LAMP_ADDR_LEN - 1] = '\0';
-
-                    // Load color support (default to false if not present)
-                    if (cJSON_IsBool(color)) {
-                        g_lamp_cache[count].supports_color = cJSON_IsTrue(color);
-                    } else {
-                        g_lamp_cache[count].supports_color = false; 
-                    }
+        root = cJSON_Parse(json_string);
+        if (root == NULL || !cJSON_IsArray(root)) {
+            ESP_LOGW(TAG, "Failed to parse '%s' JSON, starting fresh.", key);
+            cJSON_Delete(root);
+            root = NULL;
+        }
+    }
 
-                    // Load brightness scaling (default to 100 if not present)
-                    if (cJSON_IsNumber(scaling)) {
-                        g_lamp_cache[count].brightness_scaling = scaling->valueint;
-                    } else {
-                        g_lamp_cache[count].brightness_scaling = 100;
-                    }
+    free(json_string);
+    return root;
+}
+
+/**
+ * @brief Serializes a JSON tree into an NVS blob. Takes ownership of @p root.
+ */
+static esp_err_t _write_json_blob(nvs_handle_t nvs_handle, const char *key, cJSON *root) {
+    char *json_string = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
 
-                    count++;
+    if (json_string == NULL) {
+        ESP_LOGE(TAG, "Failed to create JSON string for '%s'.", key);
+        return ESP_FAIL;
+    }
+
+    esp_err_t err = nvs_set_blob(nvs_handle, key, json_string, strlen(json_string) + 1);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to set '%s' blob in NVS: %s", key, esp_err_to_name(err));
+    }
+    free(json_string);
+    return err;
+}
+
+static void _parse_lamp_list(const cJSON *root) {
+    int count = 0;
+    cJSON *elem;
+    cJSON_ArrayForEach(elem, root) {
+        if (count >= MAX_LAMPS) break;
+        cJSON *name = cJSON_GetObjectItem(elem, "name");
+        cJSON *address = cJSON_GetObjectItem(elem, "address");
+        cJSON *caps = cJSON_GetObjectItem(elem, "caps");
+        cJSON *color = cJSON_GetObjectItem(elem, "supports_color");
+        cJSON *scaling = cJSON_GetObjectItem(elem, "brightness_scaling");
+        cJSON *groups = cJSON_GetObjectItem(elem, "groups");
+        cJSON *ack = cJSON_GetObjectItem(elem, "acknowledged");
+        cJSON *auto_scaling = cJSON_GetObjectItem(elem, "auto_scaling");
+        cJSON *probed = cJSON_GetObjectItem(elem, "probed");
+        if (cJSON_IsString(name) && cJSON_IsString(address)) {
+            LampLabel label = {0};
+            LampInfo lamp = {0};
+            strncpy(label.name, name->valuestring, MAX_LAMP_NAME_LEN - 1);
+            strncpy(label.address, address->valuestring, MAX_LAMP_ADDR_LEN - 1);
+
+            // Load capabilities; lists saved before them only know about color
+            if (cJSON_IsNumber(caps)) {
+                lamp.caps = (uint8_t)caps->valueint;
+            } else {
+                lamp.caps = cJSON_IsTrue(color) ? LAMP_CAPS_COLOR : LAMP_CAPS_DIMMABLE;
+            }
+
+            // Load brightness scaling (default to 100 if not present)
+            if (cJSON_IsNumber(scaling) && scaling->valueint > 0 && scaling->valueint <= UINT16_MAX) {
+                lamp.brightness_scaling = (uint16_t)scaling->valueint;
+            } else {
+                lamp.brightness_scaling = 100;
+            }
+
+            // Load acknowledged mode (default to off if not present)
+            lamp.acknowledged = cJSON_IsTrue(ack);
+            // Lamps saved before probing existed were set up by hand: they
+            // count as probed and keep their scale
+            lamp.auto_scaling = cJSON_IsTrue(auto_scaling);
+            lamp.probed = probed == NULL || cJSON_IsTrue(probed);
+
+            // Load group memberships (none if not present)
+            if (cJSON_IsArray(groups)) {
+                int g = 0;
+                cJSON *group;
+                cJSON_ArrayForEach(group, groups) {
+                    if (g >= MAX_LAMP_GROUPS) break;
+                    if (cJSON_IsNumber(group)) {
+                        lamp.groups[g++] = (uint16_t)group->valueint;
+                    }
                 }
             }
-            g_lamp_count = count;
-            ESP_LOGI(TAG, "Loaded %d lamps from NVS.", g_lamp_count);
-        } else {
-            ESP_LOGW(TAG, "Failed to parse lamp list JSON, starting fresh.");
-            g_lamp_count = 0;
+
+            _store_lamp(count, &label, &lamp);
+            count++;
+        }
+    }
+    g_lamp_count = count;
+    _rebuild_addr_index();
+    ESP_LOGI(TAG, "Loaded %d lamps from NVS.", g_lamp_count);
+}
+
+static void _parse_group_list(const cJSON *root) {
+    int count = 0;
+    cJSON *elem;
+    cJSON_ArrayForEach(elem, root) {
+        if (count >= MAX_GROUPS) break;
+        cJSON *name = cJSON_GetObjectItem(elem, "name");
+        cJSON *address = cJSON_GetObjectItem(elem, "address");
+        if (cJSON_IsString(name) && cJSON_IsNumber(address)) {
+            memset(&g_group_cache[count], 0, sizeof(GroupInfo));
+            strncpy(g_group_cache[count].name, name->valuestring, MAX_LAMP_NAME_LEN - 1);
+            g_group_cache[count].address = (uint16_t)address->valueint;
+            count++;
         }
+    }
+    g_group_count = count;
+    ESP_LOGI(TAG, "Loaded %d groups from NVS.", g_group_count);
+}
+
+/**
+ * @brief Loads the lamp and group lists from NVS into the in-memory cache.
+ */
+static void _load_from_nvs(void) {
+    g_lamp_count = 0;
+    g_group_count = 0;
+    _rebuild_addr_index();
+
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGI(TAG, "NVS namespace not found, initializing empty lamp list.");
+        return;
+    }
+
+    cJSON *root = _read_json_blob(nvs_handle, NVS_KEY);
+    if (root != NULL) {
+        _parse_lamp_list(root);
+        cJSON_Delete(root);
+    }
+
+    root = _read_json_blob(nvs_handle, NVS_GROUP_KEY);
+    if (root != NULL) {
+        _parse_group_list(root);
         cJSON_Delete(root);
     }
 
-    free(json_string);
     nvs_close(nvs_handle);
 }
 
 /**
- * @brief Saves the in-memory lamp cache to the NVS blob.
+ * @brief Saves the in-memory lamp and group caches to NVS.
  */
 static esp_err_t _save_to_nvs(void) {
     nvs_handle_t nvs_handle;
@@ -112,128 +281,333 @@ static esp_err_t _save_to_nvs(void) {
     cJSON *root = cJSON_CreateArray();
     for (int i = 0; i < g_lamp_count; i++) {
         cJSON *lamp_obj = cJSON_CreateObject();
-        cJSON_AddStringToObject(lamp_obj, "name", g_lamp_cache[i].name);
-        cJSON_AddStringToObject(lamp_obj, "address", g_lamp_cache[i].address);
-        cJSON_AddBoolToObject(lamp_obj, "supports_color", g_lamp_cache[i].supports_color);
+        cJSON_AddStringToObject(lamp_obj, "name", g_lamp_labels[i].name);
+        cJSON_AddStringToObject(lamp_obj, "address", g_lamp_labels[i].address);
+        cJSON_AddNumberToObject(lamp_obj, "caps", g_lamp_cache[i].caps);
         cJSON_AddNumberToObject(lamp_obj, "brightness_scaling", g_lamp_cache[i].brightness_scaling);
+        cJSON_AddBoolToObject(lamp_obj, "acknowledged", g_lamp_cache[i].acknowledged);
+        cJSON_AddBoolToObject(lamp_obj, "auto_scaling", g_lamp_cache[i].auto_scaling);
+        cJSON_AddBoolToObject(lamp_obj, "probed", g_lamp_cache[i].probed);
+        cJSON *groups = cJSON_AddArrayToObject(lamp_obj, "groups");
+        for (int g = 0; g < MAX_LAMP_GROUPS; g++) {
+            if (g_lamp_cache[i].groups[g] != 0) {
+                cJSON_AddItemToArray(groups, cJSON_CreateNumber(g_lamp_cache[i].groups[g]));
+            }
+        }
         cJSON_AddItemToArray(root, lamp_obj);
     }
-
-    char *json_string = cJSON_PrintUnformatted(root);
-    cJSON_Delete(root);
-
-    if (json_string == NULL) {
-        ESP_LOGE(TAG, "Failed to create JSON string from lamp cache.");
-        nvs_close(nvs_handle);
-        return ESP_FAIL;
+    err = _write_json_blob(nvs_handle, NVS_KEY, root);
+
+    if (err == ESP_OK) {
+        root = cJSON_CreateArray();
+        for (int i = 0; i < g_group_count; i++) {
+            cJSON *group_obj = cJSON_CreateObject();
+            cJSON_AddStringToObject(group_obj, "name", g_group_cache[i].name);
+            cJSON_AddNumberToObject(group_obj, "address", g_group_cache[i].address);
+            cJSON_AddItemToArray(root, group_obj);
+        }
+        err = _write_json_blob(nvs_handle, NVS_GROUP_KEY, root);
     }
 
-    err = nvs_set_blob(nvs_handle, NVS_KEY, json_string, strlen(json_string) + 1);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to set lamp list blob in NVS: %s", esp_err_to_name(err));
-    } else {
+    if (err == ESP_OK) {
         err = nvs_commit(nvs_handle);
         if (err != ESP_OK) {
             ESP_LOGE(TAG, "Failed to commit NVS changes: %s", esp_err_to_name(err));
         } else {
-            ESP_LOGI(TAG, "Successfully saved %d lamps to NVS.", g_lamp_count);
+            ESP_LOGI(TAG, "Successfully saved %d lamps and %d groups to NVS.", g_lamp_count, g_group_count);
         }
     }
 
-    free(json_string);
     nvs_close(nvs_handle);
     return err;
 }
 
+/**
+ * @brief Position of a lamp in the cache, or -1 if no lamp has the name.
+ */
+static int _lamp_index_by_name(const char *name) {
+    for (int i = 0; i < g_lamp_count; i++) {
+        if (strcmp(g_lamp_labels[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Checks whether a lamp or group (or the built-in group) already uses a name.
+ */
+static bool _name_in_use(const char *name) {
+    if (strcmp(name, ALL_LAMPS_GROUP_NAME) == 0) {
+        return true;
+    }
+    if (_lamp_index_by_name(name) >= 0) {
+        return true;
+    }
+    for (int i = 0; i < g_group_count; i++) {
+        if (strcmp(g_group_cache[i].name, name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Position of a lamp in the cache, or -1 if no lamp has the address.
+ */
+static int _lamp_index_by_address(uint16_t address) {
+    if (address == 0) {
+        return -1;
+    }
+    unsigned slot = _addr_slot(address);
+    for (int probe = 0; probe < ADDR_INDEX_SIZE; probe++) {
+        int8_t index = g_addr_index[slot];
+        if (index == ADDR_INDEX_EMPTY || index >= g_lamp_count) {
+            return -1;
+        }
+        if (g_lamp_cache[index].address == address) {
+            return index;
+        }
+        slot = (slot + 1) & (ADDR_INDEX_SIZE - 1);
+    }
+    return -1;
+}
+
+/**
+ * @brief Copies a cached lamp and its label out; either destination may be NULL.
+ */
+static esp_err_t _copy_lamp(int index, LampInfo *lamp, LampLabel *label) {
+    if (index < 0) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (lamp != NULL) {
+        *lamp = g_lamp_cache[index];
+    }
+    if (label != NULL) {
+        *label = g_lamp_labels[index];
+    }
+    return ESP_OK;
+}
+
 // --- Public API Functions ---
 
 void lamp_nvs_init(void) {
+    g_lock = xSemaphoreCreateMutex();
+    if (g_lock == NULL) {
+        ESP_LOGE(TAG, "Failed to create lamp list lock");
+        abort();
+    }
     _load_from_nvs();
 }
 
-esp_err_t add_lamp_info(const LampInfo *new_lamp) {
+esp_err_t add_lamp_info(const LampLabel *label, const LampInfo *new_lamp) {
+    esp_err_t err;
+    LOCK();
     if (g_lamp_count >= MAX_LAMPS) {
         ESP_LOGE(TAG, "Cannot add lamp, storage is full.");
-        return ESP_ERR_NVS_NO_FREE_PAGES;
-    }
-    // Check for duplicate name or address before adding
-    for (int i = 0; i < g_lamp_count; i++) {
-        if (strcmp(g_lamp_cache[i].name, new_lamp->name) == 0) {
-            ESP_LOGE(TAG, "Cannot add lamp, name '%s' already exists.", new_lamp->name);
-            return ESP_ERR_INVALID_ARG;
-        }
+        err = ESP_ERR_NVS_NO_FREE_PAGES;
+    } else if (_name_in_use(label->name)) {
+        // Lamps and groups share the topic namespace
+        ESP_LOGE(TAG, "Cannot add lamp, name '%s' already exists.", label->name);
+        err = ESP_ERR_INVALID_ARG;
+    } else {
+        _store_lamp(g_lamp_count, label, new_lamp);
+        g_lamp_count++;
+        _rebuild_addr_index();
+        err = _save_to_nvs();
     }
-
-    memcpy(&g_lamp_cache[g_lamp_count], new_lamp, sizeof(LampInfo));
-    g_lamp_count++;
-    return _save_to_nvs();
+    UNLOCK();
+    return err;
 }
 
 esp_err_t remove_lamp_info_by_name(const char *name) {
-    int found_index = -1;
-    for (int i = 0; i < g_lamp_count; i++) {
-        if (strcmp(g_lamp_cache[i].name, name) == 0) {
-            found_index = i;
-            break;
-        }
-    }
+    LOCK();
+    int found_index = _lamp_index_by_name(name);
 
     if (found_index == -1) {
+        UNLOCK();
         return ESP_ERR_NVS_NOT_FOUND;
     }
 
     // Shift elements to fill the gap
     for (int i = found_index; i < g_lamp_count - 1; i++) {
         memcpy(&g_lamp_cache[i], &g_lamp_cache[i + 1], sizeof(LampInfo));
+        memcpy(&g_lamp_labels[i], &g_lamp_labels[i + 1], sizeof(LampLabel));
     }
     g_lamp_count--;
+    _rebuild_addr_index();
+
+    esp_err_t err = _save_to_nvs();
+    UNLOCK();
+    return err;
+}
+
+esp_err_t update_lamp_info(const char *original_name, const LampLabel *label,
+                           const LampInfo *updated_lamp) {
+    LOCK();
+    int found_index = _lamp_index_by_name(original_name);
+
+    if (found_index == -1) {
+        UNLOCK();
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (strcmp(original_name, label->name) != 0 && _name_in_use(label->name)) {
+        ESP_LOGE(TAG, "Cannot rename lamp, name '%s' already exists.", label->name);
+        UNLOCK();
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    LampInfo old = g_lamp_cache[found_index];
+    LampInfo *lamp = &g_lamp_cache[found_index];
+    _store_lamp(found_index, label, updated_lamp);
+    lamp->probed = old.probed && lamp->address == old.address &&
+                   (old.auto_scaling || !lamp->auto_scaling);
+    if (lamp->probed && lamp->auto_scaling) {
+        lamp->brightness_scaling = old.brightness_scaling;
+    }
+    _rebuild_addr_index();
+    esp_err_t err = _save_to_nvs();
+    UNLOCK();
+    return err;
+}
+
+esp_err_t set_lamp_probe_result(uint16_t address, uint8_t caps, uint16_t brightness_scaling) {
+    LOCK();
+    int index = _lamp_index_by_address(address);
+    if (index < 0) {
+        UNLOCK();
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+
+    LampInfo *lamp = &g_lamp_cache[index];
+    lamp->caps = _complete_caps((caps & ~LAMP_CAP_CTL) | (lamp->caps & LAMP_CAP_CTL));
+    if (brightness_scaling != 0 && lamp->auto_scaling) {
+        lamp->brightness_scaling = brightness_scaling;
+    }
+    lamp->probed = true;
+    esp_err_t err = _save_to_nvs();
+    UNLOCK();
+    return err;
+}
+
+int get_all_lamps(LampInfo *lamps, LampLabel *labels, int max) {
+    LOCK();
+    int count = g_lamp_count < max ? g_lamp_count : max;
+    if (lamps != NULL) {
+        memcpy(lamps, g_lamp_cache, count * sizeof(LampInfo));
+    }
+    if (labels != NULL) {
+        memcpy(labels, g_lamp_labels, count * sizeof(LampLabel));
+    }
+    UNLOCK();
+    return count;
+}
+
+esp_err_t lamp_by_name(const char *name, LampInfo *lamp, LampLabel *label) {
+    LOCK();
+    esp_err_t err = _copy_lamp(_lamp_index_by_name(name), lamp, label);
+    UNLOCK();
+    return err;
+}
+
+esp_err_t lamp_by_address(uint16_t address, LampInfo *lamp, LampLabel *label) {
+    LOCK();
+    esp_err_t err = _copy_lamp(_lamp_index_by_address(address), lamp, label);
+    UNLOCK();
+    return err;
+}
+
+int get_lamp_count(void) {
+    LOCK();
+    int count = g_lamp_count;
+    UNLOCK();
+    return count;
+}
+
+bool lamp_in_group(const LampInfo *lamp, uint16_t group_addr) {
+    if (group_addr == ALL_LAMPS_GROUP_ADDR) {
+        return true;
+    }
+    for (int g = 0; g < MAX_LAMP_GROUPS; g++) {
+        if (lamp->groups[g] == group_addr) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    return _save_to_nvs();
+esp_err_t add_group_info(const GroupInfo *new_group) {
+    esp_err_t err;
+    LOCK();
+    if (g_group_count >= MAX_GROUPS) {
+        ESP_LOGE(TAG, "Cannot add group, storage is full.");
+        err = ESP_ERR_NVS_NO_FREE_PAGES;
+    } else if (new_group->address < 0xC000 || new_group->address >= 0xFF00) {
+        // Group addresses are 0xC000-0xFEFF; 0xFF00+ are fixed addresses.
+        ESP_LOGE(TAG, "Cannot add group, 0x%04X is not a group address.", new_group->address);
+        err = ESP_ERR_INVALID_ARG;
+    } else if (_name_in_use(new_group->name)) {
+        ESP_LOGE(TAG, "Cannot add group, name '%s' already exists.", new_group->name);
+        err = ESP_ERR_INVALID_ARG;
+    } else {
+        memcpy(&g_group_cache[g_group_count], new_group, sizeof(GroupInfo));
+        g_group_count++;
+        err = _save_to_nvs();
+    }
+    UNLOCK();
+    return err;
 }
 
-esp_err_t update_lamp_info(const char *original_name, const LampInfo *updated_lamp) {
+esp_err_t remove_group_info_by_name(const char *name) {
+    LOCK();
     int found_index = -1;
-    for (int i = 0; i < g_lamp_count; i++) {
-        if (strcmp(g_lamp_cache[i].name, original_name) == 0) {
+    for (int i = 0; i < g_group_count; i++) {
+        if (strcmp(g_group_cache[i].name, name) == 0) {
             found_index = i;
             break;
         }
     }
 
     if (found_index == -1) {
+        UNLOCK();
         return ESP_ERR_NVS_NOT_FOUND;
     }
 
-    memcpy(&g_lamp_cache[found_index], updated_lamp, sizeof(LampInfo));
-    return _save_to_nvs();
-}
+    // Shift elements to fill the gap
+    for (int i = found_index; i < g_group_count - 1; i++) {
+        memcpy(&g_group_cache[i], &g_group_cache[i + 1], sizeof(GroupInfo));
+    }
+    g_group_count--;
 
-const LampInfo* get_all_lamps(int* count) {
-    *count = g_lamp_count;
-    return g_lamp_cache;
+    esp_err_t err = _save_to_nvs();
+    UNLOCK();
+    return err;
 }
 
-esp_err_t find_lamp_by_name(const char *name, LampInfo *lamp_info) {
-    for (int i = 0; i < g_lamp_count; i++) {
-        if (strcmp(g_lamp_cache[i].name, name) == 0) {
-            memcpy(lamp_info, &g_lamp_cache[i], sizeof(LampInfo));
-            return ESP_OK;
-        }
-    }
-    return ESP_ERR_NVS_NOT_FOUND;
+int get_all_groups(GroupInfo *groups, int max) {
+    LOCK();
+    int count = g_group_count < max ? g_group_count : max;
+    memcpy(groups, g_group_cache, count * sizeof(GroupInfo));
+    UNLOCK();
+    return count;
 }
 
-esp_err_t find_lamp_by_address(uint16_t address, LampInfo *lamp_info) {
-    for (int i = 0; i < g_lamp_count; i++) {
-        uint16_t stored_addr = (uint16_t)strtol(g_lamp_cache[i].address, NULL, 0);
-        if (stored_addr == address) {
-            memcpy(lamp_info, &g_lamp_cache[i], sizeof(LampInfo));
-            return ESP_OK;
+esp_err_t find_group_by_name(const char *name, GroupInfo *group_info) {
+    if (strcmp(name, ALL_LAMPS_GROUP_NAME) == 0) {
+        memset(group_info, 0, sizeof(GroupInfo));
+        strncpy(group_info->name, ALL_LAMPS_GROUP_NAME, MAX_LAMP_NAME_LEN - 1);
+        group_info->address = ALL_LAMPS_GROUP_ADDR;
+        return ESP_OK;
+    }
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+    LOCK();
+    for (int i = 0; i < g_group_count; i++) {
+        if (strcmp(g_group_cache[i].name, name) == 0) {
+            memcpy(group_info, &g_group_cache[i], sizeof(GroupInfo));
+            err = ESP_OK;
+            break;
         }
     }
-    return ESP_ERR_NVS_NOT_FOUND;
+    UNLOCK();
+    return err;
 }
-
-int get_lamp_count(void) {
-    return g_lamp_count;
-}
\ No newline at end of file
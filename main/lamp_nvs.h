@@ -3,18 +3,53 @@
 
 #include "esp_err.h"
 #include <stdbool.h>
+#include <stdint.h>
 
 #define MAX_LAMP_NAME_LEN 32
 #define MAX_LAMP_ADDR_LEN 8
+#define MAX_LAMPS 20
+#define MAX_LAMP_GROUPS 4          // Group memberships per lamp
+#define MAX_GROUPS 8
 
-// The core struct remains the same.
+// Reserved name and address of the built-in "all lamps" group.
+#define ALL_LAMPS_GROUP_NAME "all_lamps"
+#define ALL_LAMPS_GROUP_ADDR 0xFFFF // All-nodes address
+
+// Lamp capabilities: the mesh server models a lamp can be driven through.
+// They decide which message types the gateway sends to it.
+#define LAMP_CAP_ONOFF     (1 << 0)   // Generic OnOff
+#define LAMP_CAP_LEVEL     (1 << 1)   // Generic Level
+#define LAMP_CAP_LIGHTNESS (1 << 2)   // Light Lightness
+#define LAMP_CAP_HSL       (1 << 3)   // Light HSL
+#define LAMP_CAP_CTL       (1 << 4)   // Light CTL
+#define LAMP_CAPS_DIMMABLE (LAMP_CAP_ONOFF | LAMP_CAP_LEVEL | LAMP_CAP_LIGHTNESS)
+#define LAMP_CAPS_COLOR    (LAMP_CAPS_DIMMABLE | LAMP_CAP_HSL)
+
+// Lamp record used on the command and status paths. The strings only needed
+// for display and discovery live apart in LampLabel, so scans over the lamp
+// list touch a few bytes per lamp.
 typedef struct {
-    char name[MAX_LAMP_NAME_LEN];
-    char address[MAX_LAMP_ADDR_LEN];
-    bool supports_color;       // Flag to indicate if the lamp supports color (HS)
-    int brightness_scaling;    // Value to scale brightness (e.g., 50, 100, 255)
+    uint16_t address;          // Unicast address
+    uint16_t groups[MAX_LAMP_GROUPS]; // Subscribed group addresses, 0 = unused slot
+    uint16_t brightness_scaling; // Brightness range HA sends (e.g. 100, 255, 65535)
+    uint8_t caps;              // LAMP_CAP_* bits
+    bool acknowledged;         // Send acknowledged Sets and retry until the lamp replies
+    bool auto_scaling;         // brightness_scaling is left to the probe
+    bool probed;               // caps (and brightness_scaling if auto_scaling) were read from the lamp
 } LampInfo;
 
+// Display strings of a lamp.
+typedef struct {
+    char name[MAX_LAMP_NAME_LEN];
+    char address[MAX_LAMP_ADDR_LEN]; // As entered; also the Home Assistant unique id
+} LampLabel;
+
+// A mesh group address exposed to Home Assistant as a light of its own.
+typedef struct {
+    char name[MAX_LAMP_NAME_LEN];
+    uint16_t address;          // Group address (0xC000-0xFEFF)
+} GroupInfo;
+
 /**
  * @brief Initializes the lamp storage system.
  *
@@ -26,10 +61,14 @@ void lamp_nvs_init(void);
 /**
  * @brief Adds a new lamp to the storage.
  *
+ * The binary address is parsed from @p label; capabilities implied by others
+ * (e.g. OnOff and Level by Lightness) are added.
+ *
+ * @param label Name and address of the new lamp.
  * @param new_lamp Pointer to the LampInfo struct for the new lamp.
  * @return ESP_OK on success, or an error code on failure.
  */
-esp_err_t add_lamp_info(const LampInfo *new_lamp);
+esp_err_t add_lamp_info(const LampLabel *label, const LampInfo *new_lamp);
 
 /**
  * @brief Removes a lamp from storage by its name.
@@ -40,39 +79,71 @@ esp_err_t add_lamp_info(const LampInfo *new_lamp);
 esp_err_t remove_lamp_info_by_name(const char *name);
 
 /**
- * @brief Updates an existing lamp's information.
+ * @brief Updates an existing lamp's information, as add_lamp_info() does.
+ *
+ * The probed flag is kept while the address stays the same, so capabilities
+ * edited after a probe are not probed over; a new address clears it, as does
+ * switching the brightness scale to auto. A lamp that stays on auto keeps
+ * its probed scale.
  *
  * @param original_name The current name of the lamp to be updated.
+ * @param label New name and address.
  * @param updated_lamp Pointer to a LampInfo struct with the new details.
  * @return ESP_OK on success, ESP_ERR_NOT_FOUND if not found.
  */
-esp_err_t update_lamp_info(const char *original_name, const LampInfo *updated_lamp);
+esp_err_t update_lamp_info(const char *original_name, const LampLabel *label,
+                           const LampInfo *updated_lamp);
 
 /**
- * @brief Gets a pointer to the in-memory list of all lamps.
+ * @brief Stores the capabilities and brightness range read from a lamp and
+ *        marks it probed.
  *
- * @param[out] count Pointer to an integer that will be filled with the number of lamps.
- * @return A const pointer to the array of LampInfo structs. Do not modify this array directly.
+ * CTL is kept as configured; the gateway cannot probe it. The brightness
+ * range only replaces the scale of a lamp with auto_scaling, never one that
+ * was entered by hand.
+ *
+ * @param address Unicast address of the probed lamp.
+ * @param caps LAMP_CAP_* bits the lamp answered for.
+ * @param brightness_scaling Upper end of the lamp's lightness range, 0 to keep the current one.
+ * @return ESP_OK on success, ESP_ERR_NVS_NOT_FOUND if no lamp has the address.
+ */
+esp_err_t set_lamp_probe_result(uint16_t address, uint8_t caps, uint16_t brightness_scaling);
+
+/**
+ * @brief Copies the list of all lamps.
+ *
+ * The cache is edited from the web server while other tasks read it, so
+ * callers get a snapshot rather than pointers into it.
+ *
+ * @param[out] lamps Array receiving up to @p max lamps, or NULL.
+ * @param[out] labels Array receiving the matching labels, or NULL.
+ * @param max Capacity of the arrays.
+ * @return The number of lamps copied.
  */
-const LampInfo* get_all_lamps(int* count);
+int get_all_lamps(LampInfo *lamps, LampLabel *labels, int max);
 
 /**
- * @brief Finds a lamp by its name from the in-memory cache.
+ * @brief Finds a lamp by its name.
  *
  * @param name The name of the lamp to find.
- * @param[out] lamp_info Pointer to a LampInfo struct to be filled with the found data.
- * @return ESP_OK on success, ESP_ERR_NOT_FOUND if not found.
+ * @param[out] lamp Filled with the lamp, or NULL.
+ * @param[out] label Filled with the lamp's label, or NULL.
+ * @return ESP_OK on success, ESP_ERR_NVS_NOT_FOUND if not found.
  */
-esp_err_t find_lamp_by_name(const char *name, LampInfo *lamp_info);
+esp_err_t lamp_by_name(const char *name, LampInfo *lamp, LampLabel *label);
 
 /**
- * @brief Finds a lamp by its address from the in-memory cache.
+ * @brief Looks up a lamp by its unicast address in constant time.
+ *
+ * The cache keeps an address index that is rebuilt whenever the lamp list
+ * changes, so this is cheap enough for every incoming status message.
  *
  * @param address The unicast address of the lamp to find.
- * @param[out] lamp_info Pointer to a LampInfo struct to be filled with the found data.
- * @return ESP_OK on success, ESP_ERR_NOT_FOUND if not found.
+ * @param[out] lamp Filled with the lamp, or NULL to only test for it.
+ * @param[out] label Filled with the lamp's label, or NULL.
+ * @return ESP_OK on success, ESP_ERR_NVS_NOT_FOUND if no lamp has that address.
  */
-esp_err_t find_lamp_by_address(uint16_t address, LampInfo *lamp_info);
+esp_err_t lamp_by_address(uint16_t address, LampInfo *lamp, LampLabel *label);
 
 /**
  * @brief Gets the current number of stored lamps.
@@ -81,4 +152,55 @@ esp_err_t find_lamp_by_address(uint16_t address, LampInfo *lamp_info);
  */
 int get_lamp_count(void);
 
+/**
+ * @brief Checks whether a lamp is a member of a group.
+ *
+ * Every lamp is a member of the built-in all-lamps group (ALL_LAMPS_GROUP_ADDR).
+ *
+ * @param lamp The lamp to check.
+ * @param group_addr The group address.
+ * @return true if the lamp subscribes to the group.
+ */
+bool lamp_in_group(const LampInfo *lamp, uint16_t group_addr);
+
+/**
+ * @brief Adds a new group to the storage.
+ *
+ * @param new_group Pointer to the GroupInfo struct for the new group.
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if the name is taken by a
+ *         lamp or group or the address is not a group address.
+ */
+esp_err_t add_group_info(const GroupInfo *new_group);
+
+/**
+ * @brief Removes a group from storage by its name.
+ *
+ * Lamp memberships referring to the group address are left untouched; they
+ * describe the lamp's mesh subscriptions, not the gateway's group list.
+ *
+ * @param name The name of the group to remove.
+ * @return ESP_OK on success, ESP_ERR_NVS_NOT_FOUND if not found.
+ */
+esp_err_t remove_group_info_by_name(const char *name);
+
+/**
+ * @brief Copies the list of all user-defined groups.
+ *
+ * The built-in all-lamps group is not part of this list.
+ *
+ * @param[out] groups Array receiving up to @p max groups.
+ * @param max Capacity of the array.
+ * @return The number of groups copied.
+ */
+int get_all_groups(GroupInfo *groups, int max);
+
+/**
+ * @brief Finds a group by its name, including the built-in all-lamps group.
+ *
+ * @param name The name of the group to find.
+ * @param[out] group_info Pointer to a GroupInfo struct to be filled with the found data.
+ * @return ESP_OK on success, ESP_ERR_NVS_NOT_FOUND if not found.
+ */
+esp_err_t find_group_by_name(const char *name, GroupInfo *group_info);
+
 #endif // LAMP_NVS_H
@@ -0,0 +1,436 @@
+/*
+ * lamp_state.c - Last known light state per mesh address
+ *
+ * Entries are created on first use; the table is sized for every configured
+ * lamp and group plus the all-lamps address. Entries of removed lamps and
+ * groups are dropped when the lists change, after a restore and before each
+ * snapshot, so they neither fill the table nor outlive a reboot.
+ *
+ * The table survives reboots and power loss through a snapshot in its own NVS
+ * namespace. Changes only arm a timer, so a burst of changes costs one flash
+ * write, and a snapshot identical to the last one written is skipped. A
+ * restored entry counts as never seen, so resync still confirms it.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+#include "fnv_hash.h"
+#include "json_writer.h"
+#include "lamp_nvs.h"
+#include "lamp_state.h"
+
+#define TAG "LAMP_STATE"
+
+#define LAMP_STATE_SLOTS (MAX_LAMPS + MAX_GROUPS + 1)
+
+#define SNAPSHOT_NAMESPACE "lamp_state"
+#define SNAPSHOT_KEY "snapshot"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_DELAY_US ((uint64_t)CONFIG_LAMP_STATE_SNAPSHOT_S * 1000000)
+
+// Snapshot entry flags
+#define SNAP_ON_KNOWN        (1 << 0)
+#define SNAP_ON              (1 << 1)
+#define SNAP_LIGHTNESS_KNOWN (1 << 2)
+#define SNAP_COLOR_KNOWN     (1 << 3)
+#define SNAP_REPORTS         (1 << 4)
+
+typedef struct __attribute__((packed)) {
+    uint16_t addr;
+    uint8_t flags;
+    uint16_t lightness;
+    uint16_t hue;
+    uint16_t saturation;
+} snapshot_entry_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    uint8_t count;
+    snapshot_entry_t entries[LAMP_STATE_SLOTS];
+} snapshot_t;
+
+typedef struct {
+    uint16_t addr;              // 0 = unused
+    lamp_state_t state;
+} state_slot_t;
+
+static state_slot_t s_slots[LAMP_STATE_SLOTS];
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool s_dirty = false;                // Changed since the last snapshot
+static esp_timer_handle_t s_snapshot_timer = NULL;
+static uint32_t s_snapshot_hash = 0;        // Of the last snapshot written or loaded
+
+// Call with s_lock held. Returns NULL when the table is full.
+static state_slot_t *slot_find(uint16_t addr, bool create)
+{
+    state_slot_t *free_slot = NULL;
+
+    for (int i = 0; i < LAMP_STATE_SLOTS; i++) {
+        if (s_slots[i].addr == addr) {
+            return &s_slots[i];
+        }
+        if (s_slots[i].addr == 0 && free_slot == NULL) {
+            free_slot = &s_slots[i];
+        }
+    }
+    if (!create || free_slot == NULL) {
+        return NULL;
+    }
+    memset(free_slot, 0, sizeof(*free_slot));
+    free_slot->addr = addr;
+    return free_slot;
+}
+
+// Whether addr is in the copied lamp or group list
+static bool addr_configured(uint16_t addr, const LampInfo *lamps, int lamp_count,
+                            const GroupInfo *groups, int group_count)
+{
+    if (addr == ALL_LAMPS_GROUP_ADDR) {
+        return true;
+    }
+    for (int i = 0; i < lamp_count; i++) {
+        if (lamps[i].address == addr) {
+            return true;
+        }
+    }
+    for (int i = 0; i < group_count; i++) {
+        if (groups[i].address == addr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Frees the slots of unconfigured addresses; returns how many were freed.
+static int slots_prune(void)
+{
+    LampInfo lamps[MAX_LAMPS];
+    GroupInfo groups[MAX_GROUPS];
+    int lamp_count = get_all_lamps(lamps, NULL, MAX_LAMPS);
+    int group_count = get_all_groups(groups, MAX_GROUPS);
+    int pruned = 0;
+
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < LAMP_STATE_SLOTS; i++) {
+        if (s_slots[i].addr != 0 &&
+            !addr_configured(s_slots[i].addr, lamps, lamp_count, groups, group_count)) {
+            memset(&s_slots[i], 0, sizeof(s_slots[i]));
+            pruned++;
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return pruned;
+}
+
+// Fields that make up the published state; last_seen_us and reports are not part of it.
+static bool state_differs(const lamp_state_t *a, const lamp_state_t *b)
+{
+    return a->on_known != b->on_known || a->on != b->on ||
+           a->lightness_known != b->lightness_known || a->lightness != b->lightness ||
+           a->color_known != b->color_known || a->hue != b->hue ||
+           a->saturation != b->saturation;
+}
+
+// Arms the snapshot timer unless it is already running.
+static void snapshot_schedule(void)
+{
+    if (s_snapshot_timer != NULL && !esp_timer_is_active(s_snapshot_timer)) {
+        esp_timer_start_once(s_snapshot_timer, SNAPSHOT_DELAY_US);
+    }
+}
+
+static size_t snapshot_size(const snapshot_t *snap)
+{
+    return offsetof(snapshot_t, entries) + snap->count * sizeof(snapshot_entry_t);
+}
+
+static void snapshot_write(void *arg)
+{
+    static snapshot_t snap;     // Timer task stack is small
+
+    memset(&snap, 0, sizeof(snap));
+    snap.version = SNAPSHOT_VERSION;
+    slots_prune();
+
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < LAMP_STATE_SLOTS; i++) {
+        const lamp_state_t *st = &s_slots[i].state;
+        if (s_slots[i].addr == 0 || !st->on_known) {
+            continue;
+        }
+        snapshot_entry_t *e = &snap.entries[snap.count++];
+        e->addr = s_slots[i].addr;
+        e->flags = (st->on_known ? SNAP_ON_KNOWN : 0) | (st->on ? SNAP_ON : 0) |
+                   (st->lightness_known ? SNAP_LIGHTNESS_KNOWN : 0) |
+                   (st->color_known ? SNAP_COLOR_KNOWN : 0) | (st->reports ? SNAP_REPORTS : 0);
+        e->lightness = st->lightness;
+        e->hue = st->hue;
+        e->saturation = st->saturation;
+    }
+    s_dirty = false;
+    portEXIT_CRITICAL(&s_lock);
+
+    size_t len = snapshot_size(&snap);
+    uint32_t hash = fnv_hash(&snap, len);
+    if (hash == s_snapshot_hash) {
+        return;
+    }
+
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(SNAPSHOT_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(nvs, SNAPSHOT_KEY, &snap, len);
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to write state snapshot: %s", esp_err_to_name(err));
+        portENTER_CRITICAL(&s_lock);
+        s_dirty = true;
+        portEXIT_CRITICAL(&s_lock);
+        snapshot_schedule();
+        return;
+    }
+    s_snapshot_hash = hash;
+    ESP_LOGD(TAG, "Snapshot of %d states written", snap.count);
+}
+
+static void snapshot_restore(void)
+{
+    static snapshot_t snap;
+    size_t len = sizeof(snap);
+    nvs_handle_t nvs;
+
+    if (nvs_open(SNAPSHOT_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return;
+    }
+    esp_err_t err = nvs_get_blob(nvs, SNAPSHOT_KEY, &snap, &len);
+    nvs_close(nvs);
+    if (err != ESP_OK || len < offsetof(snapshot_t, entries) ||
+        snap.version != SNAPSHOT_VERSION || snap.count > LAMP_STATE_SLOTS ||
+        len != snapshot_size(&snap)) {
+        if (err != ESP_ERR_NVS_NOT_FOUND) {
+            ESP_LOGW(TAG, "Ignoring unreadable state snapshot");
+        }
+        return;
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < snap.count; i++) {
+        const snapshot_entry_t *e = &snap.entries[i];
+        state_slot_t *slot = slot_find(e->addr, true);
+        if (slot == NULL) {
+            break;
+        }
+        slot->state = (lamp_state_t){
+            .on_known = e->flags & SNAP_ON_KNOWN,
+            .on = e->flags & SNAP_ON,
+            .lightness_known = e->flags & SNAP_LIGHTNESS_KNOWN,
+            .lightness = e->lightness,
+            .color_known = e->flags & SNAP_COLOR_KNOWN,
+            .hue = e->hue,
+            .saturation = e->saturation,
+            .reports = e->flags & SNAP_REPORTS,
+            .last_seen_us = 0,
+        };
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    s_snapshot_hash = fnv_hash(&snap, len);
+    int pruned = slots_prune();
+    ESP_LOGI(TAG, "Restored %d lamp states", snap.count - pruned);
+}
+
+esp_err_t lamp_state_init(void)
+{
+    snapshot_restore();
+
+    const esp_timer_create_args_t args = {
+        .callback = snapshot_write,
+        .name = "state_snap",
+    };
+    esp_err_t err = esp_timer_create(&args, &s_snapshot_timer);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create snapshot timer (err %d)", err);
+    }
+    return err;
+}
+
+void lamp_state_prune(void)
+{
+    if (slots_prune() == 0) {
+        return;
+    }
+    portENTER_CRITICAL(&s_lock);
+    s_dirty = true;
+    portEXIT_CRITICAL(&s_lock);
+    snapshot_schedule();
+}
+
+void lamp_state_get(uint16_t addr, lamp_state_t *out)
+{
+    portENTER_CRITICAL(&s_lock);
+    state_slot_t *slot = slot_find(addr, false);
+    if (slot) {
+        *out = slot->state;
+    } else {
+        memset(out, 0, sizeof(*out));
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+// Lightness 0 switches the lamp off; keep the previous level for the next "on".
+static void apply_lightness(lamp_state_t *st, uint16_t lightness)
+{
+    st->on_known = true;
+    st->on = lightness > 0;
+    if (lightness > 0) {
+        st->lightness_known = true;
+        st->lightness = lightness;
+    }
+}
+
+// Generic Level is bound to Light Lightness as lightness - 32768.
+static void apply_level(lamp_state_t *st, int16_t level)
+{
+    apply_lightness(st, (uint16_t)((int32_t)level + 32768));
+}
+
+static void apply_hsl(lamp_state_t *st, uint16_t lightness, uint16_t hue, uint16_t saturation)
+{
+    apply_lightness(st, lightness);
+    st->color_known = true;
+    st->hue = hue;
+    st->saturation = saturation;
+}
+
+void lamp_state_apply_msg(const mesh_msg_t *msg)
+{
+    bool dirty = false;
+
+    portENTER_CRITICAL(&s_lock);
+    state_slot_t *slot = slot_find(msg->addr, true);
+    if (slot) {
+        lamp_state_t *st = &slot->state;
+        lamp_state_t before = *st;
+        switch (msg->type) {
+        case MESH_MSG_ONOFF:
+            st->on_known = true;
+            st->on = msg->onoff != 0;
+            break;
+        case MESH_MSG_LEVEL:
+            apply_level(st, msg->level);
+            break;
+        case MESH_MSG_LIGHTNESS:
+            apply_lightness(st, msg->lightness);
+            break;
+        case MESH_MSG_HSL:
+            apply_hsl(st, msg->hsl.lightness, msg->hsl.hue, msg->hsl.saturation);
+            break;
+        default:
+            break;
+        }
+        s_dirty |= state_differs(&before, st);
+        dirty = s_dirty;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (dirty) {
+        snapshot_schedule();
+    }
+}
+
+bool lamp_state_apply_status(const mesh_core_status_t *status)
+{
+    bool changed = false;
+    bool dirty = false;
+
+    portENTER_CRITICAL(&s_lock);
+    state_slot_t *slot = slot_find(status->addr, true);
+    if (slot) {
+        lamp_state_t *st = &slot->state;
+        lamp_state_t before = *st;
+        switch (status->type) {
+        case MESH_MSG_ONOFF:
+            st->on_known = true;
+            st->on = status->onoff != 0;
+            break;
+        case MESH_MSG_LEVEL:
+            apply_level(st, status->level);
+            break;
+        case MESH_MSG_LIGHTNESS:
+            apply_lightness(st, status->lightness);
+            break;
+        case MESH_MSG_HSL:
+            apply_hsl(st, status->hsl.lightness, status->hsl.hue, status->hsl.saturation);
+            break;
+        default:
+            break;
+        }
+        // Get replies are answers to our polls; only replies to Sets and
+        // publications show that the lamp reports changes by itself
+        if (status->source != MESH_CORE_STATUS_GET_REPLY) {
+            st->reports = true;
+        }
+        st->last_seen_us = esp_timer_get_time();
+        changed = state_differs(&before, st);
+        s_dirty |= changed || before.reports != st->reports;
+        dirty = s_dirty;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (dirty) {
+        snapshot_schedule();
+    }
+    return changed;
+}
+
+void lamp_state_on_miss(uint16_t addr)
+{
+    bool dirty = false;
+
+    portENTER_CRITICAL(&s_lock);
+    state_slot_t *slot = slot_find(addr, false);
+    if (slot && slot->state.reports) {
+        slot->state.reports = false;
+        s_dirty = true;
+        dirty = true;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (dirty) {
+        snapshot_schedule();
+    }
+}
+
+int lamp_state_to_json(const lamp_state_t *st, char *buf, size_t len)
+{
+    json_writer_t w;
+
+    json_init(&w, buf, len);
+    json_obj_begin(&w, NULL);
+    if (st->on_known) {
+        json_str(&w, "state", st->on ? "ON" : "OFF");
+    }
+    if (st->on_known && st->on && st->lightness_known) {
+        json_int(&w, "brightness", st->lightness);
+        if (st->color_known) {
+            json_str(&w, "color_mode", "hs");
+            json_obj_begin(&w, "color");
+            json_int(&w, "h", st->hue);
+            json_int(&w, "s", st->saturation);
+            json_obj_end(&w);
+        }
+    }
+    json_obj_end(&w);
+    return json_finish(&w);
+}
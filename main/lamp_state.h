@@ -0,0 +1,91 @@
+#ifndef LAMP_STATE_H
+#define LAMP_STATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "mesh_codec.h"
+#include "mesh_core.h"
+
+/**
+ * @brief Last known light state of a mesh address (lamp or group), from the
+ *        commands sent to it and the status messages it reported.
+ *
+ * This is the single source for state topics, the web overview and command
+ * merging. A status from the lamp always overrides a commanded value.
+ */
+typedef struct {
+    bool on_known;
+    bool on;
+    bool lightness_known;
+    uint16_t lightness;         // Last non-zero lightness, kept while the lamp is off
+    bool color_known;
+    uint16_t hue;
+    uint16_t saturation;
+    bool reports;               // Sends a status after a Set (reply or publication); cleared when it misses one
+    int64_t last_seen_us;       // esp_timer time of the last status, 0 = never
+} lamp_state_t;
+
+/**
+ * @brief Restores the states saved before the last reboot and starts saving
+ *        snapshots of changes.
+ *
+ * Call once at boot after nvs_flash_init() and before MQTT connects, so the
+ * restored states are the first ones published. Restored states count as
+ * never seen (last_seen_us 0) until the lamp reports again; states of lamps
+ * and groups removed meanwhile are dropped. Changes are saved
+ * CONFIG_LAMP_STATE_SNAPSHOT_S after the first change since the last snapshot.
+ * Call after lamp_nvs_init().
+ *
+ * @return ESP_OK, or the error from esp_timer_create() (states are then not saved).
+ */
+esp_err_t lamp_state_init(void);
+
+/**
+ * @brief Drops the states of addresses that are no longer a configured lamp,
+ *        group or the all-lamps group, so their slots go to new ones. Call
+ *        after a lamp or group was removed or readdressed.
+ */
+void lamp_state_prune(void);
+
+/**
+ * @brief Copies the last known state of an address.
+ *
+ * @param addr Unicast or group address.
+ * @param[out] out Receives the state; all fields unknown if the address has none.
+ */
+void lamp_state_get(uint16_t addr, lamp_state_t *out);
+
+/**
+ * @brief Records the state a Set message puts its destination in, until the
+ *        lamp reports otherwise.
+ */
+void lamp_state_apply_msg(const mesh_msg_t *msg);
+
+/**
+ * @brief Records a status message from a lamp. Safe to call from the BLE Mesh
+ *        callbacks.
+ *
+ * @return true if the lamp's state changed.
+ */
+bool lamp_state_apply_status(const mesh_core_status_t *status);
+
+/**
+ * @brief Records that a lamp did not answer a message. It no longer counts as
+ *        reporting its state, so commands publish their state optimistically
+ *        again until it sends a status of its own.
+ */
+void lamp_state_on_miss(uint16_t addr);
+
+/**
+ * @brief Formats a state as a Home Assistant JSON state payload. Fields that
+ *        are not known are left out.
+ *
+ * @return Length written, excluding the terminator, or -1 if @p buf is too
+ *         small (it then holds an empty string).
+ */
+int lamp_state_to_json(const lamp_state_t *st, char *buf, size_t len);
+
+#endif /* LAMP_STATE_H */
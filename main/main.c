@@ -51,20 +51,26 @@
 #include "esp_http_server.h"
 
 /* BLE Mesh */
-#include "esp_ble_mesh_common_api.h"
-#include "esp_ble_mesh_provisioning_api.h"
-#include "esp_ble_mesh_networking_api.h"
-#include "esp_ble_mesh_config_model_api.h"
-#include "esp_ble_mesh_generic_model_api.h"
-#include "esp_ble_mesh_lighting_model_api.h"
+#include "esp_ble_mesh_defs.h"
+#include "mesh_core.h"
 
 /* Project-specific */
 #include "board.h"
 #include "lamp_nvs.h"
 #include "http_server.h"
-#include "cJSON.h"
 #include "main.h"
 #include "wifi_setup.h"
+#include "mesh_tx.h"
+#include "lamp_state.h"
+#include "cmd_planner.h"
+#include "cmd_parse.h"
+#include "resync.h"
+#include "state_pub.h"
+#include "mqtt_routes.h"
+#include "mqtt_pub.h"
+#include "probe.h"
+#include "lamp_health.h"
+#include "discovery.h"
 
 /* --- Macros and Constants --- */
 
@@ -75,7 +81,9 @@ static char s_mqtt_pass[64] = {0};
 
 // General
 #define TAG "BLE_MESH_GATEWAY"
-#define CID_ESP 0x02E5
+
+// Timeout for acknowledged Sets; mesh_tx retries on top of this
+#define ACK_MSG_TIMEOUT_MS CONFIG_MESH_TX_ACK_TIMEOUT_MS
 
 // Wi-Fi Configuration (from menuconfig)
 //#define ESP_WIFI_SSID      CONFIG_ESP_WIFI_SSID
@@ -94,258 +102,145 @@ static char s_mqtt_pass[64] = {0};
 #define WIFI_CONNECTED_BIT BIT0
 #define WIFI_FAIL_BIT      BIT1
 
-/* --- Global Variables --- */
+// Group the lamps publish their status to, 0 = none
+#if CONFIG_MESH_STATUS_GROUP_ENABLE
+#define MESH_STATUS_GROUP CONFIG_MESH_STATUS_GROUP
+#else
+#define MESH_STATUS_GROUP 0
+#endif
+
+// Home Assistant announces "online" here after it (re)started
+#define HA_STATUS_TOPIC "homeassistant/status"
 
-// BLE Mesh
-static uint8_t dev_uuid[16] = { 0xcc, 0xcc };
-static esp_ble_mesh_client_t onoff_client;
-static esp_ble_mesh_client_t level_client;
-static esp_ble_mesh_client_t light_client;
+/* --- Global Variables --- */
 
 // MQTT
 static esp_mqtt_client_handle_t mqtt_client = NULL;
 
-// NVS
-static nvs_handle_t NVS_HANDLE;
-
-// Application State
-static struct app_state_t {
-    uint16_t net_idx;   /* NetKey Index */
-    uint16_t app_idx;   /* AppKey Index */
-    uint8_t  tid;       /* Message TID */
-} __attribute__((packed)) app_state = {
-    .net_idx = ESP_BLE_MESH_KEY_UNUSED,
-    .app_idx = ESP_BLE_MESH_KEY_UNUSED,
-    .tid = 0x0,
-};
-
-/* --- BLE Mesh Configuration --- */
-
-static esp_ble_mesh_cfg_srv_t config_server = {
-    .relay = ESP_BLE_MESH_RELAY_DISABLED,
-    .beacon = ESP_BLE_MESH_BEACON_ENABLED,
-#if defined(CONFIG_BLE_MESH_FRIEND)
-    .friend_state = ESP_BLE_MESH_FRIEND_ENABLED,
-#else
-    .friend_state = ESP_BLE_MESH_FRIEND_NOT_SUPPORTED,
-#endif
-#if defined(CONFIG_BLE_MESH_GATT_PROXY_SERVER)
-    .gatt_proxy = ESP_BLE_MESH_GATT_PROXY_ENABLED,
-#else
-    .gatt_proxy = ESP_BLE_MESH_GATT_PROXY_NOT_SUPPORTED,
-#endif
-    .default_ttl = 7,
-    .net_transmit = ESP_BLE_MESH_TRANSMIT(2, 20),
-    .relay_retransmit = ESP_BLE_MESH_TRANSMIT(2, 20),
-};
-
-ESP_BLE_MESH_MODEL_PUB_DEFINE(onoff_cli_pub, 2 + 2, ROLE_NODE);
-ESP_BLE_MESH_MODEL_PUB_DEFINE(level_cli_pub, 2 + 2, ROLE_NODE);
-ESP_BLE_MESH_MODEL_PUB_DEFINE(light_cli_pub, 2 + 2, ROLE_NODE);
-
-static esp_ble_mesh_model_t root_models[] = {
-    ESP_BLE_MESH_MODEL_CFG_SRV(&config_server),
-    ESP_BLE_MESH_MODEL_GEN_ONOFF_CLI(&onoff_cli_pub, &onoff_client),
-    ESP_BLE_MESH_MODEL_GEN_LEVEL_CLI(&level_cli_pub, &level_client),
-    ESP_BLE_MESH_MODEL_LIGHT_LIGHTNESS_CLI(&light_cli_pub, &light_client),
-};
-
-static esp_ble_mesh_elem_t elements[] = {
-    ESP_BLE_MESH_ELEMENT(0, root_models, ESP_BLE_MESH_MODEL_NONE),
-};
-
-static esp_ble_mesh_comp_t composition = {
-    .cid = CID_ESP,
-    .elements = elements,
-    .element_count = ARRAY_SIZE(elements),
-};
-
-static esp_ble_mesh_prov_t provision = {
-    .uuid = dev_uuid,
-    .output_size = 0,
-    .output_actions = 0,
-};
-
-
-/* --- NVS Functions for BLE Mesh State --- */
-
-static esp_err_t ble_mesh_nvs_open(nvs_handle_t *handle)
-{
-    return nvs_open("ble_mesh", NVS_READWRITE, handle);
-}
+// Command payload arriving in several MQTT_EVENT_DATA events
+static char s_cmd_frag_name[MAX_LAMP_NAME_LEN];    // Target lamp or group
+static cmd_frag_t s_cmd_frag;
 
-static esp_err_t ble_mesh_nvs_store(nvs_handle_t handle, const char *key, const void *data, size_t length)
-{
-    return nvs_set_blob(handle, key, data, length);
-}
+/* --- BLE Mesh Events --- */
 
-static esp_err_t ble_mesh_nvs_restore(nvs_handle_t handle, const char *key, void *data, size_t length, bool *exist)
+static void mesh_prov_complete(uint16_t net_idx, uint16_t addr)
 {
-    esp_err_t err = nvs_get_blob(handle, key, data, &length);
-    if (err != ESP_OK) {
-        if (err == ESP_ERR_NVS_NOT_FOUND) {
-            *exist = false;
-        }
-        return err;
-    }
-    *exist = true;
-    return ESP_OK;
+    board_led_operation(GPIO_NUM_2, LED_OFF);
 }
 
-static void mesh_info_store(void)
+/**
+ * @brief Sends a state payload built by state_pub to the lamp's state topic.
+ */
+static bool mqtt_send_state(const char *name, const char *payload)
 {
-    ble_mesh_nvs_store(NVS_HANDLE, NVS_MESH_INFO_KEY, &app_state, sizeof(app_state));
+    mqtt_route_t route;
+
+    if (mqtt_client == NULL || !mqtt_routes_by_name(name, &route)) {
+        return false;
+    }
+    // Only the latest state of a lamp matters if several are waiting
+    return mqtt_pub_post(route.state_topic, payload, 0, false, true);
 }
 
-static void mesh_info_restore(void)
+/**
+ * @brief Called by mqtt_pub for a message dropped from its full queue. A
+ *        dropped state must go out again even if it does not change.
+ */
+static void mqtt_pub_dropped_handler(const char *topic)
 {
-    esp_err_t err = ESP_OK;
-    bool exist = false;
-
-    err = ble_mesh_nvs_restore(NVS_HANDLE, NVS_MESH_INFO_KEY, &app_state, sizeof(app_state), &exist);
-    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
-        ESP_LOGE(TAG, "Failed to restore mesh info from NVS");
+    const size_t prefix_len = strlen(MQTT_TOPIC_PREFIX);
+    const size_t suffix_len = strlen("/state");
+    size_t len = strlen(topic);
+    char name[MAX_LAMP_NAME_LEN];
+    mqtt_route_t route;
+
+    if (len <= prefix_len + suffix_len || len - prefix_len - suffix_len >= sizeof(name) ||
+        strncmp(topic, MQTT_TOPIC_PREFIX, prefix_len) != 0 ||
+        strcmp(topic + len - suffix_len, "/state") != 0) {
         return;
     }
-
-    if (exist) {
-        ESP_LOGI(TAG, "Restored state: net_idx 0x%04x, app_idx 0x%04x, tid 0x%02x",
-            app_state.net_idx, app_state.app_idx, app_state.tid);
+    memcpy(name, topic + prefix_len, len - prefix_len - suffix_len);
+    name[len - prefix_len - suffix_len] = '\0';
+    if (mqtt_routes_by_name(name, &route)) {
+        state_pub_forget(route.addr);
     }
 }
 
-
-/* --- BLE Mesh Core Functions & Callbacks --- */
-
-static void prov_complete(uint16_t net_idx, uint16_t addr, uint8_t flags, uint32_t iv_index)
+/**
+ * @brief Schedules the cached state of a lamp or group for its state topic.
+ */
+static void publish_state(const char *name, uint16_t addr)
 {
-    ESP_LOGI(TAG, "Provisioning complete: net_idx 0x%04x, addr 0x%04x", net_idx, addr);
-    ESP_LOGI(TAG, "flags: 0x%02x, iv_index: 0x%08" PRIx32, flags, iv_index);
-    
-    board_led_operation(GPIO_NUM_2, LED_OFF);
-    app_state.net_idx = net_idx;
+    state_pub_request(name, addr);
 }
 
-static void ble_mesh_provisioning_cb(esp_ble_mesh_prov_cb_event_t event,
-                                     esp_ble_mesh_prov_cb_param_t *param)
+/**
+ * @brief Publishes the cached state of every lamp that has one.
+ */
+static void publish_cached_states(void)
 {
-    switch (event) {
-    case ESP_BLE_MESH_PROV_REGISTER_COMP_EVT:
-        ESP_LOGI(TAG, "ESP_BLE_MESH_PROV_REGISTER_COMP_EVT, err_code %d", param->prov_register_comp.err_code);
-        mesh_info_restore();
-        break;
-    case ESP_BLE_MESH_NODE_PROV_LINK_OPEN_EVT:
-        ESP_LOGI(TAG, "Provisioning link opened on %s",
-            param->node_prov_link_open.bearer == ESP_BLE_MESH_PROV_ADV ? "PB-ADV" : "PB-GATT");
-        break;
-    case ESP_BLE_MESH_NODE_PROV_LINK_CLOSE_EVT:
-        ESP_LOGI(TAG, "Provisioning link closed on %s",
-            param->node_prov_link_close.bearer == ESP_BLE_MESH_PROV_ADV ? "PB-ADV" : "PB-GATT");
-        break;
-    case ESP_BLE_MESH_NODE_PROV_COMPLETE_EVT:
-        prov_complete(param->node_prov_complete.net_idx, param->node_prov_complete.addr,
-            param->node_prov_complete.flags, param->node_prov_complete.iv_index);
-        break;
-    default:
-        break;
+    LampInfo lamps[MAX_LAMPS];
+    LampLabel labels[MAX_LAMPS];
+    int lamp_count = get_all_lamps(lamps, labels, MAX_LAMPS);
+    for (int i = 0; i < lamp_count; i++) {
+        publish_state(labels[i].name, lamps[i].address);
     }
 }
 
-static void ble_mesh_config_server_cb(esp_ble_mesh_cfg_server_cb_event_t event,
-                                      esp_ble_mesh_cfg_server_cb_param_t *param)
+static void mesh_status_handler(const mesh_core_status_t *status)
 {
-    if (event == ESP_BLE_MESH_CFG_SERVER_STATE_CHANGE_EVT) {
-        switch (param->ctx.recv_op) {
-        case ESP_BLE_MESH_MODEL_OP_APP_KEY_ADD:
-            ESP_LOGI(TAG, "AppKey added: net_idx 0x%04x, app_idx 0x%04x",
-                param->value.state_change.appkey_add.net_idx,
-                param->value.state_change.appkey_add.app_idx);
-            break;
-        case ESP_BLE_MESH_MODEL_OP_MODEL_APP_BIND:
-            ESP_LOGI(TAG, "Model bound: elem_addr 0x%04x, app_idx 0x%04x, mod_id 0x%04x",
-                param->value.state_change.mod_app_bind.element_addr,
-                param->value.state_change.mod_app_bind.app_idx,
-                param->value.state_change.mod_app_bind.model_id);
-            if (param->value.state_change.mod_app_bind.model_id == ESP_BLE_MESH_MODEL_ID_GEN_ONOFF_CLI ||
-                param->value.state_change.mod_app_bind.model_id == ESP_BLE_MESH_MODEL_ID_LIGHT_LIGHTNESS_CLI) {
-                app_state.app_idx = param->value.state_change.mod_app_bind.app_idx;
-                mesh_info_store();
-            }
-            break;
-        default:
-            break;
-        }
+    if (status->source == MESH_CORE_STATUS_SET_REPLY) {
+        mesh_tx_on_status(status->addr, status->type);
     }
-}
 
-static void ble_mesh_generic_client_cb(esp_ble_mesh_generic_client_cb_event_t event,
-                                       esp_ble_mesh_generic_client_cb_param_t *param)
-{
-    if (param->error_code) {
-        ESP_LOGE(TAG, "Generic client error: event %u, error_code %d, opcode 0x%04" PRIx32,
-                 event, param->error_code, param->params->opcode);
+    ESP_LOGI(TAG, "%s status from 0x%04X", mesh_codec_desc(status->type)->name, status->addr);
+    probe_on_status(status);
+    lamp_health_on_status(status->addr);
+    if (status->type == MESH_MSG_LIGHTNESS_RANGE) {
+        // Configuration, not state; only the probe asks for it
         return;
     }
+    resync_on_status(status->addr);
 
-    switch (event) {
-    case ESP_BLE_MESH_GENERIC_CLIENT_GET_STATE_EVT:
-    case ESP_BLE_MESH_GENERIC_CLIENT_SET_STATE_EVT:
-    case ESP_BLE_MESH_GENERIC_CLIENT_PUBLISH_EVT:
-        if (param->params->ctx.recv_op == ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_STATUS) {
-            uint16_t sender_addr = param->params->ctx.addr;
-            uint8_t onoff_state = param->status_cb.onoff_status.present_onoff;
-            ESP_LOGI(TAG, "OnOff status from 0x%04X: %s", sender_addr, onoff_state ? "ON" : "OFF");
-
-            LampInfo lamp_info;
-            if (find_lamp_by_address(sender_addr, &lamp_info) == ESP_OK) {
-                char state_topic[256];
-                char state_payload[128];
-                snprintf(state_topic, sizeof(state_topic), "homeassistant/light/%s/state", lamp_info.name);
-                snprintf(state_payload, sizeof(state_payload), "{\"state\":\"%s\"}", onoff_state ? "ON" : "OFF");
-                if (mqtt_client) {
-                    esp_mqtt_client_publish(mqtt_client, state_topic, state_payload, 0, 0, false);
-                }
-            }
-        }
-        break;
-    default:
-        ESP_LOGD(TAG, "Unknown generic client event %u", event);
-        break;
+    LampLabel label;
+    if (lamp_by_address(status->addr, NULL, &label) != ESP_OK) {
+        // Not a configured lamp; its state would only take a slot
+        return;
     }
+    // Unchanged states are filtered out by state_pub
+    lamp_state_apply_status(status);
+    publish_state(label.name, status->addr);
 }
 
-static void ble_mesh_lighting_client_cb(esp_ble_mesh_light_client_cb_event_t event,
-                                        esp_ble_mesh_light_client_cb_param_t *param)
+static void mesh_timeout_handler(uint16_t addr, mesh_msg_type_t type)
 {
-    ESP_LOGI(TAG, "Lighting client event: %d, error_code %d, opcode 0x%04" PRIx32,
-             event, param->error_code, param->params->opcode);
+    mesh_tx_on_timeout(addr, type);
+    lamp_health_on_timeout(addr);
+}
 
-    if (param->error_code) {
-        ESP_LOGE(TAG, "Lighting client message failed to send (timeout)");
+/**
+ * @brief Publishes whether a lamp is reachable to
+ *        homeassistant/light/<name>/availability (retained).
+ */
+static void publish_availability(uint16_t addr, bool online)
+{
+    LampLabel label;
+
+    if (mqtt_client == NULL || lamp_by_address(addr, NULL, &label) != ESP_OK) {
         return;
     }
 
-    switch (event) {
-    case ESP_BLE_MESH_LIGHT_CLIENT_GET_STATE_EVT:
-    case ESP_BLE_MESH_LIGHT_CLIENT_SET_STATE_EVT:
-    case ESP_BLE_MESH_LIGHT_CLIENT_PUBLISH_EVT:
-        if (param->params->ctx.recv_op == ESP_BLE_MESH_MODEL_OP_LIGHT_LIGHTNESS_STATUS) {
-            uint16_t sender_addr = param->params->ctx.addr;
-            uint16_t lightness = param->status_cb.lightness_status.present_lightness;
-            ESP_LOGI(TAG, "Lightness status from 0x%04X: %d", sender_addr, lightness);
-            // Here you could update Home Assistant with the actual brightness if needed
-        }
-        // else if (param->params->ctx.recv_op == ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_STATUS) {
-        //     uint16_t sender_addr = param->params->ctx.addr;
-        //     uint16_t h = param->status_cb.hsl_status.hsl_hue;
-        //     uint16_t s = param->status_cb.hsl_status.hsl_saturation;
-        //     uint16_t lightness = param->status_cb.hsl_status.hsl_lightness;
-        //     ESP_LOGI(TAG, "hsl status from 0x%04X: %d %d %d", sender_addr, h,s,lightness);
-        //     // Here you could update Home Assistant with the actual hsl, but light does not appear to send these updates on boot.
-        // }
-        break;
-    default:
-        break;
+    char topic[MQTT_ROUTE_TOPIC_LEN + sizeof("availability")];
+    snprintf(topic, sizeof(topic), MQTT_TOPIC_PREFIX "%s/availability", label.name);
+    mqtt_pub_post(topic, online ? "online" : "offline", 1, true, true);
+}
+
+static void publish_all_availability(void)
+{
+    LampInfo lamps[MAX_LAMPS];
+    int lamp_count = get_all_lamps(lamps, NULL, MAX_LAMPS);
+    for (int i = 0; i < lamp_count; i++) {
+        publish_availability(lamps[i].address, !lamp_health_is_offline(lamps[i].address));
     }
 }
 
@@ -384,298 +279,294 @@ static esp_err_t bluetooth_init(void)
     return ESP_OK;
 }
 
-static void ble_mesh_get_dev_uuid(uint8_t *dev_uuid)
-{
-    if (dev_uuid == NULL) {
-        ESP_LOGE(TAG, "%s, Invalid device uuid", __func__);
-        return;
-    }
-    ESP_ERROR_CHECK(esp_efuse_mac_get_default(dev_uuid));
-}
-
 static esp_err_t ble_mesh_init(void)
 {
-    esp_err_t err;
-    esp_ble_mesh_register_prov_callback(ble_mesh_provisioning_cb);
-    esp_ble_mesh_register_config_server_callback(ble_mesh_config_server_cb);
-    esp_ble_mesh_register_generic_client_callback(ble_mesh_generic_client_cb);
-    esp_ble_mesh_register_light_client_callback(ble_mesh_lighting_client_cb);
+    const mesh_core_config_t config = {
+        .nvs_key = NVS_MESH_INFO_KEY,
+        .net_transmit_count = 2,
+        .net_transmit_interval_ms = 20,
+        .net_transmit_min = CONFIG_MESH_NET_TRANSMIT_MIN,
+        .net_transmit_max = CONFIG_MESH_NET_TRANSMIT_MAX,
+        .ttl_max = CONFIG_MESH_TTL_MAX,
+        .status_group = MESH_STATUS_GROUP,
+        .ack_timeout_ms = ACK_MSG_TIMEOUT_MS,
+        .on_prov_complete = mesh_prov_complete,
+        .on_status = mesh_status_handler,
+        .on_timeout = mesh_timeout_handler,
+        .on_send_failed = mesh_tx_on_send_failed,
+    };
 
-    err = esp_ble_mesh_init(&provision, &composition);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to initialize mesh stack (err %d)", err);
-        return err;
-    }
-    err = esp_ble_mesh_node_prov_enable(ESP_BLE_MESH_PROV_ADV | ESP_BLE_MESH_PROV_GATT);
+    esp_err_t err = mesh_core_init(&config);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to enable mesh node (err %d)", err);
         return err;
     }
-    ESP_LOGI(TAG, "BLE Mesh Node initialized");
     board_led_operation(GPIO_NUM_2, LED_OFF);
     return ESP_OK;
 }
 
-/* --- BLE Mesh Client Send Functions --- */
+/* --- MQTT Functions --- */
 
-void ble_mesh_send_gen_onoff_set(uint8_t onoff, uint16_t addr)
+void refresh_mqtt_routes(void)
 {
-    esp_ble_mesh_client_common_param_t common = {0};
-    esp_ble_mesh_generic_client_set_state_t set = {0};
-    esp_err_t err;
-
-    if (app_state.app_idx == ESP_BLE_MESH_KEY_UNUSED) {
-        ESP_LOGE(TAG, "Cannot send OnOff Set: AppKey has not been bound yet!");
-        return;
-    }
-    ESP_LOGI(TAG, "Sending OnOff Set: onoff=%d, addr=0x%04X, net_idx=0x%04x, app_idx=0x%04x",
-             onoff, addr, app_state.net_idx, app_state.app_idx);
-
-    common.opcode = ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET_UNACK;
-    common.model = onoff_client.model;
-    common.ctx.net_idx = app_state.net_idx;
-    common.ctx.app_idx = app_state.app_idx;
-    common.ctx.addr = addr;
-    common.ctx.send_ttl = 7;
-    common.ctx.send_rel = false;
-    common.msg_timeout = 0;
-    common.msg_role = ROLE_NODE;
+    // Commands arrive through the one wildcard subscription; only the lookup changes
+    mqtt_routes_rebuild();
+}
 
-    set.onoff_set.op_en = false;
-    set.onoff_set.onoff = onoff;
-    set.onoff_set.tid = app_state.tid++;
+/*
+ * A group command carries one raw lightness value for all members, so the
+ * first member's scaling is used. Color (and CTL) is offered if any member
+ * supports it; members without it ignore those messages. The other message
+ * types are only used if every member understands them.
+ */
+void get_group_profile(uint16_t group_addr, uint8_t *caps, int *brightness_scaling)
+{
+    LampInfo lamps[MAX_LAMPS];
+    int lamp_count = get_all_lamps(lamps, NULL, MAX_LAMPS);
+    uint8_t any = 0;
+    uint8_t all = 0xFF;
 
-    err = esp_ble_mesh_generic_client_set_state(&common, &set);
-    if (err) {
-        ESP_LOGE(TAG, "Failed to send OnOff Set message (err %d)", err);
+    *brightness_scaling = 0;
+    for (int i = 0; i < lamp_count; i++) {
+        if (!lamp_in_group(&lamps[i], group_addr)) {
+            continue;
+        }
+        any |= lamps[i].caps;
+        all &= lamps[i].caps;
+        if (*brightness_scaling == 0) {
+            *brightness_scaling = lamps[i].brightness_scaling;
+        } else if (*brightness_scaling != lamps[i].brightness_scaling) {
+            ESP_LOGW(TAG, "Group 0x%04X mixes brightness scalings (%d, %d)",
+                     group_addr, *brightness_scaling, lamps[i].brightness_scaling);
+        }
+    }
+    if (*brightness_scaling == 0) {
+        *brightness_scaling = 100;
     }
+    *caps = any ? (all & LAMP_CAPS_DIMMABLE) | (any & (LAMP_CAP_HSL | LAMP_CAP_CTL)) : LAMP_CAPS_DIMMABLE;
 }
 
-void ble_mesh_send_lightness_set(uint16_t lightness, uint16_t addr)
+void publish_ha_discovery_messages(void)
 {
-    esp_ble_mesh_client_common_param_t common = {0};
-    esp_ble_mesh_light_client_set_state_t set = {0};
-    esp_err_t err;
+    discovery_request(mqtt_client, false);
+}
 
-    if (app_state.app_idx == ESP_BLE_MESH_KEY_UNUSED) {
-        ESP_LOGE(TAG, "Cannot send Lightness Set: AppKey has not been bound yet!");
+/**
+ * @brief Publishes the state of a command target that will not report it.
+ *
+ * Lamps that answer Sets or publish their status get their state topic
+ * updated when the status arrives; only the rest is published from the
+ * command. A lamp that missed a reply since is treated as silent again.
+ * A group never reports, and its members are handled one by one.
+ *
+ * @param name Name of the lamp or group the command was sent to.
+ * @param addr Address the command was sent to.
+ * @param group_addr Group address, or ESP_BLE_MESH_ADDR_UNASSIGNED for a single lamp.
+ */
+static void publish_command_state(const char *name, uint16_t addr, uint16_t group_addr)
+{
+    lamp_state_t st;
+
+    lamp_state_get(addr, &st);
+    if (!st.reports) {
+        publish_state(name, addr);
+    }
+    if (group_addr == ESP_BLE_MESH_ADDR_UNASSIGNED) {
         return;
     }
 
-    ESP_LOGI(TAG, "Sending Lightness Set: lightness=%d, addr=0x%04X, net_idx=0x%04x, app_idx=0x%04x",
-             lightness, addr, app_state.net_idx, app_state.app_idx);
-
-    common.opcode = ESP_BLE_MESH_MODEL_OP_LIGHT_LIGHTNESS_SET_UNACK;
-    common.model = light_client.model;
-    common.ctx.net_idx = app_state.net_idx;
-    common.ctx.app_idx = app_state.app_idx;
-    common.ctx.addr = addr;
-    common.ctx.send_ttl = 7;
-    common.ctx.send_rel = false;
-    common.msg_timeout = 0;
-    common.msg_role = ROLE_NODE;
-
-    set.lightness_set.op_en = false;
-    set.lightness_set.lightness = lightness;
-    set.lightness_set.tid = app_state.tid++;
-
-    err = esp_ble_mesh_light_client_set_state(&common, &set);
-    if (err) {
-        ESP_LOGE(TAG, "Failed to send Lightness Set message (err %d)", err);
+    LampInfo lamps[MAX_LAMPS];
+    int lamp_count = get_all_lamps(lamps, NULL, MAX_LAMPS);
+    for (int i = 0; i < lamp_count; i++) {
+        if (!lamp_in_group(&lamps[i], group_addr)) {
+            continue;
+        }
+        uint16_t member = lamps[i].address;
+        LampLabel label;
+        lamp_state_get(member, &st);
+        if (!st.reports && lamp_by_address(member, NULL, &label) == ESP_OK) {
+            publish_state(label.name, member);
+        }
     }
 }
 
-void ble_mesh_send_hsl_set(uint16_t hue, uint16_t saturation, uint16_t addr)
+/**
+ * @brief Publishes the outcome of an acknowledged command to
+ *        homeassistant/light/<name>/delivery.
+ */
+static void mesh_tx_result_handler(uint16_t addr, mesh_msg_type_t type, bool delivered, uint8_t attempts,
+                                   bool no_reply)
 {
-    esp_ble_mesh_client_common_param_t common = {0};
-    esp_ble_mesh_light_client_set_state_t set = {0};
-    esp_err_t err;
+    const mesh_codec_desc_t *desc = mesh_codec_desc(type);
+    LampLabel label;
 
-    if (app_state.app_idx == ESP_BLE_MESH_KEY_UNUSED) {
-        ESP_LOGE(TAG, "Cannot send hsl Set: AppKey has not been bound yet!");
+    if (no_reply) {
+        // One miss per command, however often it was retried. Attempts the
+        // stack could not send are not the lamp's fault.
+        lamp_health_on_miss(addr);
+    }
+    if (mqtt_client == NULL || lamp_by_address(addr, NULL, &label) != ESP_OK) {
         return;
     }
 
-    ESP_LOGI(TAG, "Sending hsl Set: hue=%d, sat=%d, addr=0x%04X, net_idx=0x%04x, app_idx=0x%04x",
-             hue, saturation, addr, app_state.net_idx, app_state.app_idx);
-
-    common.opcode = ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET_UNACK;
-    common.model = light_client.model;
-    common.ctx.net_idx = app_state.net_idx;
-    common.ctx.app_idx = app_state.app_idx;
-    common.ctx.addr = addr;
-    common.ctx.send_ttl = 7;
-    common.ctx.send_rel = false;
-    common.msg_timeout = 0;
-    common.msg_role = ROLE_NODE;
-
-    set.hsl_set.op_en = false;
-    set.hsl_set.hsl_lightness = 70;
-    set.hsl_set.hsl_hue = hue;
-    set.hsl_set.hsl_saturation = saturation;
-    set.hsl_set.tid = app_state.tid++;
-
-    err = esp_ble_mesh_light_client_set_state(&common, &set);
-    if (err) {
-        ESP_LOGE(TAG, "Failed to send hsl Set message (err %d)", err);
-    }
+    char topic[sizeof(MQTT_TOPIC_PREFIX) + MAX_LAMP_NAME_LEN + sizeof("/delivery")];
+    char payload[96];
+    snprintf(topic, sizeof(topic), MQTT_TOPIC_PREFIX "%s/delivery", label.name);
+    snprintf(payload, sizeof(payload), "{\"command\":\"%s\",\"result\":\"%s\",\"attempts\":%d}",
+             desc ? desc->name : "unknown",
+             delivered ? "delivered" : "failed", attempts);
+    // Called from the TX task, which must not wait on the network
+    mqtt_pub_post(topic, payload, 0, false, false);
 }
 
-/* --- MQTT Functions --- */
-
-void refresh_mqtt_subscriptions(void)
+/**
+ * @brief Records the state a command puts its target in. A group message
+ *        changes every member, so member lamps are updated too.
+ */
+static void record_command_state(const mesh_msg_t *msg, uint16_t group_addr)
 {
-    if (mqtt_client == NULL) {
-        ESP_LOGE(TAG, "Cannot refresh subscriptions, MQTT client not initialized.");
+    lamp_state_apply_msg(msg);
+    if (group_addr == ESP_BLE_MESH_ADDR_UNASSIGNED) {
         return;
     }
-    ESP_LOGI(TAG, "Refreshing MQTT subscriptions...");
-
-    int lamp_count = 0;
-    const LampInfo* lamps = get_all_lamps(&lamp_count);
 
+    LampInfo lamps[MAX_LAMPS];
+    int lamp_count = get_all_lamps(lamps, NULL, MAX_LAMPS);
     for (int i = 0; i < lamp_count; i++) {
-        char topic[256];
-        snprintf(topic, sizeof(topic), "homeassistant/light/%s/set", lamps[i].name);
-        esp_mqtt_client_subscribe(mqtt_client, topic, 0);
-        ESP_LOGI(TAG, "Subscribed to %s", topic);
+        if (lamp_in_group(&lamps[i], group_addr)) {
+            mesh_msg_t member = *msg;
+            member.addr = lamps[i].address;
+            lamp_state_apply_msg(&member);
+        }
     }
 }
 
-static char *create_ha_discovery_payload(const LampInfo *lamp, const char *base_topic)
+static void handle_lamp_command(const mqtt_route_t *route, const char *payload, int payload_len)
 {
-    cJSON *root = cJSON_CreateObject();
-    if (root == NULL) {
-        ESP_LOGE(TAG, "Failed to create cJSON root object");
-        return NULL;
-    }
-
-    cJSON_AddNullToObject(root, "name");
-
-    cJSON_AddStringToObject(root, "~", base_topic);
-    cJSON_AddStringToObject(root, "cmd_t", "~/set");
-    cJSON_AddStringToObject(root, "stat_t", "~/state");
-    cJSON_AddStringToObject(root, "schema", "json");
-    cJSON_AddTrueToObject(root, "brightness");
-    // Use the lamp's specific brightness scaling
-    cJSON_AddNumberToObject(root, "bri_scl", lamp->brightness_scaling);
-
-    // Conditionally add color support
-    if (lamp->supports_color) {
-        cJSON_AddStringToObject(root,"sup_clrm","hs");
-    }
-    cJSON_AddStringToObject(root, "uniq_id", lamp->address);
-
-    cJSON *dev = cJSON_CreateObject();
-    cJSON_AddStringToObject(dev, "name", lamp->name);
-    cJSON_AddStringToObject(dev, "identifiers", lamp->address);
-    cJSON_AddStringToObject(dev, "manufacturer", "Espressif");
-    cJSON_AddStringToObject(dev, "model", "BLE Mesh Lamp");
-    cJSON_AddItemToObject(root, "dev", dev);
-
-    char *payload_str = cJSON_PrintUnformatted(root);
-    cJSON_Delete(root);
-    return payload_str;
-}
-
-void publish_ha_discovery_messages(void)
-{
-    ESP_LOGI(TAG, "Publishing Home Assistant discovery messages...");
-    int lamp_count = 0;
-    const LampInfo* lamps = get_all_lamps(&lamp_count);
-
-    for (int i = 0; i < lamp_count; i++) {
-        char base_topic[256];
-        char config_topic[256];
-        snprintf(base_topic, sizeof(base_topic), "homeassistant/light/%s", lamps[i].name);
-        snprintf(config_topic, sizeof(config_topic), "homeassistant/light/%s/config", lamps[i].name);
-
-        char *payload = create_ha_discovery_payload(&lamps[i], base_topic);
-        if (payload) {
-            ESP_LOGI(TAG, "Publishing to %s", config_topic);
-            esp_mqtt_client_publish(mqtt_client, config_topic, payload, 0, 1, true);
-            free(payload);
+    const char *lamp_name = route->name;
+
+    // Commands addressed to a group go out as a single message to the group
+    // address instead of one message per member lamp.
+    uint16_t addr = route->addr;
+    uint16_t group_addr = ESP_BLE_MESH_ADDR_UNASSIGNED;
+    uint16_t fallback_lightness;
+    uint8_t caps;
+    bool ack = false; // Groups are always unacknowledged; every member would reply
+    bool offline = false;
+    if (route->group) {
+        int brightness_scaling;
+        group_addr = route->addr;
+        get_group_profile(group_addr, &caps, &brightness_scaling);
+        fallback_lightness = (uint16_t)brightness_scaling;
+    } else {
+        LampInfo lamp;
+        if (lamp_by_address(addr, &lamp, NULL) != ESP_OK) {
+            ESP_LOGW(TAG, "Received command for unknown lamp: %s", lamp_name);
+            return;
         }
+        ack = lamp.acknowledged;
+        caps = lamp.caps;
+        offline = lamp_health_is_offline(addr);
+        fallback_lightness = lamp.brightness_scaling;
     }
-}
 
-static void handle_lamp_command(esp_mqtt_event_handle_t event)
-{
-    char lamp_name[32] = {0};
-    sscanf(event->topic, "homeassistant/light/%31[^/]/set", lamp_name);
+    ESP_LOGI(TAG, "Command for %s '%s' (addr 0x%04X)",
+             group_addr != ESP_BLE_MESH_ADDR_UNASSIGNED ? "group" : "lamp", lamp_name, addr);
 
-    if (strlen(lamp_name) == 0) {
-        ESP_LOGW(TAG, "Could not parse lamp name from topic: %.*s", event->topic_len, event->topic);
+    cmd_request_t req;
+    if (!cmd_parse(payload, payload_len, &req)) {
+        ESP_LOGE(TAG, "Failed to parse command JSON");
         return;
     }
+    if (req.has_color_temp) {
+        ESP_LOGD(TAG, "Ignoring color_temp for '%s', CTL is not supported", lamp_name);
+    }
 
-    LampInfo lamp_info;
-    if (find_lamp_by_name(lamp_name, &lamp_info) != ESP_OK) {
-        ESP_LOGW(TAG, "Received command for unknown lamp: %s", lamp_name);
+    // Fold the command into one mesh message, using the last known state for
+    // whatever the command leaves out (e.g. the lightness of an HSL Set).
+    lamp_state_t last;
+    mesh_msg_t msg;
+    lamp_state_get(addr, &last);
+    if (!cmd_plan(&req, caps, &last, fallback_lightness, &msg)) {
+        ESP_LOGW(TAG, "Command for '%s' has nothing to send", lamp_name);
+        return;
+    }
+    msg.addr = addr;
+    msg.ack = ack;
+    if (offline) {
+        // Sent once behind everything else in case the lamp is back. Its state
+        // is left alone: lamp_health notices when it answers again, and the
+        // reply brings the real state.
+        ESP_LOGI(TAG, "Lamp '%s' is offline, sending without retries", lamp_name);
+        msg.ack = false;
+        mesh_tx_submit_prio(&msg, MESH_TX_PRIO_BACKGROUND);
         return;
     }
 
-    uint16_t addr = (uint16_t)strtol(lamp_info.address, NULL, 0);
-    ESP_LOGI(TAG, "Command for lamp '%s' (addr 0x%04X)", lamp_name, addr);
-
-    cJSON *json = cJSON_ParseWithLength(event->data, event->data_len);
-    if (json == NULL) {
-        ESP_LOGE(TAG, "Failed to parse command JSON");
+    // On/off goes ahead of slider traffic even when planned as a Lightness or HSL Set
+    esp_err_t err = mesh_tx_submit_prio(&msg, req.has_state ? MESH_TX_PRIO_STATE : MESH_TX_PRIO_INTERACTIVE);
+    if (err != ESP_OK) {
+        // Shed or refused: the lamp never gets it, so HA keeps the last state
+        ESP_LOGW(TAG, "Command for '%s' not sent (%s)", lamp_name, esp_err_to_name(err));
         return;
     }
-    // else
-    // {
-    //     ESP_LOG(TAG, "Got json: %s",cJSON_Print(json));
-    // }
-
-    char state_topic[256];
-    snprintf(state_topic, sizeof(state_topic), "homeassistant/light/%s/state", lamp_name);
-    char state_payload[128];
-
-    const cJSON *brightness = cJSON_GetObjectItemCaseSensitive(json, "brightness");
-    const cJSON *state = cJSON_GetObjectItemCaseSensitive(json, "state");
-    const cJSON *temp = cJSON_GetObjectItemCaseSensitive(json, "color");
-    const cJSON *hue = cJSON_GetObjectItemCaseSensitive(temp, "h");
-    const cJSON *sat = cJSON_GetObjectItemCaseSensitive(temp, "s");
-
-    // Prioritize brightness command, as it implies the light should be on.
-    if(cJSON_IsNumber(hue) && cJSON_IsNumber(sat))
-    {
-        int huenum = hue->valueint;
-        int satnum = sat->valueint;
-        uint16_t hue16 = (uint16_t)huenum;
-        uint16_t sat16 = (uint16_t)satnum;
-        ble_mesh_send_hsl_set(hue16,sat16,addr);
-        snprintf(state_payload, sizeof(state_payload), "{\"state\":\"ON\", \"color\":{\"h\":%d,\"s\"%d}:}", hue16,sat16);
-        esp_mqtt_client_publish(mqtt_client, state_topic, state_payload, 0, 0, false);
-
-    }
-    if (cJSON_IsNumber(brightness)) {
-        int bri_ha = brightness->valueint; // HA brightness 0-255
-        
-        // It's likely the lamp expects a 0-255 value, not the standard 0-65535.
-        // We will send the value from Home Assistant directly.
-        uint16_t lightness = (uint16_t)bri_ha;
-        
-        ble_mesh_send_lightness_set(lightness, addr);
-        
-        snprintf(state_payload, sizeof(state_payload), "{\"state\":\"ON\", \"brightness\":%d}", bri_ha);
-        esp_mqtt_client_publish(mqtt_client, state_topic, state_payload, 0, 0, false);
-    } 
-    // If no brightness command, check for a state command.
-    else if (cJSON_IsString(state) && (state->valuestring != NULL)) {
-        if (strcmp(state->valuestring, "ON") == 0) {
-            ble_mesh_send_gen_onoff_set(1, addr);
-            snprintf(state_payload, sizeof(state_payload), "{\"state\":\"ON\"}");
-            esp_mqtt_client_publish(mqtt_client, state_topic, state_payload, 0, 0, false);
-        } else if (strcmp(state->valuestring, "OFF") == 0) {
-            ble_mesh_send_gen_onoff_set(0, addr);
-            snprintf(state_payload, sizeof(state_payload), "{\"state\":\"OFF\"}");
-            esp_mqtt_client_publish(mqtt_client, state_topic, state_payload, 0, 0, false);
+    record_command_state(&msg, group_addr);
+    publish_command_state(lamp_name, addr, group_addr);
+}
+
+/**
+ * @brief Dispatches an MQTT_EVENT_DATA event.
+ *
+ * A payload larger than the client's buffer arrives in several events, and
+ * only the first one carries the topic. Commands that come in one piece are
+ * parsed in place; fragmented ones are collected in a fixed buffer first.
+ */
+static void handle_mqtt_data(esp_mqtt_event_handle_t event)
+{
+    if (event->current_data_offset == 0) {
+        cmd_frag_begin(&s_cmd_frag, 0);
+
+        if (event->topic_len == strlen(HA_STATUS_TOPIC) &&
+            memcmp(event->topic, HA_STATUS_TOPIC, event->topic_len) == 0) {
+            if (event->data_len == strlen("online") && memcmp(event->data, "online", event->data_len) == 0) {
+                // HA restarted: resend every config, paced by discovery
+                discovery_request(mqtt_client, true);
+            }
+            return;
+        }
+
+        mqtt_route_t route;
+        if (!mqtt_routes_by_topic(event->topic, event->topic_len, &route)) {
+            return;
+        }
+        if (event->data_len == event->total_data_len) {
+            handle_lamp_command(&route, event->data, event->data_len);
+            return;
+        }
+        if (!cmd_frag_begin(&s_cmd_frag, event->total_data_len)) {
+            ESP_LOGW(TAG, "Command for '%s' too long (%d bytes), ignored", route.name, event->total_data_len);
+            return;
         }
+        strncpy(s_cmd_frag_name, route.name, sizeof(s_cmd_frag_name) - 1);
     }
 
-    cJSON_Delete(json);
+    if (!cmd_frag_active(&s_cmd_frag)) {
+        return;
+    }
+    switch (cmd_frag_add(&s_cmd_frag, event->current_data_offset, event->data, event->data_len)) {
+    case CMD_FRAG_MORE:
+        return;
+    case CMD_FRAG_DROPPED:
+        ESP_LOGW(TAG, "Fragmented command for '%s' out of order, ignored", s_cmd_frag_name);
+        return;
+    case CMD_FRAG_DONE:
+        break;
+    }
+
+    // Looked up again, the routes may have been rebuilt in between
+    mqtt_route_t route;
+    if (mqtt_routes_by_name(s_cmd_frag_name, &route)) {
+        handle_lamp_command(&route, s_cmd_frag.data, s_cmd_frag.len);
+    }
 }
 
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
@@ -686,21 +577,22 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     switch ((esp_mqtt_event_id_t)event_id) {
     case MQTT_EVENT_CONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-        esp_mqtt_client_subscribe(mqtt_client, "homeassistant/status", 0);
-        refresh_mqtt_subscriptions();
+        mqtt_pub_set_client(mqtt_client);
+        esp_mqtt_client_subscribe(mqtt_client, HA_STATUS_TOPIC, 0);
+        // One SUBSCRIBE for all lamps and groups; mqtt_routes drops foreign topics
+        esp_mqtt_client_subscribe(mqtt_client, MQTT_ROUTE_CMD_FILTER, 0);
+        publish_all_availability();
+        // Republish what is known, then read what is not (or is stale)
+        state_pub_reset();
+        publish_cached_states();
+        resync_start();
         break;
     case MQTT_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
         break;
     case MQTT_EVENT_DATA:
         ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-        if (strncmp(event->topic, "homeassistant/status", event->topic_len) == 0 &&
-            strncmp(event->data, "online", event->data_len) == 0) {
-            publish_ha_discovery_messages();
-        }
-        else if (strstr(event->topic, "/set") != NULL) {
-            handle_lamp_command(event);
-        }
+        handle_mqtt_data(event);
         break;
     case MQTT_EVENT_ERROR:
         ESP_LOGE(TAG, "MQTT_EVENT_ERROR");
@@ -751,6 +643,8 @@ static void mqtt_app_start(void)
         .broker.address.uri = s_mqtt_url,
         .credentials.username = s_mqtt_user,
         .credentials.authentication.password = s_mqtt_pass,
+        // Commands beyond it are reassembled, up to CMD_PARSE_MAX_LEN
+        .buffer.size = CMD_MQTT_BUFFER_SIZE,
     };
     esp_mqtt_client_handle_t client = esp_mqtt_client_init(&mqtt_cfg);
     esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
@@ -776,6 +670,9 @@ void app_main(void)
 
     // Initialize the lamp storage system from NVS
     lamp_nvs_init();
+    mqtt_routes_rebuild();
+    // Last known states, published as soon as MQTT connects
+    lamp_state_init();
 
     // --- WI-FI SETUP ---
     // Try to connect. If it fails, it will start the AP and return ESP_FAIL.
@@ -794,18 +691,49 @@ void app_main(void)
         return;
     }
 
-    err = ble_mesh_nvs_open(&NVS_HANDLE);
+    err = ble_mesh_init();
+    if (err) {
+        ESP_LOGE(TAG, "ble_mesh_init failed (err %d)", err);
+        return;
+    }
+
+    // Outbound mesh commands are queued and sent from a dedicated task
+    err = mesh_tx_init();
     if (err) {
-        ESP_LOGE(TAG, "ble_mesh_nvs_open failed (err %d)", err);
+        ESP_LOGE(TAG, "mesh_tx_init failed (err %d)", err);
         return;
     }
+    mesh_tx_set_result_cb(mesh_tx_result_handler);
 
-    ble_mesh_get_dev_uuid(dev_uuid);
+    err = mqtt_pub_init();
+    if (err) {
+        ESP_LOGE(TAG, "mqtt_pub_init failed (err %d)", err);
+    }
+    mqtt_pub_set_drop_cb(mqtt_pub_dropped_handler);
 
-    err = ble_mesh_init();
+    err = state_pub_init(mqtt_send_state);
     if (err) {
-        ESP_LOGE(TAG, "ble_mesh_init failed (err %d)", err);
-        return;
+        ESP_LOGE(TAG, "state_pub_init failed (err %d)", err);
+    }
+
+    err = discovery_init();
+    if (err) {
+        ESP_LOGE(TAG, "discovery_init failed (err %d)", err);
+    }
+
+    err = resync_init();
+    if (err) {
+        ESP_LOGE(TAG, "resync_init failed (err %d)", err);
+    }
+
+    err = lamp_health_init(publish_availability);
+    if (err) {
+        ESP_LOGE(TAG, "lamp_health_init failed (err %d)", err);
+    }
+
+    err = probe_init();
+    if (err) {
+        ESP_LOGE(TAG, "probe_init failed (err %d)", err);
     }
 
     // Start MQTT client
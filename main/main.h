@@ -1,14 +1,27 @@
 #ifndef MAIN_H
 #define MAIN_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 /**
- * @brief Subscribes/re-subscribes to the command topics for all configured lamps.
+ * @brief Rebuilds the MQTT routes after the lamp or group list changed.
  */
-void refresh_mqtt_subscriptions(void);
+void refresh_mqtt_routes(void);
 
 /**
- * @brief Publishes Home Assistant discovery messages for all configured lamps.
+ * @brief Publishes the Home Assistant discovery configs that changed and
+ *        clears those of removed lamps and groups (see discovery_request()).
  */
 void publish_ha_discovery_messages(void);
 
+/**
+ * @brief Derives the HA capabilities of a group from its member lamps.
+ *
+ * @param group_addr Group address, or ALL_LAMPS_GROUP_ADDR.
+ * @param[out] caps LAMP_CAP_* bits offered for the group.
+ * @param[out] brightness_scaling Brightness scale of the group's first member.
+ */
+void get_group_profile(uint16_t group_addr, uint8_t *caps, int *brightness_scaling);
+
 #endif /* MAIN_H */
\ No newline at end of file
@@ -0,0 +1,620 @@
+/*
+ * mesh_tx.c - Coalescing outbound mesh command queue
+ *
+ * Commands are stored in a small table with one slot per (destination, type).
+ * A newer command for an occupied slot overwrites the queued value, so a slider
+ * drag only puts the most recent value on air. A dedicated task drains the
+ * table and paces the sends to keep the advertising bearer free.
+ *
+ * Every command has a priority class and a deadline. The task sends the best
+ * class first, oldest first within a class, and drops commands whose deadline
+ * has passed instead of putting stale values on air. Under memory pressure or
+ * when the mesh stack runs out of advertising buffers, new low-priority work
+ * is refused at submission so on/off changes still get through.
+ *
+ * Commands for lamps in acknowledged mode use the *_SET opcodes. They are
+ * tracked in a bounded in-flight window until the lamp's status arrives, and
+ * are retried with exponential backoff when the mesh stack reports a timeout.
+ */
+
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_system.h"
+
+#include "mesh_core.h"
+#include "mesh_tx.h"
+
+#define TAG "MESH_TX"
+
+#define MESH_TX_QUEUE_LEN    CONFIG_MESH_TX_QUEUE_LEN
+#define MESH_TX_INTERVAL_MS  CONFIG_MESH_TX_INTERVAL_MS
+#define MESH_TX_TASK_STACK   4096
+#define MESH_TX_TASK_PRIO    5
+
+#define ACK_WINDOW           CONFIG_MESH_TX_ACK_WINDOW
+#define ACK_TIMEOUT_MS       CONFIG_MESH_TX_ACK_TIMEOUT_MS
+#define ACK_MAX_ATTEMPTS     (CONFIG_MESH_TX_ACK_RETRIES + 1)
+#define ACK_BACKOFF_MS       CONFIG_MESH_TX_ACK_BACKOFF_MS
+// Safety margin on top of the stack's own timeout in case its event is lost
+#define ACK_GRACE_MS         1000
+
+#define SHED_FREE_HEAP       CONFIG_MESH_TX_SHED_FREE_HEAP
+// How long a buffer shortage in the mesh stack counts as congestion
+#define CONGESTION_HOLD_MS   2000
+// Shortages within the hold time after which interactive work is shed as well
+#define CONGESTION_SEVERE    3
+
+static const uint32_t s_deadline_ms[MESH_TX_PRIO_COUNT] = {
+    [MESH_TX_PRIO_STATE] = CONFIG_MESH_TX_DEADLINE_STATE_MS,
+    [MESH_TX_PRIO_INTERACTIVE] = CONFIG_MESH_TX_DEADLINE_INTERACTIVE_MS,
+    [MESH_TX_PRIO_BACKGROUND] = CONFIG_MESH_TX_DEADLINE_BACKGROUND_MS,
+};
+
+typedef struct {
+    bool pending;
+    uint8_t prio;       // mesh_tx_prio_t
+    uint32_t seq;       // Queue position; lower is older
+    TickType_t deadline;
+    mesh_tx_cmd_t cmd;
+} tx_slot_t;
+
+typedef enum {
+    INFLIGHT_FREE = 0,
+    INFLIGHT_WAITING,   // Sent, waiting for status or timeout
+    INFLIGHT_ACKED,     // Status received, result not reported yet
+    INFLIGHT_TIMED_OUT, // Timed out or failed to send, retry not scheduled yet
+    INFLIGHT_BACKOFF,   // Waiting to be retransmitted
+} inflight_state_t;
+
+typedef struct {
+    inflight_state_t state;
+    uint8_t attempts;
+    TickType_t due;     // Reply timeout (WAITING) or retry time (BACKOFF)
+    TickType_t deadline; // No retries past this point
+    bool no_reply;      // An attempt went out and got no status
+    mesh_tx_cmd_t cmd;
+} inflight_t;
+
+typedef struct {
+    uint16_t addr;
+    mesh_msg_type_t type;
+    bool delivered;
+    uint8_t attempts;
+    bool no_reply;
+} tx_result_t;
+
+static tx_slot_t s_slots[MESH_TX_QUEUE_LEN];
+static inflight_t s_inflight[ACK_WINDOW];
+static uint32_t s_next_seq = 0;
+static uint32_t s_coalesced = 0;
+static uint32_t s_expired[MESH_TX_PRIO_COUNT];
+static uint32_t s_shed[MESH_TX_PRIO_COUNT];
+static uint8_t s_congestion = 0;        // Recent buffer shortages
+static TickType_t s_congested_until = 0;
+static SemaphoreHandle_t s_lock = NULL;
+static TaskHandle_t s_task = NULL;
+static mesh_tx_result_cb_t s_result_cb = NULL;
+
+// Wrap-safe "a is older than b" for sequence numbers.
+static inline bool seq_before(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b) < 0;
+}
+
+// Wrap-safe "tick t has been reached".
+static inline bool tick_reached(TickType_t now, TickType_t t)
+{
+    return (int32_t)(now - t) >= 0;
+}
+
+/* --- In-flight window (call with s_lock held) --- */
+
+static inflight_t *inflight_find(uint16_t addr)
+{
+    for (int i = 0; i < ACK_WINDOW; i++) {
+        if (s_inflight[i].state != INFLIGHT_FREE && s_inflight[i].cmd.addr == addr) {
+            return &s_inflight[i];
+        }
+    }
+    return NULL;
+}
+
+static inflight_t *inflight_alloc(void)
+{
+    for (int i = 0; i < ACK_WINDOW; i++) {
+        if (s_inflight[i].state == INFLIGHT_FREE) {
+            return &s_inflight[i];
+        }
+    }
+    return NULL;
+}
+
+static bool slot_pending_for(uint16_t addr, mesh_msg_type_t type)
+{
+    for (int i = 0; i < MESH_TX_QUEUE_LEN; i++) {
+        if (s_slots[i].pending && !s_slots[i].cmd.get && s_slots[i].cmd.addr == addr &&
+            s_slots[i].cmd.type == type) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static TickType_t backoff_ticks(uint8_t attempts)
+{
+    uint32_t ms = ACK_BACKOFF_MS << (attempts - 1);
+    // Jitter keeps retries to several lamps from lining up again
+    ms += esp_random() % (ACK_BACKOFF_MS / 2 + 1);
+    return pdMS_TO_TICKS(ms);
+}
+
+/**
+ * @brief Advances the in-flight entries: collects finished ones and schedules
+ *        retries for timed-out ones.
+ *
+ * @param[out] results Finished commands to report once the lock is released.
+ * @return Number of entries written to @p results.
+ */
+static int inflight_process(TickType_t now, tx_result_t *results)
+{
+    int n = 0;
+
+    for (int i = 0; i < ACK_WINDOW; i++) {
+        inflight_t *e = &s_inflight[i];
+
+        if (e->state == INFLIGHT_WAITING && tick_reached(now, e->due)) {
+            e->state = INFLIGHT_TIMED_OUT;
+            e->no_reply = true;
+        }
+        if (e->state == INFLIGHT_BACKOFF && slot_pending_for(e->cmd.addr, e->cmd.type)) {
+            e->state = INFLIGHT_FREE;
+            continue;
+        }
+        if (e->state == INFLIGHT_BACKOFF && tick_reached(now, e->deadline)) {
+            results[n++] = (tx_result_t){ e->cmd.addr, e->cmd.type, false, e->attempts, e->no_reply };
+            e->state = INFLIGHT_FREE;
+            continue;
+        }
+
+        if (e->state == INFLIGHT_ACKED) {
+            results[n++] = (tx_result_t){ e->cmd.addr, e->cmd.type, true, e->attempts, false };
+            e->state = INFLIGHT_FREE;
+        } else if (e->state == INFLIGHT_TIMED_OUT) {
+            if (slot_pending_for(e->cmd.addr, e->cmd.type)) {
+                // A newer value is queued; retrying the old one is wasted airtime.
+                e->state = INFLIGHT_FREE;
+            } else if (e->attempts < ACK_MAX_ATTEMPTS && !tick_reached(now, e->deadline)) {
+                e->state = INFLIGHT_BACKOFF;
+                e->due = now + backoff_ticks(e->attempts);
+            } else {
+                results[n++] = (tx_result_t){ e->cmd.addr, e->cmd.type, false, e->attempts, e->no_reply };
+                e->state = INFLIGHT_FREE;
+            }
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief Ticks until the next in-flight deadline or retry, portMAX_DELAY if none.
+ */
+static TickType_t inflight_next_wakeup(TickType_t now)
+{
+    TickType_t wait = portMAX_DELAY;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < ACK_WINDOW; i++) {
+        if (s_inflight[i].state == INFLIGHT_WAITING || s_inflight[i].state == INFLIGHT_BACKOFF) {
+            TickType_t left = tick_reached(now, s_inflight[i].due) ? 0 : s_inflight[i].due - now;
+            if (left < wait) {
+                wait = left;
+            }
+        }
+    }
+    xSemaphoreGive(s_lock);
+
+    return wait;
+}
+
+/**
+ * @brief Drops queued commands whose deadline has passed (call with s_lock held).
+ *
+ * @return Number of commands dropped.
+ */
+static int slots_expire(TickType_t now)
+{
+    int n = 0;
+
+    for (int i = 0; i < MESH_TX_QUEUE_LEN; i++) {
+        if (s_slots[i].pending && tick_reached(now, s_slots[i].deadline)) {
+            s_slots[i].pending = false;
+            s_expired[s_slots[i].prio]++;
+            n++;
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief Finds the queued command to send next (call with s_lock held).
+ *
+ * Commands to one destination keep the order they were queued in, so only the
+ * oldest per destination is a candidate. It competes with the best class
+ * waiting for that destination: an OFF queued behind a brightness update lifts
+ * the update rather than overtaking it and being undone by it.
+ *
+ * @return Slot index, or -1 if nothing can be sent now.
+ */
+static int slots_pick(void)
+{
+    bool window_full = inflight_alloc() == NULL;
+    int best = -1;
+    uint8_t best_prio = MESH_TX_PRIO_COUNT;
+
+    for (int i = 0; i < MESH_TX_QUEUE_LEN; i++) {
+        if (!s_slots[i].pending) {
+            continue;
+        }
+        // The stack allows one outstanding acknowledged message per destination
+        if (s_slots[i].cmd.ack && (window_full || inflight_find(s_slots[i].cmd.addr) != NULL)) {
+            continue;
+        }
+        // Gets need a reply as well, but their replies are tracked by the caller
+        if (s_slots[i].cmd.get && inflight_find(s_slots[i].cmd.addr) != NULL) {
+            continue;
+        }
+
+        bool head = true;
+        uint8_t prio = s_slots[i].prio;
+        for (int j = 0; j < MESH_TX_QUEUE_LEN && head; j++) {
+            if (j == i || !s_slots[j].pending || s_slots[j].cmd.addr != s_slots[i].cmd.addr) {
+                continue;
+            }
+            if (seq_before(s_slots[j].seq, s_slots[i].seq)) {
+                head = false;
+            } else if (s_slots[j].prio < prio) {
+                prio = s_slots[j].prio;
+            }
+        }
+        if (!head) {
+            continue;
+        }
+
+        if (best < 0 || prio < best_prio ||
+            (prio == best_prio && seq_before(s_slots[i].seq, s_slots[best].seq))) {
+            best = i;
+            best_prio = prio;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Picks the next command to transmit: a due retry first, otherwise the
+ *        best queued command that the in-flight window has room for.
+ *
+ * @return true if a command was copied to @p out.
+ */
+static bool tx_take_next(mesh_tx_cmd_t *out)
+{
+    TickType_t now = xTaskGetTickCount();
+    tx_result_t results[ACK_WINDOW];
+    int n_results;
+    int n_expired;
+    bool found = false;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    n_results = inflight_process(now, results);
+    n_expired = slots_expire(now);
+
+    for (int i = 0; i < ACK_WINDOW && !found; i++) {
+        inflight_t *e = &s_inflight[i];
+        if (e->state == INFLIGHT_BACKOFF && tick_reached(now, e->due)) {
+            e->state = INFLIGHT_WAITING;
+            e->attempts++;
+            e->due = now + pdMS_TO_TICKS(ACK_TIMEOUT_MS + ACK_GRACE_MS);
+            *out = e->cmd;
+            found = true;
+            ESP_LOGI(TAG, "Retrying command for 0x%04X (attempt %d)", e->cmd.addr, e->attempts);
+        }
+    }
+
+    if (!found) {
+        int next = slots_pick();
+        if (next >= 0) {
+            *out = s_slots[next].cmd;
+            s_slots[next].pending = false;
+            found = true;
+
+            if (out->ack && !out->get) {
+                inflight_t *e = inflight_alloc();
+                e->state = INFLIGHT_WAITING;
+                e->attempts = 1;
+                e->due = now + pdMS_TO_TICKS(ACK_TIMEOUT_MS + ACK_GRACE_MS);
+                e->deadline = s_slots[next].deadline;
+                e->no_reply = false;
+                e->cmd = *out;
+            }
+        }
+    }
+    xSemaphoreGive(s_lock);
+
+    if (n_expired > 0) {
+        ESP_LOGW(TAG, "Dropped %d commands past their deadline", n_expired);
+    }
+    for (int i = 0; i < n_results; i++) {
+        if (!results[i].delivered) {
+            ESP_LOGW(TAG, "%s 0x%04X after %d attempts",
+                     results[i].no_reply ? "No status from" : "Could not send to",
+                     results[i].addr, results[i].attempts);
+        }
+        if (s_result_cb) {
+            s_result_cb(results[i].addr, results[i].type, results[i].delivered, results[i].attempts,
+                        results[i].no_reply);
+        }
+    }
+
+    return found;
+}
+
+/**
+ * @brief Worst priority class still admitted (call with s_lock held).
+ *
+ * Background work goes first when heap runs low or the mesh stack recently ran
+ * out of advertising buffers; interactive updates follow when the shortage is
+ * severe. State changes are always admitted.
+ */
+static mesh_tx_prio_t admit_limit(TickType_t now)
+{
+    uint32_t free_heap = esp_get_free_heap_size();
+    bool congested = s_congestion > 0 && !tick_reached(now, s_congested_until);
+
+    if (!congested) {
+        s_congestion = 0;
+    }
+    if (free_heap < SHED_FREE_HEAP / 2 || s_congestion >= CONGESTION_SEVERE) {
+        return MESH_TX_PRIO_STATE;
+    }
+    if (free_heap < SHED_FREE_HEAP || congested) {
+        return MESH_TX_PRIO_INTERACTIVE;
+    }
+    return MESH_TX_PRIO_BACKGROUND;
+}
+
+/**
+ * @brief Frees the newest queued command of a worse class than @p prio to make
+ *        room for a more urgent one (call with s_lock held).
+ *
+ * @return The freed slot index, or -1 if every queued command is at least as urgent.
+ */
+static int slots_evict(mesh_tx_prio_t prio)
+{
+    int victim = -1;
+
+    for (int i = 0; i < MESH_TX_QUEUE_LEN; i++) {
+        if (!s_slots[i].pending || s_slots[i].prio <= prio) {
+            continue;
+        }
+        if (victim < 0 || s_slots[i].prio > s_slots[victim].prio ||
+            (s_slots[i].prio == s_slots[victim].prio && seq_before(s_slots[victim].seq, s_slots[i].seq))) {
+            victim = i;
+        }
+    }
+    if (victim >= 0) {
+        s_slots[victim].pending = false;
+        s_shed[s_slots[victim].prio]++;
+    }
+    return victim;
+}
+
+static void mesh_tx_task(void *arg)
+{
+    mesh_tx_cmd_t cmd;
+
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, inflight_next_wakeup(xTaskGetTickCount()));
+
+        while (tx_take_next(&cmd)) {
+            mesh_core_send(&cmd);
+            // While we wait, newer values overwrite the queued ones in place.
+            // A congested stack gets twice the gap to drain its buffers.
+            TickType_t gap = pdMS_TO_TICKS(MESH_TX_INTERVAL_MS);
+            xSemaphoreTake(s_lock, portMAX_DELAY);
+            if (s_congestion > 0 && !tick_reached(xTaskGetTickCount(), s_congested_until)) {
+                gap *= 2;
+            }
+            xSemaphoreGive(s_lock);
+            vTaskDelay(gap);
+        }
+    }
+}
+
+static void inflight_update(uint16_t addr, mesh_msg_type_t type, inflight_state_t state, bool no_reply)
+{
+    if (s_task == NULL) {
+        return;
+    }
+
+    bool changed = false;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    inflight_t *e = inflight_find(addr);
+    if (e != NULL && e->state == INFLIGHT_WAITING && e->cmd.type == type) {
+        e->state = state;
+        e->no_reply |= no_reply;
+        changed = true;
+    }
+    xSemaphoreGive(s_lock);
+
+    if (changed) {
+        xTaskNotifyGive(s_task);
+    }
+}
+
+/* --- Public API --- */
+
+esp_err_t mesh_tx_init(void)
+{
+    if (s_task != NULL) {
+        return ESP_OK;
+    }
+
+    s_lock = xSemaphoreCreateMutex();
+    if (s_lock == NULL) {
+        ESP_LOGE(TAG, "Failed to create queue lock");
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (xTaskCreate(mesh_tx_task, "mesh_tx", MESH_TX_TASK_STACK, NULL,
+                    MESH_TX_TASK_PRIO, &s_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create TX task");
+        s_task = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_LOGI(TAG, "TX queue started: %d slots, %d ms interval, ack window %d",
+             MESH_TX_QUEUE_LEN, MESH_TX_INTERVAL_MS, ACK_WINDOW);
+    return ESP_OK;
+}
+
+void mesh_tx_set_result_cb(mesh_tx_result_cb_t cb)
+{
+    s_result_cb = cb;
+}
+
+void mesh_tx_on_status(uint16_t addr, mesh_msg_type_t type)
+{
+    inflight_update(addr, type, INFLIGHT_ACKED, false);
+}
+
+void mesh_tx_on_timeout(uint16_t addr, mesh_msg_type_t type)
+{
+    inflight_update(addr, type, INFLIGHT_TIMED_OUT, true);
+}
+
+void mesh_tx_on_send_failed(uint16_t addr, mesh_msg_type_t type, int err)
+{
+    // Retried like a timeout, but the lamp is not to blame
+    inflight_update(addr, type, INFLIGHT_TIMED_OUT, false);
+
+    if (s_task == NULL || err != -ENOBUFS) {
+        return;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_congestion < UINT8_MAX) {
+        s_congestion++;
+    }
+    s_congested_until = xTaskGetTickCount() + pdMS_TO_TICKS(CONGESTION_HOLD_MS);
+    xSemaphoreGive(s_lock);
+
+    ESP_LOGW(TAG, "Mesh stack out of buffers (0x%04X), shedding low-priority commands", addr);
+}
+
+esp_err_t mesh_tx_submit_prio(const mesh_tx_cmd_t *cmd, mesh_tx_prio_t prio)
+{
+    if (s_task == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (prio >= MESH_TX_PRIO_COUNT) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    int match = -1;
+    int free_slot = -1;
+    bool newer_for_addr = false;
+    bool shed = false;
+    esp_err_t err = ESP_OK;
+    TickType_t now = xTaskGetTickCount();
+    TickType_t deadline = now + pdMS_TO_TICKS(s_deadline_ms[prio]);
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < MESH_TX_QUEUE_LEN; i++) {
+        if (!s_slots[i].pending) {
+            if (free_slot < 0) {
+                free_slot = i;
+            }
+            continue;
+        }
+        if (s_slots[i].cmd.addr != cmd->addr) {
+            continue;
+        }
+        if (s_slots[i].cmd.type == cmd->type && s_slots[i].cmd.get == cmd->get) {
+            match = i;
+        }
+    }
+
+    if (match >= 0) {
+        // Keep the queue position unless another command for this destination
+        // was queued after it; then move to the back so the order in which the
+        // lamp sees OnOff/Lightness/HSL matches the order they were requested.
+        for (int i = 0; i < MESH_TX_QUEUE_LEN; i++) {
+            if (i != match && s_slots[i].pending && s_slots[i].cmd.addr == cmd->addr &&
+                seq_before(s_slots[match].seq, s_slots[i].seq)) {
+                newer_for_addr = true;
+                break;
+            }
+        }
+        // Replacing a queued value costs nothing, so it is never shed
+        s_slots[match].cmd = *cmd;
+        if (prio < s_slots[match].prio) {
+            s_slots[match].prio = prio;
+        }
+        s_slots[match].deadline = deadline;
+        if (newer_for_addr) {
+            s_slots[match].seq = s_next_seq++;
+        }
+        s_coalesced++;
+    } else if (prio > admit_limit(now)) {
+        s_shed[prio]++;
+        shed = true;
+        err = ESP_ERR_NO_MEM;
+    } else {
+        if (free_slot < 0) {
+            free_slot = slots_evict(prio);
+        }
+        if (free_slot >= 0) {
+            s_slots[free_slot].cmd = *cmd;
+            s_slots[free_slot].prio = prio;
+            s_slots[free_slot].seq = s_next_seq++;
+            s_slots[free_slot].deadline = deadline;
+            s_slots[free_slot].pending = true;
+        } else {
+            err = ESP_ERR_NO_MEM;
+        }
+    }
+    xSemaphoreGive(s_lock);
+
+    if (shed) {
+        ESP_LOGD(TAG, "Shedding class %d command for 0x%04X (total %" PRIu32 ")",
+                 prio, cmd->addr, s_shed[prio]);
+        return err;
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "TX queue full, dropping command for 0x%04X", cmd->addr);
+        return err;
+    }
+    if (match >= 0) {
+        ESP_LOGD(TAG, "Coalesced command for 0x%04X (total %" PRIu32 ")", cmd->addr, s_coalesced);
+    }
+
+    xTaskNotifyGive(s_task);
+    return ESP_OK;
+}
+
+esp_err_t mesh_tx_submit(const mesh_tx_cmd_t *cmd)
+{
+    if (cmd->get) {
+        return mesh_tx_submit_prio(cmd, MESH_TX_PRIO_BACKGROUND);
+    }
+    return mesh_tx_submit_prio(cmd, cmd->type == MESH_MSG_ONOFF ? MESH_TX_PRIO_STATE
+                                                                 : MESH_TX_PRIO_INTERACTIVE);
+}
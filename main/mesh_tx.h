@@ -0,0 +1,112 @@
+#ifndef MESH_TX_H
+#define MESH_TX_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mesh_codec.h"
+
+/**
+ * @brief An outbound mesh command. Each destination holds at most one queued
+ *        Set and one Get per message type; a newer one replaces it.
+ *        With ack set, a Set is retried until the lamp's status arrives. Get
+ *        replies are left to the caller to track.
+ */
+typedef mesh_msg_t mesh_tx_cmd_t;
+
+/**
+ * @brief Scheduling class of a command. Lower classes go on air first, and
+ *        higher ones are refused first when the gateway is overloaded.
+ *        Each class has its own deadline (menuconfig) after which a queued
+ *        command is dropped.
+ */
+typedef enum {
+    MESH_TX_PRIO_STATE = 0,     // On/off changes
+    MESH_TX_PRIO_INTERACTIVE,   // Brightness and colour
+    MESH_TX_PRIO_BACKGROUND,    // Polling and resync
+    MESH_TX_PRIO_COUNT,
+} mesh_tx_prio_t;
+
+/**
+ * @brief Called from the TX task when an acknowledged command completes.
+ *
+ * @param addr Destination address.
+ * @param type Message type of the command.
+ * @param delivered true if the lamp replied with a status, false if all retries failed.
+ * @param attempts Number of transmissions made.
+ * @param no_reply The command was not delivered and at least one attempt went
+ *                 out but got no status, rather than all failing in the stack.
+ */
+typedef void (*mesh_tx_result_cb_t)(uint16_t addr, mesh_msg_type_t type, bool delivered, uint8_t attempts,
+                                    bool no_reply);
+
+/**
+ * @brief Creates the command queue and starts the TX task that drains it.
+ *
+ * Must be called once after the BLE Mesh stack has been initialized.
+ *
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the task or lock could not be created.
+ */
+esp_err_t mesh_tx_init(void);
+
+/**
+ * @brief Queues a command for transmission ("latest value wins").
+ *
+ * If a command of the same type is already waiting for the same destination,
+ * its value is overwritten and only the newest value goes on air. Otherwise
+ * the command needs a free slot; a full queue makes room by dropping the
+ * newest command of a lower class. Under memory pressure or when the mesh
+ * stack is short of advertising buffers, new background and then interactive
+ * commands are refused.
+ *
+ * @param cmd The command to queue. Copied, may live on the caller's stack.
+ * @param prio Scheduling class.
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the queue is full or the
+ *         command was shed, ESP_ERR_INVALID_STATE if mesh_tx_init() has not run.
+ */
+esp_err_t mesh_tx_submit_prio(const mesh_tx_cmd_t *cmd, mesh_tx_prio_t prio);
+
+/**
+ * @brief mesh_tx_submit_prio() with the class derived from the message:
+ *        OnOff is a state change, Gets are background work, everything else
+ *        is interactive.
+ */
+esp_err_t mesh_tx_submit(const mesh_tx_cmd_t *cmd);
+
+/**
+ * @brief Registers the handler for delivery results of acknowledged commands.
+ */
+void mesh_tx_set_result_cb(mesh_tx_result_cb_t cb);
+
+/**
+ * @brief Reports a status reply to an acknowledged Set. Safe to call from the
+ *        BLE Mesh client callbacks.
+ *
+ * @param addr Address the status came from.
+ * @param type Message type of the Set the status answers.
+ */
+void mesh_tx_on_status(uint16_t addr, mesh_msg_type_t type);
+
+/**
+ * @brief Reports that the mesh stack gave up waiting for a status. Safe to call
+ *        from the BLE Mesh client callbacks.
+ *
+ * @param addr Destination of the timed-out Set.
+ * @param type Message type of the timed-out Set.
+ */
+void mesh_tx_on_timeout(uint16_t addr, mesh_msg_type_t type);
+
+/**
+ * @brief Reports that the mesh stack failed to send a message. An
+ *        acknowledged Set is retried like a timed-out one, and a buffer
+ *        shortage (-ENOBUFS) makes the queue shed low-priority work for a
+ *        while. Safe to call from the BLE Mesh callbacks.
+ *
+ * @param addr Destination of the failed message.
+ * @param type Message type of the failed message.
+ * @param err Error code from the stack.
+ */
+void mesh_tx_on_send_failed(uint16_t addr, mesh_msg_type_t type, int err);
+
+#endif /* MESH_TX_H */
@@ -0,0 +1,231 @@
+/*
+ * mqtt_pub.c - Non-blocking MQTT publishing
+ *
+ * esp_mqtt_client_publish() writes to the socket in the caller's task and
+ * can block for as long as the network is slow. Producers (state_pub,
+ * lamp_health, delivery results of the TX task) therefore only copy their
+ * message into a small fixed queue, and a publisher task hands them to the
+ * client's outbox with esp_mqtt_client_enqueue(), from where the MQTT task
+ * sends them.
+ *
+ * While the outbox holds more than CONFIG_MQTT_PUB_OUTBOX_MAX the publisher
+ * waits, and the queue absorbs the backlog: a new state for a topic replaces
+ * the one still queued, and when the queue is full the oldest message that is
+ * not retained is dropped, counted and reported to the drop callback.
+ * Retained messages (availability) are never dropped; if the queue holds
+ * nothing else, the new message is refused.
+ */
+
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+#include "fnv_hash.h"
+#include "mqtt_pub.h"
+#include "mqtt_routes.h"
+
+#define TAG "MQTT_PUB"
+
+#define PUB_QUEUE_LEN       CONFIG_MQTT_PUB_QUEUE_LEN
+#define PUB_OUTBOX_MAX      CONFIG_MQTT_PUB_OUTBOX_MAX
+#define PUB_TOPIC_LEN       (MQTT_ROUTE_TOPIC_LEN + sizeof("availability"))
+#define PUB_PAYLOAD_LEN     128
+#define PUB_BACKOFF_MS      50
+#define PUB_TASK_STACK      3072
+#define PUB_TASK_PRIO       4
+
+typedef struct {
+    uint32_t topic_hash;
+    uint32_t seq;               // Changes when a coalesced message is replaced
+    uint8_t qos;
+    bool retain;
+    bool coalesce;
+    char topic[PUB_TOPIC_LEN];
+    char payload[PUB_PAYLOAD_LEN];
+} pub_msg_t;
+
+static pub_msg_t s_queue[PUB_QUEUE_LEN];
+static int s_head = 0;          // Oldest message
+static int s_count = 0;
+static uint32_t s_seq = 0;
+static uint32_t s_dropped = 0;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t s_task = NULL;
+static esp_mqtt_client_handle_t s_client = NULL;
+static mqtt_pub_drop_cb_t s_drop_cb = NULL;
+
+static void publisher_task(void *arg)
+{
+    TickType_t wait = portMAX_DELAY;
+
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, wait);
+        wait = portMAX_DELAY;
+
+        for (;;) {
+            pub_msg_t msg;
+            esp_mqtt_client_handle_t client;
+
+            portENTER_CRITICAL(&s_lock);
+            bool have = s_count > 0;
+            if (have) {
+                msg = s_queue[s_head];
+            }
+            client = s_client;
+            portEXIT_CRITICAL(&s_lock);
+
+            if (!have) {
+                break;
+            }
+            // Backpressure: keep the backlog here, where it coalesces
+            if (client == NULL || esp_mqtt_client_get_outbox_size(client) > PUB_OUTBOX_MAX) {
+                wait = pdMS_TO_TICKS(PUB_BACKOFF_MS);
+                break;
+            }
+            if (esp_mqtt_client_enqueue(client, msg.topic, msg.payload, 0, msg.qos, msg.retain, true) < 0) {
+                ESP_LOGW(TAG, "Could not enqueue %s", msg.topic);
+            }
+
+            portENTER_CRITICAL(&s_lock);
+            // Replaced in the meantime: the new value still has to go out
+            if (s_count > 0 && s_queue[s_head].seq == msg.seq) {
+                s_head = (s_head + 1) % PUB_QUEUE_LEN;
+                s_count--;
+            }
+            portEXIT_CRITICAL(&s_lock);
+        }
+    }
+}
+
+/**
+ * @brief Removes the oldest message that is not retained and copies its topic
+ *        to @p topic. Call with s_lock held.
+ *
+ * @return false if every queued message is retained.
+ */
+static bool queue_drop_oldest(char *topic)
+{
+    for (int n = 0; n < s_count; n++) {
+        if (s_queue[(s_head + n) % PUB_QUEUE_LEN].retain) {
+            continue;
+        }
+        memcpy(topic, s_queue[(s_head + n) % PUB_QUEUE_LEN].topic, PUB_TOPIC_LEN);
+        // Close the gap from the head side, where it is usually short. The
+        // message the publisher task is sending stays at the head.
+        for (; n > 0; n--) {
+            s_queue[(s_head + n) % PUB_QUEUE_LEN] = s_queue[(s_head + n - 1) % PUB_QUEUE_LEN];
+        }
+        s_head = (s_head + 1) % PUB_QUEUE_LEN;
+        s_count--;
+        return true;
+    }
+    return false;
+}
+
+/* --- Public API --- */
+
+esp_err_t mqtt_pub_init(void)
+{
+    if (s_task != NULL) {
+        return ESP_OK;
+    }
+    if (xTaskCreate(publisher_task, "mqtt_pub", PUB_TASK_STACK, NULL,
+                    PUB_TASK_PRIO, &s_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create publisher task");
+        s_task = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void mqtt_pub_set_drop_cb(mqtt_pub_drop_cb_t cb)
+{
+    s_drop_cb = cb;
+}
+
+void mqtt_pub_set_client(esp_mqtt_client_handle_t client)
+{
+    portENTER_CRITICAL(&s_lock);
+    s_client = client;
+    portEXIT_CRITICAL(&s_lock);
+
+    if (s_task != NULL) {
+        xTaskNotifyGive(s_task);
+    }
+}
+
+bool mqtt_pub_post(const char *topic, const char *payload, int qos, bool retain, bool coalesce)
+{
+    size_t topic_len = strlen(topic);
+    size_t payload_len = strlen(payload);
+    uint32_t hash = fnv_hash_str(topic);
+    bool dropped = false;
+    bool refused = false;
+    char dropped_topic[PUB_TOPIC_LEN];
+    uint32_t drops;
+
+    if (s_task == NULL || topic_len >= PUB_TOPIC_LEN || payload_len >= PUB_PAYLOAD_LEN) {
+        ESP_LOGE(TAG, "Cannot queue message for %s", topic);
+        return false;
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    pub_msg_t *msg = NULL;
+    if (coalesce) {
+        for (int n = 0; n < s_count; n++) {
+            pub_msg_t *m = &s_queue[(s_head + n) % PUB_QUEUE_LEN];
+            if (m->coalesce && m->topic_hash == hash && strcmp(m->topic, topic) == 0) {
+                msg = m;
+                break;
+            }
+        }
+    }
+    if (msg == NULL && s_count == PUB_QUEUE_LEN) {
+        if (queue_drop_oldest(dropped_topic)) {
+            s_dropped++;
+            dropped = true;
+        } else {
+            refused = true;
+        }
+    }
+    if (msg == NULL && !refused) {
+        msg = &s_queue[(s_head + s_count) % PUB_QUEUE_LEN];
+        s_count++;
+        memcpy(msg->topic, topic, topic_len + 1);
+        msg->topic_hash = hash;
+        msg->coalesce = coalesce;
+    }
+    if (msg != NULL) {
+        memcpy(msg->payload, payload, payload_len + 1);
+        msg->qos = (uint8_t)qos;
+        msg->retain = retain;
+        msg->seq = ++s_seq;
+    }
+    drops = s_dropped;
+    portEXIT_CRITICAL(&s_lock);
+
+    if (refused) {
+        ESP_LOGW(TAG, "Queue full of retained messages, %s not queued", topic);
+        return false;
+    }
+    if (dropped) {
+        ESP_LOGW(TAG, "Queue full, dropped %s (%lu dropped so far)", dropped_topic, (unsigned long)drops);
+        if (s_drop_cb != NULL) {
+            s_drop_cb(dropped_topic);
+        }
+    }
+    xTaskNotifyGive(s_task);
+    return true;
+}
+
+uint32_t mqtt_pub_dropped(void)
+{
+    uint32_t dropped;
+
+    portENTER_CRITICAL(&s_lock);
+    dropped = s_dropped;
+    portEXIT_CRITICAL(&s_lock);
+    return dropped;
+}
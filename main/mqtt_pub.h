@@ -0,0 +1,57 @@
+#ifndef MQTT_PUB_H
+#define MQTT_PUB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "mqtt_client.h"
+
+/**
+ * @brief Told about a message dropped from the full queue. Called from the
+ *        task that posted the message which took its place.
+ */
+typedef void (*mqtt_pub_drop_cb_t)(const char *topic);
+
+/**
+ * @brief Creates the publisher task that hands queued messages to the MQTT
+ *        client.
+ *
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the task could not be created.
+ */
+esp_err_t mqtt_pub_init(void);
+
+/**
+ * @brief Sets the client messages are published through (NULL while there is none).
+ */
+void mqtt_pub_set_client(esp_mqtt_client_handle_t client);
+
+/**
+ * @brief Sets the callback for dropped messages (NULL for none).
+ */
+void mqtt_pub_set_drop_cb(mqtt_pub_drop_cb_t cb);
+
+/**
+ * @brief Queues a message for publishing without waiting on the network.
+ *
+ * Safe to call from any task, including the BLE Mesh callbacks. With
+ * @p coalesce, a message still queued for the same topic is replaced, so only
+ * the latest value goes out. A full queue drops its oldest message that is
+ * not retained, and refuses the new one if all are retained.
+ *
+ * @param topic Topic; copied.
+ * @param payload NUL-terminated payload; copied.
+ * @param qos MQTT QoS.
+ * @param retain MQTT retain flag.
+ * @param coalesce Replace a queued message for the same topic.
+ * @return false if the topic or payload is too long to queue, or the queue
+ *         is full of retained messages.
+ */
+bool mqtt_pub_post(const char *topic, const char *payload, int qos, bool retain, bool coalesce);
+
+/**
+ * @brief Number of messages dropped because the queue was full.
+ */
+uint32_t mqtt_pub_dropped(void);
+
+#endif /* MQTT_PUB_H */
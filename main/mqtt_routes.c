@@ -0,0 +1,158 @@
+/*
+ * mqtt_routes.c - Precomputed MQTT topics and lookups for lamps and groups
+ *
+ * Every light Home Assistant knows gets a route with its command and state
+ * topics formatted once, when the lamp or group list changes. Two hash
+ * indexes, one over the command topic and one over the name, resolve an
+ * incoming command or an outgoing state publication to its route without
+ * sscanf, snprintf or a linear strcmp scan. Commands for all routes arrive
+ * through one wildcard subscription; topics of other devices under the same
+ * prefix simply find no route.
+ *
+ * The web server rebuilds the routes while the MQTT, timer and publisher
+ * tasks look them up. A rebuild fills the table not in use and swaps it in
+ * under a spinlock; lookups copy the route out under the same lock.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+
+#include "fnv_hash.h"
+#include "mqtt_routes.h"
+
+#define TAG "MQTT_ROUTES"
+
+#define MAX_ROUTES (MAX_LAMPS + MAX_GROUPS + 1)  // + the all-lamps group
+#define ROUTE_INDEX_SIZE 64
+#define ROUTE_INDEX_EMPTY (-1)
+
+_Static_assert(ROUTE_INDEX_SIZE >= 2 * MAX_ROUTES, "route index too small");
+_Static_assert((ROUTE_INDEX_SIZE & (ROUTE_INDEX_SIZE - 1)) == 0, "route index size must be a power of two");
+
+typedef struct {
+    mqtt_route_t routes[MAX_ROUTES];
+    int count;
+    int8_t topic_index[ROUTE_INDEX_SIZE];
+    int8_t name_index[ROUTE_INDEX_SIZE];
+} route_table_t;
+
+static route_table_t s_tables[2];
+static route_table_t *s_active = &s_tables[0];  // Read under s_lock
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void index_insert(int8_t *index, uint32_t hash, int route)
+{
+    unsigned slot = hash & (ROUTE_INDEX_SIZE - 1);
+    while (index[slot] != ROUTE_INDEX_EMPTY) {
+        slot = (slot + 1) & (ROUTE_INDEX_SIZE - 1);
+    }
+    index[slot] = (int8_t)route;
+}
+
+static void add_route(route_table_t *t, const char *name, uint16_t addr, bool group)
+{
+    if (t->count >= MAX_ROUTES) {
+        return;
+    }
+
+    mqtt_route_t *r = &t->routes[t->count];
+    memset(r, 0, sizeof(*r));
+    strncpy(r->name, name, sizeof(r->name) - 1);
+    r->addr = addr;
+    r->group = group;
+    r->cmd_topic_len = (uint16_t)snprintf(r->cmd_topic, sizeof(r->cmd_topic),
+                                          MQTT_TOPIC_PREFIX "%s/set", r->name);
+    snprintf(r->state_topic, sizeof(r->state_topic), MQTT_TOPIC_PREFIX "%s/state", r->name);
+    r->topic_hash = fnv_hash(r->cmd_topic, r->cmd_topic_len);
+    r->name_hash = fnv_hash(r->name, strlen(r->name));
+
+    index_insert(t->topic_index, r->topic_hash, t->count);
+    index_insert(t->name_index, r->name_hash, t->count);
+    t->count++;
+}
+
+void mqtt_routes_rebuild(void)
+{
+    // Not read by anyone: lookups only use the active table
+    route_table_t *t = (s_active == &s_tables[0]) ? &s_tables[1] : &s_tables[0];
+
+    memset(t->topic_index, ROUTE_INDEX_EMPTY, sizeof(t->topic_index));
+    memset(t->name_index, ROUTE_INDEX_EMPTY, sizeof(t->name_index));
+    t->count = 0;
+
+    // Lamps first: a name lookup finds the lamp if a group should share its name
+    LampInfo lamps[MAX_LAMPS];
+    LampLabel labels[MAX_LAMPS];
+    int lamp_count = get_all_lamps(lamps, labels, MAX_LAMPS);
+    for (int i = 0; i < lamp_count; i++) {
+        add_route(t, labels[i].name, lamps[i].address, false);
+    }
+
+    GroupInfo groups[MAX_GROUPS];
+    int group_count = get_all_groups(groups, MAX_GROUPS);
+    for (int i = 0; i < group_count; i++) {
+        add_route(t, groups[i].name, groups[i].address, true);
+    }
+    if (lamp_count > 0) {
+        add_route(t, ALL_LAMPS_GROUP_NAME, ALL_LAMPS_GROUP_ADDR, true);
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    s_active = t;
+    portEXIT_CRITICAL(&s_lock);
+    ESP_LOGD(TAG, "Built %d routes", t->count);
+}
+
+bool mqtt_routes_by_topic(const char *topic, int len, mqtt_route_t *route)
+{
+    uint32_t hash = fnv_hash(topic, len);
+    unsigned slot = hash & (ROUTE_INDEX_SIZE - 1);
+    bool found = false;
+
+    portENTER_CRITICAL(&s_lock);
+    const route_table_t *t = s_active;
+    for (int probe = 0; probe < ROUTE_INDEX_SIZE; probe++) {
+        int8_t i = t->topic_index[slot];
+        if (i == ROUTE_INDEX_EMPTY || i >= t->count) {
+            break;
+        }
+        const mqtt_route_t *r = &t->routes[i];
+        if (r->topic_hash == hash && r->cmd_topic_len == len &&
+            memcmp(r->cmd_topic, topic, len) == 0) {
+            *route = *r;
+            found = true;
+            break;
+        }
+        slot = (slot + 1) & (ROUTE_INDEX_SIZE - 1);
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return found;
+}
+
+bool mqtt_routes_by_name(const char *name, mqtt_route_t *route)
+{
+    uint32_t hash = fnv_hash(name, strlen(name));
+    unsigned slot = hash & (ROUTE_INDEX_SIZE - 1);
+    bool found = false;
+
+    portENTER_CRITICAL(&s_lock);
+    const route_table_t *t = s_active;
+    for (int probe = 0; probe < ROUTE_INDEX_SIZE; probe++) {
+        int8_t i = t->name_index[slot];
+        if (i == ROUTE_INDEX_EMPTY || i >= t->count) {
+            break;
+        }
+        const mqtt_route_t *r = &t->routes[i];
+        if (r->name_hash == hash && strcmp(r->name, name) == 0) {
+            *route = *r;
+            found = true;
+            break;
+        }
+        slot = (slot + 1) & (ROUTE_INDEX_SIZE - 1);
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return found;
+}
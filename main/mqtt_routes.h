@@ -0,0 +1,57 @@
+#ifndef MQTT_ROUTES_H
+#define MQTT_ROUTES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lamp_nvs.h"
+
+#define MQTT_TOPIC_PREFIX "homeassistant/light/"
+// Subscription covering the command topic of every route
+#define MQTT_ROUTE_CMD_FILTER MQTT_TOPIC_PREFIX "+/set"
+// Longest topic a route holds: prefix, name and "/state" or "/set"
+#define MQTT_ROUTE_TOPIC_LEN (sizeof(MQTT_TOPIC_PREFIX) + MAX_LAMP_NAME_LEN + sizeof("/state"))
+
+/**
+ * @brief A Home Assistant light (lamp or group) and its precomputed topics.
+ */
+typedef struct {
+    char name[MAX_LAMP_NAME_LEN];
+    char cmd_topic[MQTT_ROUTE_TOPIC_LEN];      // homeassistant/light/<name>/set
+    char state_topic[MQTT_ROUTE_TOPIC_LEN];    // homeassistant/light/<name>/state
+    uint16_t cmd_topic_len;
+    uint16_t addr;              // Lamp unicast address or group address
+    bool group;
+    uint32_t topic_hash;
+    uint32_t name_hash;
+} mqtt_route_t;
+
+/**
+ * @brief Rebuilds the routes of all lamps, groups and the built-in all-lamps
+ *        group from the lamp storage. Call whenever the lamp or group list changes.
+ *
+ * Lookups from other tasks may run meanwhile; rebuilds themselves must come
+ * from one task at a time.
+ */
+void mqtt_routes_rebuild(void);
+
+/**
+ * @brief Resolves a command topic to its route without parsing it.
+ *
+ * @param topic Topic as received; need not be NUL-terminated.
+ * @param len Length of @p topic.
+ * @param[out] route Receives a copy of the route.
+ * @return false if no light has that topic.
+ */
+bool mqtt_routes_by_topic(const char *topic, int len, mqtt_route_t *route);
+
+/**
+ * @brief Finds the route of a lamp or group by name.
+ *
+ * @param name Name of the lamp or group.
+ * @param[out] route Receives a copy of the route.
+ * @return false if not found.
+ */
+bool mqtt_routes_by_name(const char *name, mqtt_route_t *route);
+
+#endif /* MQTT_ROUTES_H */
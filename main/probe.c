@@ -0,0 +1,249 @@
+/*
+ * probe.c - Learns which message types each lamp understands
+ *
+ * Composition Data would list a lamp's models, but reading it takes a Config
+ * Client and the lamp's device key, which stays with the provisioning app.
+ * A lamp only answers Gets for models bound to the application key, and those
+ * are exactly the models the gateway can drive, so the probe asks instead:
+ * HSL, then Light Lightness, then Generic Level and OnOff for lamps without
+ * either, and finally the Light Lightness Range for the brightness scale.
+ *
+ * A model is only taken as missing after several unanswered Gets, and a lamp
+ * that answers nothing at all keeps its configured capabilities, so a lamp
+ * that is switched off is not mistaken for a simpler one. The range is only
+ * asked for when the lamp's scale was left to the probe. The result is
+ * stored with the lamp, so each lamp is probed once.
+ */
+
+#include <string.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+
+#include "lamp_health.h"
+#include "lamp_nvs.h"
+#include "main.h"
+#include "mesh_tx.h"
+#include "probe.h"
+
+#define TAG "PROBE"
+
+#define PROBE_ATTEMPTS      3
+// Time a Get may take: queueing behind other traffic, then the stack's timeout
+#define PROBE_REPLY_MS      (2 * CONFIG_MESH_TX_ACK_TIMEOUT_MS + 1000)
+#define PROBE_IDLE_MS       30000   // Re-check for unprobed lamps and mesh readiness
+#define PROBE_TASK_STACK    3072
+#define PROBE_TASK_PRIO     2
+
+static TaskHandle_t s_task = NULL;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool s_waiting = false;
+static bool s_replied = false;  // s_reply holds the status waited for
+static uint16_t s_wait_addr;
+static mesh_msg_type_t s_wait_type;
+static mesh_core_status_t s_reply;
+// Lamps that answered nothing; skipped until the next probe_kick()
+static uint16_t s_silent[MAX_LAMPS];
+static int s_silent_count = 0;
+
+/**
+ * @brief Waits until probe_on_status() hands over the reply or the time is up.
+ *
+ * The task is also notified by probe_kick(), so a notification alone does
+ * not mean the lamp answered.
+ */
+static bool wait_reply(mesh_core_status_t *reply)
+{
+    TickType_t start = xTaskGetTickCount();
+    TickType_t timeout = pdMS_TO_TICKS(PROBE_REPLY_MS);
+    TickType_t elapsed = 0;
+    bool replied = false;
+
+    while (!replied && elapsed < timeout) {
+        ulTaskNotifyTake(pdTRUE, timeout - elapsed);
+        portENTER_CRITICAL(&s_lock);
+        replied = s_replied;
+        if (replied) {
+            *reply = s_reply;
+        }
+        portEXIT_CRITICAL(&s_lock);
+        elapsed = xTaskGetTickCount() - start;
+    }
+    return replied;
+}
+
+/**
+ * @brief Sends a Get and waits for its status, retrying a few times.
+ *
+ * @return true if the lamp answered; the status is copied to @p reply.
+ */
+static bool probe_get(uint16_t addr, mesh_msg_type_t type, mesh_core_status_t *reply)
+{
+    for (int attempt = 0; attempt < PROBE_ATTEMPTS; attempt++) {
+        portENTER_CRITICAL(&s_lock);
+        s_wait_addr = addr;
+        s_wait_type = type;
+        s_waiting = true;
+        s_replied = false;
+        portEXIT_CRITICAL(&s_lock);
+        ulTaskNotifyTake(pdTRUE, 0);
+
+        mesh_tx_cmd_t cmd = { .addr = addr, .type = type, .get = true };
+        if (mesh_tx_submit(&cmd) != ESP_OK) {
+            // Gateway busy; does not count as a missing model
+            attempt--;
+            vTaskDelay(pdMS_TO_TICKS(PROBE_REPLY_MS));
+            continue;
+        }
+        if (wait_reply(reply)) {
+            return true;
+        }
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    s_waiting = false;
+    portEXIT_CRITICAL(&s_lock);
+    return false;
+}
+
+static bool is_silent(uint16_t addr)
+{
+    bool silent = false;
+
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < s_silent_count && !silent; i++) {
+        silent = s_silent[i] == addr;
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return silent;
+}
+
+/**
+ * @brief Finds the next lamp to probe.
+ *
+ * @return true if there is one; it is copied to @p next.
+ */
+static bool next_unprobed(LampInfo *next)
+{
+    LampInfo lamps[MAX_LAMPS];
+    int lamp_count = get_all_lamps(lamps, NULL, MAX_LAMPS);
+    for (int i = 0; i < lamp_count; i++) {
+        if (!lamps[i].probed && lamps[i].address != 0 && !is_silent(lamps[i].address)) {
+            *next = lamps[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+static void probe_lamp(const LampInfo *lamp)
+{
+    uint16_t addr = lamp->address;
+    mesh_core_status_t reply;
+    uint8_t caps = 0;
+    uint16_t scaling = 0;
+
+    ESP_LOGI(TAG, "Probing 0x%04X", addr);
+    if (probe_get(addr, MESH_MSG_HSL, &reply)) {
+        caps = LAMP_CAPS_COLOR;
+    } else if (probe_get(addr, MESH_MSG_LIGHTNESS, &reply)) {
+        caps = LAMP_CAPS_DIMMABLE;
+    } else {
+        if (probe_get(addr, MESH_MSG_LEVEL, &reply)) {
+            caps |= LAMP_CAP_LEVEL;
+        }
+        if (probe_get(addr, MESH_MSG_ONOFF, &reply)) {
+            caps |= LAMP_CAP_ONOFF;
+        }
+    }
+
+    if (caps == 0) {
+        ESP_LOGW(TAG, "No answer from 0x%04X, capabilities left as configured", addr);
+        lamp_health_on_miss(addr);
+        portENTER_CRITICAL(&s_lock);
+        if (s_silent_count < MAX_LAMPS) {
+            s_silent[s_silent_count++] = addr;
+        }
+        portEXIT_CRITICAL(&s_lock);
+        return;
+    }
+
+    if (lamp->auto_scaling && (caps & LAMP_CAP_LIGHTNESS) && probe_get(addr, MESH_MSG_LIGHTNESS_RANGE, &reply) &&
+        reply.range.status_code == 0 && reply.range.max > 0) {
+        scaling = reply.range.max;
+    }
+
+    ESP_LOGI(TAG, "0x%04X: caps 0x%02X, lightness range max %u", addr, caps, scaling);
+    if (set_lamp_probe_result(addr, caps, scaling) == ESP_OK) {
+        // Brightness and colour support may have changed
+        publish_ha_discovery_messages();
+    }
+}
+
+static void probe_task(void *arg)
+{
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(PROBE_IDLE_MS));
+        if (!mesh_core_is_ready()) {
+            continue;
+        }
+
+        LampInfo lamp;
+        while (next_unprobed(&lamp)) {
+            probe_lamp(&lamp);
+        }
+    }
+}
+
+/* --- Public API --- */
+
+esp_err_t probe_init(void)
+{
+#if CONFIG_MESH_PROBE_CAPS
+    if (s_task != NULL) {
+        return ESP_OK;
+    }
+    if (xTaskCreate(probe_task, "probe", PROBE_TASK_STACK, NULL,
+                    PROBE_TASK_PRIO, &s_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create probe task");
+        s_task = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+    return ESP_OK;
+}
+
+void probe_kick(void)
+{
+    if (s_task == NULL) {
+        return;
+    }
+    portENTER_CRITICAL(&s_lock);
+    s_silent_count = 0;
+    portEXIT_CRITICAL(&s_lock);
+    xTaskNotifyGive(s_task);
+}
+
+void probe_on_status(const mesh_core_status_t *status)
+{
+    bool match;
+
+    if (s_task == NULL) {
+        return;
+    }
+    portENTER_CRITICAL(&s_lock);
+    match = s_waiting && status->addr == s_wait_addr && status->type == s_wait_type;
+    if (match) {
+        s_reply = *status;
+        s_waiting = false;
+        s_replied = true;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (match) {
+        xTaskNotifyGive(s_task);
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include "esp_err.h"
+
+#include "mesh_core.h"
+
+/**
+ * @brief Creates the probe task, which reads the capabilities and lightness
+ *        range of every lamp not probed yet, one lamp at a time.
+ *
+ * Does nothing when CONFIG_MESH_PROBE_CAPS is off. Must be called after
+ * mesh_tx_init().
+ *
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the task could not be created.
+ */
+esp_err_t probe_init(void);
+
+/**
+ * @brief Wakes the probe task, e.g. after a lamp was added or its address
+ *        changed. Lamps that did not answer before are tried again.
+ */
+void probe_kick(void);
+
+/**
+ * @brief Hands a status message to a running probe. Safe to call from the
+ *        BLE Mesh callbacks.
+ */
+void probe_on_status(const mesh_core_status_t *status);
+
+#endif /* PROBE_H */
@@ -0,0 +1,315 @@
+/*
+ * resync.c - Reads the lamps' state after a reboot or MQTT reconnect
+ *
+ * Without it, Home Assistant shows whatever it last saw until a lamp happens to
+ * report. Every configured lamp gets a single Get for the richest state it
+ * has (HSL for colour lamps, which also carries lightness and thus on/off,
+ * then Light Lightness, Generic Level, Generic OnOff), unless its cached
+ * state is recent enough.
+ *
+ * The task keeps a few Gets in flight and spaces them with jitter, so a
+ * resync of many lamps neither floods the mesh nor waits on one slow lamp.
+ * Gets are queued as background traffic in mesh_tx and never delay commands.
+ * A pass over all lamps is spaced to take at most half of the time budget;
+ * the rest is left for retrying lamps that did not answer, with backoff. The
+ * resync stops when the budget is used up.
+ */
+
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+
+#include "lamp_health.h"
+#include "lamp_nvs.h"
+#include "lamp_state.h"
+#include "mesh_core.h"
+#include "mesh_tx.h"
+#include "resync.h"
+
+#define TAG "RESYNC"
+
+#define RESYNC_INFLIGHT      CONFIG_MESH_RESYNC_INFLIGHT
+#define RESYNC_GAP_MS        CONFIG_MESH_RESYNC_GAP_MS
+#define RESYNC_MAX_ATTEMPTS  (CONFIG_MESH_RESYNC_RETRIES + 1)
+#define RESYNC_BUDGET_MS     (CONFIG_MESH_RESYNC_BUDGET_S * 1000)
+#define RESYNC_FRESH_US      ((int64_t)CONFIG_MESH_RESYNC_FRESH_S * 1000000)
+#define RESYNC_MIN_GAP_MS    20
+#define RESYNC_BACKOFF_MS    2000
+// Time a Get may take: queueing behind other traffic, then the stack's timeout
+#define RESYNC_REPLY_MS      (2 * CONFIG_MESH_TX_ACK_TIMEOUT_MS + 1000)
+#define RESYNC_TASK_STACK    3072
+#define RESYNC_TASK_PRIO     3
+
+typedef enum {
+    ENTRY_PENDING = 0,
+    ENTRY_INFLIGHT,
+    ENTRY_BACKOFF,
+    ENTRY_DONE,
+    ENTRY_FAILED,
+} entry_state_t;
+
+typedef struct {
+    uint16_t addr;
+    mesh_msg_type_t type;
+    entry_state_t state;
+    uint8_t attempts;
+    TickType_t due;     // Reply deadline (INFLIGHT) or retry time (BACKOFF)
+} resync_entry_t;
+
+static resync_entry_t s_entries[MAX_LAMPS];
+static int s_count = 0;
+static bool s_running = false;
+static TickType_t s_started;
+static TickType_t s_gap;
+static SemaphoreHandle_t s_lock = NULL;
+static TaskHandle_t s_task = NULL;
+
+// Wrap-safe "tick t has been reached".
+static inline bool tick_reached(TickType_t now, TickType_t t)
+{
+    return (int32_t)(now - t) >= 0;
+}
+
+static TickType_t backoff_ticks(uint8_t attempts)
+{
+    uint32_t ms = RESYNC_BACKOFF_MS << (attempts - 1);
+    ms += esp_random() % (RESYNC_BACKOFF_MS / 2 + 1);
+    return pdMS_TO_TICKS(ms);
+}
+
+mesh_msg_type_t resync_get_type(uint8_t caps)
+{
+    if (caps & LAMP_CAP_HSL) {
+        return MESH_MSG_HSL;
+    }
+    if (caps & LAMP_CAP_LIGHTNESS) {
+        return MESH_MSG_LIGHTNESS;
+    }
+    if (caps & LAMP_CAP_LEVEL) {
+        return MESH_MSG_LEVEL;
+    }
+    return MESH_MSG_ONOFF;
+}
+
+/**
+ * @brief Ends the resync and logs the outcome (call with s_lock held).
+ */
+static void resync_finish(TickType_t now)
+{
+    int done = 0;
+    for (int i = 0; i < s_count; i++) {
+        if (s_entries[i].state == ENTRY_DONE) {
+            done++;
+        }
+    }
+    s_running = false;
+    ESP_LOGI(TAG, "Resync finished in %" PRIu32 " ms: %d of %d lamps answered",
+             (uint32_t)pdTICKS_TO_MS(now - s_started), done, s_count);
+}
+
+/**
+ * @brief Advances timeouts and picks the next lamp to query (call with s_lock held).
+ *
+ * @return Index of the entry to send a Get for, or -1.
+ */
+static int resync_step(TickType_t now)
+{
+    int inflight = 0;
+    int retry = -1;
+    int pending = -1;
+    bool open = false;
+
+    for (int i = 0; i < s_count; i++) {
+        resync_entry_t *e = &s_entries[i];
+
+        if (e->state == ENTRY_INFLIGHT && tick_reached(now, e->due)) {
+            if (e->attempts < RESYNC_MAX_ATTEMPTS) {
+                e->state = ENTRY_BACKOFF;
+                e->due = now + backoff_ticks(e->attempts);
+            } else {
+                ESP_LOGW(TAG, "No state from 0x%04X after %d Gets", e->addr, e->attempts);
+                e->state = ENTRY_FAILED;
+                lamp_health_on_miss(e->addr);
+            }
+        }
+
+        switch (e->state) {
+        case ENTRY_INFLIGHT:
+            inflight++;
+            open = true;
+            break;
+        case ENTRY_PENDING:
+            open = true;
+            if (pending < 0) {
+                pending = i;
+            }
+            break;
+        case ENTRY_BACKOFF:
+            open = true;
+            if (retry < 0 && tick_reached(now, e->due)) {
+                retry = i;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (!open || tick_reached(now, s_started + pdMS_TO_TICKS(RESYNC_BUDGET_MS))) {
+        resync_finish(now);
+        return -1;
+    }
+    if (inflight >= RESYNC_INFLIGHT) {
+        return -1;
+    }
+    // Due retries first, then the lamps in list order
+    return retry >= 0 ? retry : pending;
+}
+
+static void resync_task(void *arg)
+{
+    for (;;) {
+        TickType_t wait = portMAX_DELAY;
+
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        if (s_running) {
+            // Up to a quarter of jitter either way keeps lamps from lining up
+            TickType_t jitter = s_gap / 4;
+            wait = s_gap - jitter + (jitter ? esp_random() % (2 * jitter + 1) : 0);
+        }
+        xSemaphoreGive(s_lock);
+
+        ulTaskNotifyTake(pdTRUE, wait);
+
+        TickType_t now = xTaskGetTickCount();
+        mesh_tx_cmd_t cmd = { .get = true };
+        int next;
+
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        next = s_running ? resync_step(now) : -1;
+        if (next >= 0) {
+            cmd.addr = s_entries[next].addr;
+            cmd.type = s_entries[next].type;
+        }
+        xSemaphoreGive(s_lock);
+
+        if (next < 0) {
+            continue;
+        }
+        // Refused when the gateway is busy; the lamp is tried again next round
+        if (mesh_tx_submit(&cmd) != ESP_OK) {
+            continue;
+        }
+
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        resync_entry_t *e = &s_entries[next];
+        if (s_running && e->addr == cmd.addr && e->state != ENTRY_DONE) {
+            e->state = ENTRY_INFLIGHT;
+            e->attempts++;
+            e->due = now + pdMS_TO_TICKS(RESYNC_REPLY_MS);
+        }
+        xSemaphoreGive(s_lock);
+    }
+}
+
+/* --- Public API --- */
+
+esp_err_t resync_init(void)
+{
+    if (s_task != NULL) {
+        return ESP_OK;
+    }
+
+    s_lock = xSemaphoreCreateMutex();
+    if (s_lock == NULL) {
+        ESP_LOGE(TAG, "Failed to create resync lock");
+        return ESP_ERR_NO_MEM;
+    }
+    if (xTaskCreate(resync_task, "resync", RESYNC_TASK_STACK, NULL,
+                    RESYNC_TASK_PRIO, &s_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create resync task");
+        s_task = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void resync_start(void)
+{
+    if (s_task == NULL) {
+        return;
+    }
+    if (!mesh_core_is_ready()) {
+        ESP_LOGI(TAG, "Mesh not provisioned yet, skipping resync");
+        return;
+    }
+
+    LampInfo lamps[MAX_LAMPS];
+    int lamp_count = get_all_lamps(lamps, NULL, MAX_LAMPS);
+    int64_t now_us = esp_timer_get_time();
+    int queued = 0;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    s_count = 0;
+    for (int i = 0; i < lamp_count && s_count < MAX_LAMPS; i++) {
+        uint16_t addr = lamps[i].address;
+        lamp_state_t st;
+
+        lamp_state_get(addr, &st);
+        if (st.last_seen_us != 0 && now_us - st.last_seen_us < RESYNC_FRESH_US) {
+            continue;
+        }
+        // Checked by lamp_health until it answers again
+        if (lamp_health_is_offline(addr)) {
+            continue;
+        }
+        s_entries[s_count++] = (resync_entry_t){
+            .addr = addr,
+            .type = resync_get_type(lamps[i].caps),
+            .state = ENTRY_PENDING,
+        };
+    }
+    queued = s_count;
+
+    // Spread the first pass over half the budget at most
+    uint32_t gap_ms = RESYNC_GAP_MS;
+    if (queued > 0 && gap_ms * queued > RESYNC_BUDGET_MS / 2) {
+        gap_ms = RESYNC_BUDGET_MS / 2 / queued;
+    }
+    if (gap_ms < RESYNC_MIN_GAP_MS) {
+        gap_ms = RESYNC_MIN_GAP_MS;
+    }
+    s_gap = pdMS_TO_TICKS(gap_ms);
+    s_started = xTaskGetTickCount();
+    s_running = queued > 0;
+    xSemaphoreGive(s_lock);
+
+    ESP_LOGI(TAG, "Resyncing %d of %d lamps, %" PRIu32 " ms apart", queued, lamp_count, gap_ms);
+    xTaskNotifyGive(s_task);
+}
+
+void resync_on_status(uint16_t addr)
+{
+    if (s_task == NULL) {
+        return;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_running) {
+        for (int i = 0; i < s_count; i++) {
+            if (s_entries[i].addr == addr) {
+                s_entries[i].state = ENTRY_DONE;
+                break;
+            }
+        }
+    }
+    xSemaphoreGive(s_lock);
+}
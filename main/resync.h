@@ -0,0 +1,44 @@
+#ifndef RESYNC_H
+#define RESYNC_H
+
+#include "esp_err.h"
+#include <stdint.h>
+
+#include "mesh_codec.h"
+
+/**
+ * @brief Creates the resync task. It stays idle until resync_start().
+ *
+ * Must be called after mesh_tx_init().
+ *
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the task or lock could not be created.
+ */
+esp_err_t resync_init(void);
+
+/**
+ * @brief Reads the state of every configured lamp whose cached state is not
+ *        recent, with a Get per lamp. Lamps known to be offline are left to
+ *        lamp_health.
+ *
+ * Gets go out as background traffic, a few at a time and spaced so a full
+ * pass fits in half of the configured time budget; lamps that do not answer
+ * are retried with backoff until the budget is used up. The replies update
+ * the state cache like any other status. A running resync is restarted.
+ */
+void resync_start(void);
+
+/**
+ * @brief Reports a status message from a lamp, which completes its resync.
+ *        Safe to call from the BLE Mesh callbacks.
+ */
+void resync_on_status(uint16_t addr);
+
+/**
+ * @brief The Get that returns the most state a lamp has: HSL carries
+ *        lightness and thus on/off as well.
+ *
+ * @param caps LAMP_CAP_* bits of the lamp.
+ */
+mesh_msg_type_t resync_get_type(uint8_t caps);
+
+#endif /* RESYNC_H */
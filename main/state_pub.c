@@ -0,0 +1,164 @@
+/*
+ * state_pub.c - Debounced, change-only publication of lamp state
+ *
+ * Status messages tend to come in bursts: an OnOff and a Lightness status for
+ * the same change, duplicate publications, replies to Gets that confirm what
+ * is already known. Each of them only marks the address; when the debounce
+ * window closes, one payload per marked address is built from the state cache
+ * and sent if it differs from the last one sent.
+ */
+
+#include <string.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "fnv_hash.h"
+#include "lamp_nvs.h"
+#include "lamp_state.h"
+#include "state_pub.h"
+
+#define TAG "STATE_PUB"
+
+#define STATE_PUB_SLOTS (MAX_LAMPS + MAX_GROUPS + 1)
+#define DEBOUNCE_US ((uint64_t)CONFIG_MQTT_STATE_DEBOUNCE_MS * 1000)
+
+typedef struct {
+    uint16_t addr;              // 0 = unused
+    bool pending;
+    bool published;             // hash is valid
+    uint32_t hash;              // Of the last payload sent
+    char name[MAX_LAMP_NAME_LEN];
+} pub_slot_t;
+
+static pub_slot_t s_slots[STATE_PUB_SLOTS];
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t s_timer = NULL;
+static state_pub_send_cb_t s_send = NULL;
+
+static void state_pub_flush(void *arg)
+{
+    for (int i = 0; i < STATE_PUB_SLOTS; i++) {
+        char name[MAX_LAMP_NAME_LEN];
+        uint16_t addr;
+
+        portENTER_CRITICAL(&s_lock);
+        bool pending = s_slots[i].pending;
+        s_slots[i].pending = false;
+        addr = s_slots[i].addr;
+        memcpy(name, s_slots[i].name, sizeof(name));
+        portEXIT_CRITICAL(&s_lock);
+
+        if (!pending) {
+            continue;
+        }
+
+        lamp_state_t st;
+        char payload[128];
+        lamp_state_get(addr, &st);
+        if (!st.on_known) {
+            continue;
+        }
+        if (lamp_state_to_json(&st, payload, sizeof(payload)) < 0) {
+            ESP_LOGE(TAG, "State of '%s' does not fit the payload buffer", name);
+            continue;
+        }
+        uint32_t hash = fnv_hash_str(payload);
+
+        portENTER_CRITICAL(&s_lock);
+        bool unchanged = s_slots[i].addr == addr && s_slots[i].published && s_slots[i].hash == hash;
+        if (!unchanged && s_slots[i].addr == addr) {
+            s_slots[i].published = true;
+            s_slots[i].hash = hash;
+        }
+        portEXIT_CRITICAL(&s_lock);
+
+        if (unchanged) {
+            ESP_LOGD(TAG, "State of '%s' unchanged, not published", name);
+            continue;
+        }
+        if (!s_send(name, payload)) {
+            state_pub_forget(addr);
+        }
+    }
+}
+
+esp_err_t state_pub_init(state_pub_send_cb_t send)
+{
+    s_send = send;
+
+    const esp_timer_create_args_t args = {
+        .callback = state_pub_flush,
+        .name = "state_pub",
+    };
+    esp_err_t err = esp_timer_create(&args, &s_timer);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create debounce timer (err %d)", err);
+    }
+    return err;
+}
+
+void state_pub_request(const char *name, uint16_t addr)
+{
+    if (s_timer == NULL) {
+        return;
+    }
+
+    pub_slot_t *slot = NULL;
+    pub_slot_t *free_slot = NULL;
+
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < STATE_PUB_SLOTS && slot == NULL; i++) {
+        if (s_slots[i].addr == addr) {
+            slot = &s_slots[i];
+        } else if (s_slots[i].addr == 0 && free_slot == NULL) {
+            free_slot = &s_slots[i];
+        }
+    }
+    if (slot == NULL && free_slot != NULL) {
+        slot = free_slot;
+        memset(slot, 0, sizeof(*slot));
+        slot->addr = addr;
+    }
+    if (slot != NULL) {
+        // A renamed lamp keeps its address; publish under the current name
+        if (strncmp(slot->name, name, sizeof(slot->name)) != 0) {
+            strncpy(slot->name, name, sizeof(slot->name) - 1);
+            slot->name[sizeof(slot->name) - 1] = '\0';
+            slot->published = false;
+        }
+        slot->pending = true;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (slot == NULL) {
+        ESP_LOGW(TAG, "No slot for 0x%04X, state not published", addr);
+        return;
+    }
+    if (!esp_timer_is_active(s_timer)) {
+        esp_timer_start_once(s_timer, DEBOUNCE_US);
+    }
+}
+
+void state_pub_forget(uint16_t addr)
+{
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < STATE_PUB_SLOTS; i++) {
+        if (s_slots[i].addr == addr) {
+            s_slots[i].published = false;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void state_pub_reset(void)
+{
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < STATE_PUB_SLOTS; i++) {
+        s_slots[i].published = false;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
@@ -0,0 +1,50 @@
+#ifndef STATE_PUB_H
+#define STATE_PUB_H
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Sends one state payload, e.g. to homeassistant/light/<name>/state.
+ *        Called from the esp_timer task.
+ *
+ * @return false if the payload was not queued for sending.
+ */
+typedef bool (*state_pub_send_cb_t)(const char *name, const char *payload);
+
+/**
+ * @brief Creates the debounce timer.
+ *
+ * @param send Publishes a payload; required.
+ * @return ESP_OK on success, or the error from esp_timer_create().
+ */
+esp_err_t state_pub_init(state_pub_send_cb_t send);
+
+/**
+ * @brief Schedules the cached state of a lamp or group for publication.
+ *
+ * Requests within the debounce window are merged into one payload built from
+ * the state cache when the window closes, and it is only sent if it differs
+ * from the last payload sent for that address. Safe to call from the BLE
+ * Mesh callbacks.
+ *
+ * @param name Lamp or group name (topic segment). Copied.
+ * @param addr Address whose cached state is published.
+ */
+void state_pub_request(const char *name, uint16_t addr);
+
+/**
+ * @brief Forgets what was published for one address, e.g. after its payload
+ *        was dropped before reaching the broker, so the next request for it
+ *        is sent even if unchanged.
+ */
+void state_pub_forget(uint16_t addr);
+
+/**
+ * @brief Forgets what was published, so the next request for every address
+ *        is sent even if unchanged. Call when the broker connection is new.
+ */
+void state_pub_reset(void);
+
+#endif /* STATE_PUB_H */